@@ -0,0 +1,519 @@
+// codec.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "entropy.hh"
+#include "shared.hh"
+
+// Compact particle frames, for streaming them to viewers and recording trajectories. See stream.hh and
+// trajectory.hh.
+//
+// Each field of a frame, the position, velocity, diameter and color, is quantized to integers on a grid per
+// component, so each value is within half a step of the original. The grid either has 2^bits steps spanning
+// the values, or steps of twice a tolerance, so that the error is at most the tolerance wherever the particles
+// go. A key frame chooses the grids around the values, with a margin, or with a tolerance in the middle of
+// 2^32 steps, and the frames after it use the same grids. Decoding rounds each value to a float, so with a
+// tolerance the steps are narrower by half a float ulp at twice the largest magnitude, and a value that grows
+// to near that magnitude leaves the grid. Each integer is sent as its change from a
+// prediction, zigzag encoded as a variable length integer. The prediction is the same particle's integer in
+// the previous frame, or if it was in the two frames before, the line through both, which follows a particle
+// moving steadily to within its acceleration. So most changes fit in a byte or two. In a key frame, and for
+// particles that are new, the prediction is the particle before. The integers are predicted exactly alike on
+// both ends.
+//
+// Merging removes particles and renumbers the rest, keeping their order, and new particles are added at the
+// end. So a frame lists the indices of the particles of the previous frame that are gone, and the rest match
+// the first particles of the frame in order. The encoder guesses which were removed by looking up to ALIGNMENT
+// particles ahead for the nearest position. A poor guess only costs bytes. A frame is a key frame when there's
+// no previous frame or a value left its grid.
+//
+// The changes may then be entropy coded, see entropy.hh, which mostly saves the bits of the zeroes and small
+// changes that varints round up to a byte.
+//
+// A message is a Header followed by, in a key frame, the origin and the step of each component's grid as
+// doubles. Then, in a delta frame, the number of particles removed and the gaps between their indices, and
+// the changes, component by component for every particle, all as varints, or an entropy block of them.
+// Little-endian.
+namespace codec {
+
+constexpr uint32_t MAGIC = 0x46565247;    // "GRVF"
+constexpr double MARGIN = 0.25;    // Of the range of each component, added at each end of its grid.
+constexpr double COLOR_TOLERANCE = 0.5/255.0;    // With tolerances, colors have 8 bits.
+constexpr size_t ALIGNMENT = 16;    // Particles the encoder looks ahead for a match after a merge.
+constexpr double SLACK = 1.0/(1 << 18);    // Of a tolerance, for the rounding of the doubles that place the grid.
+constexpr double MIN_TOLERANCE = std::numeric_limits<float>::epsilon();    // Below float resolution for any value over 1.
+
+enum Field : uint8_t {
+    position = 1,
+    velocity = 2,
+    diameter = 4,
+    color = 8,
+    ALL_FIELDS = 15,
+};
+
+constexpr std::array<Field, 4> FIELDS = {position, velocity, diameter, color};
+
+// A comma separated list such as "position,diameter", or "all".
+inline uint8_t fields_from_names(const std::string& names) {
+    if (names == "all")
+        return ALL_FIELDS;
+    uint8_t ret = 0;
+    std::istringstream in(names);
+    std::string name;
+    while (std::getline(in, name, ',')) {
+        if (name == "position") ret |= position;
+        else if (name == "velocity") ret |= velocity;
+        else if (name == "diameter") ret |= diameter;
+        else if (name == "color") ret |= color;
+        else throw std::runtime_error("unknown field: "+name);
+    }
+    return ret;
+}
+
+// How the frames of a stream or a trajectory are encoded.
+struct Settings {
+    uint8_t fields{ALL_FIELDS};
+    unsigned bits{16};    // Per component, when there's no tolerance.
+    double tolerance{0.0};    // The largest error of a position or a diameter. Replaces bits if set.
+    double velocity_tolerance{0.0};    // The largest error of a velocity, if not the tolerance.
+    bool entropy{false};    // Entropy code the changes.
+};
+
+// A tolerance of 0, for none, or one that decoded floats can keep for values of magnitude 1. The encoder can
+// still refuse one that's too fine for the range of the values it's given. See Encoder::choose_grid().
+inline bool valid_tolerance(double tolerance) {
+    return tolerance == 0.0 || (tolerance > MIN_TOLERANCE && std::isfinite(tolerance));
+}
+
+// Sets one name=value item, such as "fields=position", "bits=12", "tolerance=0.001", "velocity-tolerance=0.01"
+// or "entropy=1". Returns false if the name isn't one of these.
+inline bool parse_setting(const std::string& name, const std::string& value, Settings& settings) {
+    if (name == "fields") settings.fields = fields_from_names(value);
+    else if (name == "bits") settings.bits = std::stoul(value);
+    else if (name == "tolerance") settings.tolerance = std::stod(value);
+    else if (name == "velocity-tolerance") settings.velocity_tolerance = std::stod(value);
+    else if (name == "entropy") settings.entropy = std::stoul(value) != 0;
+    else return false;
+    if (settings.fields == 0 || settings.bits < 1 || settings.bits > 32 || !valid_tolerance(settings.tolerance) || !valid_tolerance(settings.velocity_tolerance))
+        throw std::runtime_error("bad "+name+": "+value);
+    return true;
+}
+
+// name=value items separated by spaces, such as a subscription or --record-settings. Each name is offered to
+// extra first, if given, which returns whether it took it, then to parse_setting().
+inline Settings parse_settings(const std::string& line, const std::function<bool(const std::string& name, const std::string& value)>& extra = nullptr) {
+    Settings ret;
+    std::istringstream in(line);
+    std::string item;
+    while (in >> item) {
+        const size_t equals = item.find('=');
+        const std::string name = item.substr(0, equals);
+        const std::string value = equals == std::string::npos ? "" : item.substr(equals+1);
+        try {
+            if (!(extra && extra(name, value)) && !parse_setting(name, value, ret))
+                throw std::runtime_error("unknown setting: "+name);
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("bad setting: "+item);
+        }
+    }
+    return ret;
+}
+
+#pragma pack(push, 1)
+struct Header {
+    uint32_t magic;
+    uint32_t bytes;    // After these first 8 bytes.
+    uint64_t frame;
+    double time;
+    uint32_t count;
+    uint8_t dimensions;
+    uint8_t fields;
+    uint8_t bits;
+    uint8_t key;
+    uint8_t entropy;
+};
+#pragma pack(pop)
+
+constexpr size_t PREFIX_BYTES = 8;    // The magic number and the length.
+
+// The components of the fields, in order: each axis of the position, then of the velocity, the diameter,
+// then red, green, blue and alpha.
+struct Component {
+    Field field;
+    unsigned index;
+};
+
+inline std::vector<Component> components(uint8_t fields, unsigned dimensions) {
+    std::vector<Component> ret;
+    for (Field field : FIELDS) {
+        if ((fields & field) == 0)
+            continue;
+        const unsigned count = field == diameter ? 1 : field == color ? 4 : dimensions;
+        for (unsigned k = 0; k < count; ++k)
+            ret.push_back({field, k});
+    }
+    return ret;
+}
+
+inline float& value(shared::Record& record, const Component& c) {
+    switch (c.field) {
+    case position: return record.position[c.index];
+    case velocity: return record.velocity[c.index];
+    case diameter: return record.diameter;
+    default: return record.color[c.index];
+    }
+}
+
+inline float value(const shared::Record& record, const Component& c) {
+    return value(const_cast<shared::Record&>(record), c);
+}
+
+// The integers of one frame, component by component, and the grids they're on.
+struct Quantized {
+    uint32_t count{0};
+    uint8_t dimensions{0};
+    uint8_t fields{0};
+    uint8_t bits{0};
+    std::vector<double> lo;    // Per component.
+    std::vector<double> step;
+    std::vector<double> limit;    // Only for the encoder: the magnitude a value must stay below to keep its tolerance.
+    std::vector<std::vector<uint32_t>> values;
+    std::vector<uint32_t> from;    // The index in the frame before of each of the first particles, if not a key frame.
+};
+
+// The prediction of a value of component c of the particle that was particle j of the previous frame.
+inline int64_t predict(const Quantized& previous, const std::optional<Quantized>& older, size_t c, uint32_t j) {
+    const int64_t last = previous.values[c][j];
+    if (!older || j >= previous.from.size())
+        return last;
+    return 2*last-older->values[c][previous.from[j]];
+}
+
+template <typename T>
+inline void put(std::vector<uint8_t>& out, const T& value) {
+    const size_t at = out.size();
+    out.resize(at+sizeof(T));
+    std::memcpy(out.data()+at, &value, sizeof(T));
+}
+
+template <typename T>
+inline T get(const uint8_t*& in, const uint8_t* end) {
+    if (end-in < static_cast<ptrdiff_t>(sizeof(T)))
+        throw std::runtime_error("truncated frame");
+    T ret;
+    std::memcpy(&ret, in, sizeof(T));
+    in += sizeof(T);
+    return ret;
+}
+
+inline void put_varint(std::vector<uint8_t>& out, int64_t delta) {
+    uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+    while (zigzag >= 0x80) {
+        out.push_back(static_cast<uint8_t>(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(zigzag));
+}
+
+inline int64_t get_varint(const uint8_t*& in, const uint8_t* end) {
+    uint64_t zigzag = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        if (in == end || shift > 63)
+            throw std::runtime_error("truncated frame");
+        const uint8_t byte = *in++;
+        zigzag |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            break;
+    }
+    return static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+}
+
+// The indices of the count particles of a frame that aren't removed, in order. removed is sorted.
+inline void survivors(size_t count, const std::vector<uint32_t>& removed, std::vector<uint32_t>& out) {
+    out.clear();
+    out.reserve(count-removed.size());
+    size_t r = 0;
+    for (uint32_t j = 0; j < count; ++j) {
+        if (r < removed.size() && removed[r] == j)
+            ++r;
+        else
+            out.push_back(j);
+    }
+}
+
+// Encodes the frames of one stream, each against the one before it.
+class Encoder {
+    Settings settings;
+    uint8_t bits;
+    std::optional<Quantized> previous;
+    std::optional<Quantized> older;    // The frame before the previous one.
+    std::vector<uint8_t> changes;    // Before they're entropy coded.
+    std::vector<uint32_t> removed;
+    std::vector<uint32_t> from;    // The previous frame's index of each particle that was in it.
+
+    inline double tolerance(Field field) const {
+        if (field == color)
+            return COLOR_TOLERANCE;
+        if (field == velocity && settings.velocity_tolerance > 0.0)
+            return settings.velocity_tolerance;
+        return settings.tolerance;
+    }
+
+    // Chooses the particles of the previous frame that are gone, and appends their indices to removed. Only
+    // looks for them when there are fewer particles than before, and without positions takes them from the end.
+    inline void align(const Quantized& next, std::vector<uint32_t>& removed) const {
+        const Quantized& before = *previous;
+        if (before.count <= next.count)
+            return;
+        const size_t gone = before.count-next.count;
+        const size_t axes = next.dimensions;    // The position components come first.
+        // How far particle i moved if it was particle j before.
+        auto distance = [&](size_t i, size_t j) {
+            if (i >= next.count || j >= before.count)
+                return std::numeric_limits<uint64_t>::max();
+            uint64_t ret = 0;
+            for (size_t c = 0; c < axes; ++c)
+                ret += static_cast<uint64_t>(std::abs(static_cast<int64_t>(next.values[c][i])-before.values[c][j]));
+            return ret;
+        };
+        size_t j = 0;
+        for (size_t i = 0; (settings.fields & position) && i < next.count && removed.size() < gone; ++i, ++j) {
+            size_t best = j;
+            uint64_t best_distance = distance(i, j);
+            const size_t last = std::min<size_t>(before.count-1, j+std::min(ALIGNMENT, gone-removed.size()));
+            // Skipping to k must suit the next particle better too, allowing for the one after k being gone
+            // as well, so that two particles that happen to be close can't throw the rest out of step. Skipping
+            // too few only costs bytes until the next look ahead, but skipping too many can't be undone.
+            auto following = [&](size_t k) { return std::min(distance(i+1, k+1), distance(i+1, k+2)); };
+            const uint64_t after = following(j);
+            for (size_t k = j+1; k <= last && best_distance > 0; ++k) {
+                const uint64_t d = distance(i, k);
+                if (d < best_distance && (i+1 == next.count || following(k) <= after)) {
+                    best = k;
+                    best_distance = d;
+                }
+            }
+            for (; j < best; ++j)
+                removed.push_back(static_cast<uint32_t>(j));
+        }
+        // Whatever is left over was removed from the end.
+        for (j = std::max(j, before.count-(gone-removed.size())); removed.size() < gone; ++j)
+            removed.push_back(static_cast<uint32_t>(j));
+    }
+
+    // A grid around the values of one component. Colors are always between 0 and 1.
+    inline void choose_grid(const std::vector<shared::Record>& records, const Component& c, double& lo, double& step, double& limit) const {
+        double low = 0.0, high = 1.0;
+        if (c.field != color && !records.empty()) {
+            low = high = value(records[0], c);
+            for (const shared::Record& r : records) {
+                low = std::min<double>(low, value(r, c));
+                high = std::max<double>(high, value(r, c));
+            }
+        }
+        if (settings.tolerance > 0.0) {
+            // The values in the middle of all 2^32 steps, which leaves them far to go. A double below 2^exponent,
+            // over twice the largest magnitude and the tolerance, is at most half_ulp from the float it decodes
+            // to. Values stay a step below that, so that the decoded ones do too.
+            int exponent = 0;
+            std::frexp(2.0*(std::max(std::abs(low), std::abs(high))+tolerance(c.field)), &exponent);
+            const double half_ulp = std::ldexp(1.0, exponent-1-std::numeric_limits<float>::digits);
+            const double bound = (tolerance(c.field)-half_ulp)*(1.0-SLACK);
+            if (!(bound > 0.0))
+                throw std::runtime_error("the tolerance is below float resolution for the range of values");
+            step = 2.0*bound;
+            limit = std::ldexp(1.0, exponent)-step;
+            const double top = static_cast<double>(std::numeric_limits<uint32_t>::max());
+            const double span = std::ceil((high-low)/step);
+            if (!(span < top))
+                throw std::runtime_error("the tolerance is too small for the range of values");
+            lo = low-std::floor((top-span)/2.0)*step;
+        } else {
+            const double margin = MARGIN*(high-low);
+            low -= margin;
+            high += margin;
+            lo = low;
+            step = high > low ? (high-low)/static_cast<double>((uint64_t{1} << bits)-1) : 1.0;
+            limit = std::numeric_limits<double>::infinity();
+        }
+    }
+
+public:
+    // With a tolerance, the grids have as many steps as the values need, up to 2^32.
+    inline explicit Encoder(const Settings& settings) : settings(settings), bits(static_cast<uint8_t>(settings.tolerance > 0.0 ? 32 : settings.bits)) {
+        if (settings.bits < 1 || settings.bits > 32)
+            throw std::runtime_error("bits must be between 1 and 32");
+    }
+
+    // The next frame will be a key frame.
+    inline void reset() {
+        previous.reset();
+        older.reset();
+    }
+
+    // Appends the message for one frame to out. Returns whether it's a key frame.
+    inline bool encode(const std::vector<shared::Record>& records, unsigned dimensions, uint64_t frame, double time, std::vector<uint8_t>& out) {
+        Quantized next;
+        next.count = static_cast<uint32_t>(records.size());
+        next.dimensions = static_cast<uint8_t>(dimensions);
+        next.fields = settings.fields;
+        next.bits = bits;
+        const std::vector<Component> cs = components(settings.fields, dimensions);
+        const double top = static_cast<double>((uint64_t{1} << bits)-1);
+        bool key = !previous || previous->dimensions != next.dimensions;
+        if (!key) {
+            next.lo = previous->lo;
+            next.step = previous->step;
+            next.limit = previous->limit;
+        }
+        next.values.resize(cs.size());
+        for (size_t c = 0; c < cs.size(); ++c) {
+            if (key) {
+                next.lo.emplace_back();
+                next.step.emplace_back();
+                next.limit.emplace_back();
+                choose_grid(records, cs[c], next.lo.back(), next.step.back(), next.limit.back());
+            }
+            std::vector<uint32_t>& values = next.values[c];
+            values.resize(records.size());
+            for (size_t i = 0; i < records.size(); ++i) {
+                const double v = value(records[i], cs[c]);
+                const double q = std::round((v-next.lo[c])/next.step[c]);
+                if (!(q >= 0.0 && q <= top && std::abs(v) < next.limit[c])) {
+                    // Left the previous frame's grid, so start over with new grids.
+                    if (key)
+                        throw std::runtime_error("value out of range, or the tolerance is too small for the range");
+                    reset();
+                    return encode(records, dimensions, frame, time, out);
+                }
+                values[i] = static_cast<uint32_t>(q);
+            }
+        }
+
+        const size_t start = out.size();
+        Header header{MAGIC, 0, frame, time, next.count, next.dimensions, settings.fields, bits, key, settings.entropy};
+        put(out, header);
+        if (key)
+            for (size_t c = 0; c < cs.size(); ++c) {
+                put(out, next.lo[c]);
+                put(out, next.step[c]);
+            }
+        std::vector<uint8_t>& to = settings.entropy ? changes : out;
+        changes.clear();
+        from.clear();
+        if (!key) {
+            removed.clear();
+            align(next, removed);
+            put_varint(to, static_cast<int64_t>(removed.size()));
+            for (size_t r = 0, at = 0; r < removed.size(); at = removed[r++]+1)
+                put_varint(to, static_cast<int64_t>(removed[r]-at));
+            survivors(previous->count, removed, from);
+        }
+        for (size_t c = 0; c < cs.size(); ++c) {
+            const std::vector<uint32_t>& values = next.values[c];
+            for (size_t i = 0; i < from.size(); ++i)
+                put_varint(to, static_cast<int64_t>(values[i])-predict(*previous, older, c, from[i]));
+            for (size_t i = from.size(); i < records.size(); ++i)
+                put_varint(to, static_cast<int64_t>(values[i])-(i > 0 ? values[i-1] : 0));
+        }
+        if (settings.entropy)
+            entropy::compress(changes.data(), changes.size(), out);
+        const uint32_t bytes = static_cast<uint32_t>(out.size()-start-PREFIX_BYTES);
+        std::memcpy(out.data()+start+offsetof(Header, bytes), &bytes, sizeof(bytes));
+        next.from = from;
+        older = std::move(previous);
+        previous = std::move(next);
+        return key;
+    }
+};
+
+// Decodes the messages of one stream, in order.
+class Decoder {
+    std::optional<Quantized> previous;
+    std::optional<Quantized> older;
+    std::vector<uint8_t> changes;    // After they're entropy decoded.
+    std::vector<uint32_t> removed;
+    std::vector<uint32_t> from;
+
+public:
+    // Decodes one whole message into frame. Fields that weren't sent are zero.
+    inline void decode(const uint8_t* data, size_t size, shared::Frame& frame) {
+        const uint8_t* in = data;
+        const uint8_t* end = data+size;
+        const Header header = get<Header>(in, end);
+        if (header.magic != MAGIC)
+            throw std::runtime_error("not a particle frame");
+        if (header.bytes != size-PREFIX_BYTES)
+            throw std::runtime_error("bad frame length");
+        Quantized next;
+        next.count = header.count;
+        next.dimensions = header.dimensions;
+        next.fields = header.fields;
+        next.bits = header.bits;
+        const std::vector<Component> cs = components(header.fields, header.dimensions);
+        if (header.key) {
+            for (size_t c = 0; c < cs.size(); ++c) {
+                next.lo.push_back(get<double>(in, end));
+                next.step.push_back(get<double>(in, end));
+            }
+        } else {
+            if (!previous || previous->fields != next.fields || previous->dimensions != next.dimensions)
+                throw std::runtime_error("a delta frame without its key frame");
+            next.lo = previous->lo;
+            next.step = previous->step;
+        }
+        next.values.resize(cs.size());
+        frame.frame = header.frame;
+        frame.time = header.time;
+        frame.records.assign(header.count, shared::Record{});
+        if (header.entropy) {
+            entropy::decompress(in, end, changes);
+            in = changes.data();
+            end = changes.data()+changes.size();
+        }
+        from.clear();
+        if (!header.key) {
+            const uint64_t count = static_cast<uint64_t>(get_varint(in, end));
+            if (count > previous->count || previous->count-count > header.count)
+                throw std::runtime_error("bad removed particles");
+            removed.clear();
+            for (uint64_t r = 0, at = 0; r < count; ++r) {
+                at += static_cast<uint64_t>(get_varint(in, end));
+                if (at >= previous->count)
+                    throw std::runtime_error("bad removed particles");
+                removed.push_back(static_cast<uint32_t>(at++));
+            }
+            survivors(previous->count, removed, from);
+        }
+        for (size_t c = 0; c < cs.size(); ++c) {
+            std::vector<uint32_t>& values = next.values[c];
+            values.resize(header.count);
+            for (size_t i = 0; i < header.count; ++i) {
+                const int64_t prediction = i < from.size() ? predict(*previous, older, c, from[i]) : i > 0 ? values[i-1] : 0;
+                values[i] = static_cast<uint32_t>(get_varint(in, end)+prediction);
+                value(frame.records[i], cs[c]) = static_cast<float>(next.lo[c]+values[i]*next.step[c]);
+            }
+        }
+        next.from = from;
+        older = std::move(previous);
+        previous = std::move(next);
+    }
+};
+
+}    // namespace codec
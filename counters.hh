@@ -0,0 +1,209 @@
+// counters.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters per phase, from Linux perf_event_open(2): cycles, instructions, last level
+// cache misses and branch mispredicts.
+//
+// A counters::Scope counts the calling thread from construction to destruction and adds the counts to its
+// phase's totals. parallel::for_blocks() counts each worker block under the phase of the thread that called
+// it, so a phase's totals include all of its workers. When counting is disabled, which is the default, a
+// Scope costs one relaxed atomic load. If the counters can't be opened, for example in a container or with
+// kernel.perf_event_paranoid above 2, a message is printed once and counting turns itself off. A counter the
+// CPU doesn't support is reported as n/a.
+namespace counters {
+
+enum Counter { cycles, instructions, cache_misses, branch_misses, COUNTER_COUNT };
+
+constexpr std::array<const char*, COUNTER_COUNT> COUNTER_NAMES = {"cycles", "instructions", "LLC misses", "branch misses"};
+
+inline std::atomic<bool> enabled{false};
+
+struct Counts {
+    std::array<uint64_t, COUNTER_COUNT> values{};
+    std::array<bool, COUNTER_COUNT> available{};
+    uint64_t scopes{0};
+
+    inline Counts& operator+=(const Counts& other) {
+        for (size_t k = 0; k < COUNTER_COUNT; ++k) {
+            values[k] += other.values[k];
+            available[k] = available[k] || other.available[k];
+        }
+        scopes += other.scopes;
+        return *this;
+    }
+};
+
+struct Totals {
+    std::mutex mutex;
+    std::map<std::string, Counts> phases;
+};
+
+inline Totals& totals() {
+    static Totals ret;
+    return ret;
+}
+
+// The phase the calling thread is counting, or nullptr.
+inline const char*& current_phase() {
+    thread_local const char* ret = nullptr;
+    return ret;
+}
+
+inline void disable(const char* why) {
+    if (enabled.exchange(false))
+        std::cout << "hardware counters unavailable: " << why << std::endl;
+}
+
+#ifdef __linux__
+
+// One group of counters on the calling thread. The first counter that opens leads the group.
+class Group {
+    std::array<int, COUNTER_COUNT> fds;
+    int leader = -1;
+
+public:
+    inline Group() {
+        static constexpr std::array<uint64_t, COUNTER_COUNT> configs = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        int error = 0;
+        for (size_t k = 0; k < COUNTER_COUNT; ++k) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[k];
+            attr.disabled = leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            fds[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fds[k] < 0)
+                error = errno;
+            else if (leader < 0)
+                leader = fds[k];
+        }
+        if (leader < 0)
+            disable(std::strerror(error));
+        else
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    inline ~Group() {
+        for (int fd : fds)
+            if (fd >= 0)
+                close(fd);
+    }
+
+    Group(const Group&) = delete;
+    Group& operator=(const Group&) = delete;
+
+    inline Counts read() const {
+        Counts ret;
+        if (leader < 0)
+            return ret;
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, 0);
+        // PERF_FORMAT_GROUP gives the number of counters, then their values in the order they were opened.
+        std::array<uint64_t, COUNTER_COUNT+1> data{};
+        if (::read(leader, data.data(), sizeof(data)) <= 0)
+            return ret;
+        size_t next = 1;
+        for (size_t k = 0; k < COUNTER_COUNT; ++k) {
+            ret.available[k] = fds[k] >= 0;
+            if (ret.available[k])
+                ret.values[k] = data[next++];
+        }
+        ret.scopes = 1;
+        return ret;
+    }
+};
+
+#else
+
+class Group {
+public:
+    inline Group() { disable("perf_event_open() needs Linux"); }
+    inline Counts read() const { return Counts(); }
+};
+
+#endif
+
+class Scope {
+    const char* phase = nullptr;
+    const char* outer = nullptr;
+    std::optional<Group> group;
+
+public:
+    inline explicit Scope(const char* phase) {
+        if (phase == nullptr || !enabled.load(std::memory_order_relaxed))
+            return;
+        this->phase = phase;
+        outer = current_phase();
+        current_phase() = phase;
+        group.emplace();
+    }
+
+    inline ~Scope() {
+        if (!group)
+            return;
+        const Counts counts = group->read();
+        group.reset();
+        current_phase() = outer;
+        std::lock_guard lock(totals().mutex);
+        totals().phases[phase] += counts;
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+inline void reset() {
+    std::lock_guard lock(totals().mutex);
+    totals().phases.clear();
+}
+
+// Prints each phase's totals, with IPC, and with the misses divided by pairs, such as the number of particle
+// pairs summed, when it's nonzero. A nested scope's counts are also in its outer scope's.
+inline void report(std::ostream& out, double pairs = 0.0, const char* per = "pair") {
+    std::lock_guard lock(totals().mutex);
+    for (const auto& [phase, counts] : totals().phases) {
+        out << std::setw(10) << phase;
+        for (size_t k = 0; k < COUNTER_COUNT; ++k) {
+            out << "  " << COUNTER_NAMES[k] << " ";
+            if (counts.available[k]) out << counts.values[k];
+            else out << "n/a";
+        }
+        out << std::fixed << std::setprecision(3);
+        if (counts.available[cycles] && counts.available[instructions] && counts.values[cycles] > 0)
+            out << "  IPC " << static_cast<double>(counts.values[instructions])/counts.values[cycles];
+        if (pairs > 0.0) {
+            if (counts.available[cache_misses])
+                out << "  LLC misses/" << per << " " << std::setprecision(6) << counts.values[cache_misses]/pairs;
+            if (counts.available[branch_misses])
+                out << "  branch misses/" << per << " " << std::setprecision(6) << counts.values[branch_misses]/pairs;
+        }
+        out << std::defaultfloat << std::endl;
+    }
+}
+
+}    // namespace counters
@@ -0,0 +1,156 @@
+// diagnostics.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "parallel.hh"
+#include "particles.hh"
+
+// Conservation diagnostics, to check whether a faster solver or a longer timestep is still physically
+// acceptable. Every few frames the solver also sums each particle's potential energy, in the same pass as
+// the forces, and a Sample totals the energies, the momentum, the angular momentum about the origin, and
+// the center of mass. A Series writes the samples to a .csv next to the time each step took, so that an
+// accuracy regression shows up beside the performance numbers.
+//
+// Mass is pi*r^2, as in BasicParticle::accelerate_particle(), and the potential of a pair is
+// -G*m1*m2/sqrt(max(r^2, 3)), with the same softening as the force. Merging is inelastic, so the total
+// energy falls a little with every merge, while the momentum should stay constant.
+namespace diagnostics {
+
+constexpr size_t FRAMES = 60;    // The default number of frames between samples.
+
+struct Sample {
+    size_t frame{0};
+    double time{0.0};    // Simulated seconds.
+    double step_seconds{0.0};    // Wall time of the force step that was sampled.
+    size_t particles{0};
+    double mass{0.0};
+    double kinetic{0.0};
+    double potential{std::numeric_limits<double>::quiet_NaN()};    // NaN if the solver doesn't provide it.
+    glm::dvec3 momentum{0.0};
+    double momentum_scale{0.0};    // The sum of |m*v|, to make the momentum drift relative even when the total is zero.
+    glm::dvec3 angular_momentum{0.0};    // Only z in 2-D.
+    glm::dvec3 center_of_mass{0.0};
+
+    inline double total() const { return kinetic+potential; }
+};
+
+// Totals the particles across the worker threads. Each thread sums a block, and the blocks are added in order.
+// potentials holds each particle's potential energy, which counts every pair twice, or is empty.
+template <glm::length_t D, typename Precision>
+inline Sample measure(const BasicParticles<D, Precision>& particles, const std::vector<typename Precision::accumulator_type>& potentials) {
+    struct Partial {
+        double mass{0.0};
+        double kinetic{0.0};
+        double potential{0.0};
+        glm::dvec3 momentum{0.0};
+        double momentum_scale{0.0};
+        glm::dvec3 angular_momentum{0.0};
+        glm::dvec3 moment{0.0};    // Sum of mass*position.
+    };
+    std::vector<Partial> partials(parallel::thread_count());
+    const bool with_potential = potentials.size() == particles.size();
+    parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t t) {
+        Partial& partial = partials[t];
+        for (size_t i = begin; i < end; ++i) {
+            const auto& p = particles[i];
+            const double radius = p.diameter/2.0;
+            const double mass = glm::pi<double>()*radius*radius;
+            glm::dvec3 position(0.0);
+            glm::dvec3 velocity(0.0);
+            for (glm::length_t k = 0; k < D; ++k) {
+                position[k] = static_cast<double>(p.position[k]);
+                velocity[k] = static_cast<double>(p.velocity[k]);
+            }
+            partial.mass += mass;
+            partial.kinetic += 0.5*mass*glm::dot(velocity, velocity);
+            partial.momentum += mass*velocity;
+            partial.momentum_scale += mass*glm::length(velocity);
+            partial.angular_momentum += mass*glm::cross(position, velocity);
+            partial.moment += mass*position;
+            if (with_potential)
+                partial.potential += 0.5*static_cast<double>(potentials[i]);
+        }
+    });
+
+    Sample ret;
+    ret.particles = particles.size();
+    double potential = 0.0;
+    glm::dvec3 moment(0.0);
+    for (const Partial& partial : partials) {
+        ret.mass += partial.mass;
+        ret.kinetic += partial.kinetic;
+        potential += partial.potential;
+        ret.momentum += partial.momentum;
+        ret.momentum_scale += partial.momentum_scale;
+        ret.angular_momentum += partial.angular_momentum;
+        moment += partial.moment;
+    }
+    if (with_potential)
+        ret.potential = potential;
+    if (ret.mass > 0.0)
+        ret.center_of_mass = moment/ret.mass;
+    return ret;
+}
+
+// A .csv field that's left empty for NaN.
+struct Optional {
+    double value;
+};
+
+inline std::ostream& operator<<(std::ostream& out, Optional field) {
+    if (!std::isnan(field.value))
+        out << field.value;
+    return out;
+}
+
+// A .csv time series of samples. The drift columns are relative to the first sample. A column is left empty
+// when it has no value: the potential, total and energy drift when the solver doesn't sum the potential, as
+// P3M doesn't, and a drift with nothing to be relative to, such as the momentum of particles that start at rest.
+class Series {
+    std::ofstream ofile;
+    bool first{true};
+    double initial_energy{0.0};
+    glm::dvec3 initial_momentum{0.0};
+    double momentum_scale{0.0};
+
+public:
+    inline explicit Series(const std::string& csv_filename) : ofile(csv_filename, std::ios::binary) {
+        if (!ofile)
+            throw std::runtime_error("can't write "+csv_filename);
+        ofile << "frame,time,step_seconds,particles,mass,kinetic,potential,total,energy_drift,"
+              << "xmomentum,ymomentum,zmomentum,momentum_drift,xangular,yangular,zangular,xcenter,ycenter,zcenter\n";
+        ofile << std::setprecision(std::numeric_limits<double>::max_digits10);
+    }
+
+    inline void write(const Sample& sample) {
+        if (first) {
+            first = false;
+            initial_energy = sample.total();
+            initial_momentum = sample.momentum;
+            momentum_scale = sample.momentum_scale;
+        }
+        constexpr double none = std::numeric_limits<double>::quiet_NaN();
+        const double energy_drift = initial_energy != 0.0 ? (sample.total()-initial_energy)/std::abs(initial_energy) : none;
+        const double momentum_drift = momentum_scale != 0.0 ? glm::length(sample.momentum-initial_momentum)/momentum_scale : none;
+        ofile << sample.frame << ',' << sample.time << ',' << sample.step_seconds << ',' << sample.particles << ','
+              << sample.mass << ',' << sample.kinetic << ',' << Optional{sample.potential} << ',' << Optional{sample.total()} << ','
+              << Optional{energy_drift} << ',' << sample.momentum.x << ',' << sample.momentum.y << ',' << sample.momentum.z << ','
+              << Optional{momentum_drift} << ',' << sample.angular_momentum.x << ',' << sample.angular_momentum.y << ',' << sample.angular_momentum.z << ','
+              << sample.center_of_mass.x << ',' << sample.center_of_mass.y << ',' << sample.center_of_mass.z << '\n';
+        ofile.flush();
+    }
+};
+
+}    // namespace diagnostics
@@ -0,0 +1,603 @@
+// distributed.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <mpi.h>
+
+#include <glm/glm.hpp>
+
+#include "parallel.hh"
+#include "particles.hh"
+#include "trace.hh"
+#include "tree.hh"
+
+// Gravity across MPI processes, for more particles than one machine can hold or sum in time. Build with
+// cmake -DGRAVITY_MPI=ON and run gravity-distributed with mpirun.
+//
+// Every step each rank sorts its particles along the same Morton curve as tree.hh, through the bounding cube
+// of all the particles, and the curve is cut into one run per rank with about the same number of particles.
+// Particles migrate to the rank that owns their run, so each rank's particles stay close together in space.
+// Each rank then summarises its particles as cells of at most CELL_SIZE particles, with their mass, center
+// of mass and bounding box, and every rank receives every cell. A cell far enough from another rank's
+// particles, compared with its size, acts on all of them as one body at its center of mass, the tree's
+// opening criterion. Otherwise its particles are sent to that rank as ghosts, which act on the rank's
+// particles with the direct kernel and can touch them. theta = 0 sends every particle everywhere, for an
+// exact sum, but the direct solver uses a ring instead, which never holds more than two ranks' particles.
+//
+// The ring is the systolic direct sum. Each rank keeps its particles as the targets, and passes a block of
+// sources to the next rank around the ring while it sums the block it has, so after ranks()-1 passes every
+// target has felt every source. The next block is sent and received while the workers compute, and the main
+// thread polls MPI meanwhile, since many MPI libraries only move large messages inside MPI calls.
+//
+// Merging keeps the single process semantics. Each particle has a label, its index in the initial
+// particles, which travels with it, and each connected set of touching particles merges into its lowest
+// label, summing the members in label order. Colliding particles are few, so every rank gathers all of them,
+// merges them with BasicParticle::merge_collisions(), and keeps the results that it owns. The touching pairs
+// found in the ring's remote blocks join the same merge.
+namespace distributed {
+
+constexpr size_t CELL_SIZE = 64;    // Most particles in a cell summary.
+constexpr size_t SAMPLES_PER_RANK = 256;    // Curve keys per rank, on average, used to cut the curve.
+
+inline void check(int error, const char* call) {
+    if (error != MPI_SUCCESS)
+        throw std::runtime_error(std::string(call)+" failed");
+}
+
+// A pair of touching particles, by label.
+using Edge = std::pair<uint64_t, uint64_t>;
+
+inline int rank() {
+    int ret = 0;
+    check(MPI_Comm_rank(MPI_COMM_WORLD, &ret), "MPI_Comm_rank");
+    return ret;
+}
+
+inline int ranks() {
+    int ret = 1;
+    check(MPI_Comm_size(MPI_COMM_WORLD, &ret), "MPI_Comm_size");
+    return ret;
+}
+
+// Byte counts and offsets for MPI, which counts in int.
+inline std::vector<int> offsets_of(const std::vector<int>& counts) {
+    std::vector<int> ret(counts.size(), 0);
+    for (size_t r = 1; r < counts.size(); ++r) {
+        if (static_cast<int64_t>(ret[r-1])+counts[r-1] > std::numeric_limits<int>::max())
+            throw std::runtime_error("more than 2 GiB in one MPI message");
+        ret[r] = ret[r-1]+counts[r-1];
+    }
+    return ret;
+}
+
+// Every rank's items, concatenated in rank order, on every rank. T is trivially copyable.
+template <typename T>
+inline std::vector<T> all_gather(const std::vector<T>& items) {
+    const int count = static_cast<int>(items.size()*sizeof(T));
+    std::vector<int> counts(ranks());
+    check(MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD), "MPI_Allgather");
+    const std::vector<int> offsets = offsets_of(counts);
+    std::vector<T> ret((static_cast<size_t>(offsets.back())+counts.back())/sizeof(T));
+    check(MPI_Allgatherv(items.data(), count, MPI_BYTE, ret.data(), counts.data(), offsets.data(), MPI_BYTE, MPI_COMM_WORLD), "MPI_Allgatherv");
+    return ret;
+}
+
+// Every rank's items, concatenated in rank order, on rank 0. Empty on the other ranks.
+template <typename T>
+inline std::vector<T> gather(const std::vector<T>& items) {
+    const int count = static_cast<int>(items.size()*sizeof(T));
+    std::vector<int> counts(ranks());
+    check(MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD), "MPI_Gather");
+    std::vector<T> ret;
+    std::vector<int> offsets(counts.size(), 0);
+    if (rank() == 0) {
+        offsets = offsets_of(counts);
+        ret.resize((static_cast<size_t>(offsets.back())+counts.back())/sizeof(T));
+    }
+    check(MPI_Gatherv(items.data(), count, MPI_BYTE, ret.data(), counts.data(), offsets.data(), MPI_BYTE, 0, MPI_COMM_WORLD), "MPI_Gatherv");
+    return ret;
+}
+
+// Sends outgoing[r] to rank r, and returns what every rank sent to this one, concatenated in rank order.
+template <typename T>
+inline std::vector<T> exchange(const std::vector<std::vector<T>>& outgoing) {
+    std::vector<int> send_counts(outgoing.size());
+    std::vector<T> sending;
+    for (size_t r = 0; r < outgoing.size(); ++r) {
+        send_counts[r] = static_cast<int>(outgoing[r].size()*sizeof(T));
+        sending.insert(sending.end(), outgoing[r].begin(), outgoing[r].end());
+    }
+    std::vector<int> receive_counts(outgoing.size());
+    check(MPI_Alltoall(send_counts.data(), 1, MPI_INT, receive_counts.data(), 1, MPI_INT, MPI_COMM_WORLD), "MPI_Alltoall");
+    const std::vector<int> send_offsets = offsets_of(send_counts);
+    const std::vector<int> receive_offsets = offsets_of(receive_counts);
+    std::vector<T> ret((static_cast<size_t>(receive_offsets.back())+receive_counts.back())/sizeof(T));
+    check(MPI_Alltoallv(sending.data(), send_counts.data(), send_offsets.data(), MPI_BYTE,
+        ret.data(), receive_counts.data(), receive_offsets.data(), MPI_BYTE, MPI_COMM_WORLD), "MPI_Alltoallv");
+    return ret;
+}
+
+// An axis-aligned bounding box, in 3-D even for 2-D particles, whose z is then always 0.
+struct Box {
+    glm::dvec3 lo{std::numeric_limits<double>::max()};
+    glm::dvec3 hi{std::numeric_limits<double>::lowest()};
+
+    inline bool empty() const { return lo.x > hi.x; }
+    inline void add(const glm::dvec3& point) { lo = glm::min(lo, point); hi = glm::max(hi, point); }
+    inline double size() const { return empty() ? 0.0 : std::max({hi.x-lo.x, hi.y-lo.y, hi.z-lo.z}); }
+
+    // The shortest distance between the boxes, or infinity if either is empty.
+    inline double distance(const Box& other) const {
+        if (empty() || other.empty())
+            return std::numeric_limits<double>::infinity();
+        const glm::dvec3 gap = glm::max(glm::dvec3(0.0), glm::max(lo-other.hi, other.lo-hi));
+        return glm::length(gap);
+    }
+};
+
+// A summary of a run of one rank's particles along the curve.
+struct Cell {
+    Box box;
+    glm::dvec3 center{0.0};    // Of mass.
+    double mass{0.0};
+    int32_t owner{0};    // The rank.
+    uint32_t begin{0};    // The owner's particles.
+    uint32_t end{0};
+};
+
+// Whether a cell is too close to the particles in a box to act on them as one body. reach is the largest
+// distance at which two particles can touch, so a cell that isn't near can't touch anything in the box.
+inline bool near(const Cell& cell, const Box& box, double theta, double reach) {
+    const double distance = cell.box.distance(box);
+    return distance <= reach || cell.box.size() >= theta*distance;
+}
+
+// This rank's work in the last step.
+struct Stats {
+    size_t particles{0};
+    size_t ghosts{0};    // Particles received from other ranks.
+    size_t far_cells{0};    // Other ranks' cells that acted as one body.
+    double seconds{0.0};
+    double waiting{0.0};    // Seconds the ring waited for a block after the workers finished the last.
+};
+
+template <glm::length_t D, typename Precision>
+class Domain {
+public:
+    using Particle = BasicParticle<D, Precision>;
+    using Particles = BasicParticles<D, Precision>;
+
+    // Every rank passes its share of the initial particles, which may be all of them on rank 0 and none
+    // elsewhere. A particle's label is its index in the concatenation of the shares in rank order. ring sums
+    // every pair exactly around the ring, and ignores theta.
+    inline Domain(Particles initial, float theta, bool ring = false);
+
+    // Accelerates, merges and moves every particle by delta seconds.
+    inline void step(float delta);
+
+    // Every particle, in label order and with IDs equal to indexes, on rank 0. Empty on the other ranks.
+    inline Particles gather() const;
+
+    inline const Stats& stats() const { return last; }
+
+private:
+    Particles particles;    // This rank's, sorted along the curve, with IDs equal to indexes.
+    Particles store;    // The accelerated particles, swapped with particles each step.
+    std::vector<uint64_t> labels;
+    std::vector<uint64_t> keys;
+    float theta;
+    bool ring;
+    Stats last;
+
+    static inline glm::dvec3 point(const Particle& p);
+    inline void decompose();
+    inline void split(std::vector<Cell>& cells, uint32_t begin, uint32_t end, unsigned level) const;
+    inline std::vector<Edge> accelerate_cells(Particles& out_particles, float delta);
+    inline std::vector<Edge> accelerate_ring(Particles& out_particles, float delta);
+    inline void merge(const std::vector<Edge>& edges, Particles& out_particles);
+};
+
+template <glm::length_t D, typename Precision>
+inline Domain<D, Precision>::Domain(Particles initial, float theta, bool ring) : particles(std::move(initial)), theta(theta), ring(ring) {
+    uint64_t count = particles.size();
+    uint64_t first = 0;
+    check(MPI_Exscan(&count, &first, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD), "MPI_Exscan");
+    if (rank() == 0)
+        first = 0;    // MPI_Exscan() leaves rank 0's result undefined.
+    labels.resize(particles.size());
+    for (size_t i = 0; i < particles.size(); ++i)
+        labels[i] = first+i;
+}
+
+template <glm::length_t D, typename Precision>
+inline glm::dvec3 Domain<D, Precision>::point(const Particle& p) {
+    glm::dvec3 ret(0.0);
+    for (glm::length_t k = 0; k < D; ++k)
+        ret[k] = static_cast<double>(p.position[k]);
+    return ret;
+}
+
+// Cut the curve into runs with equal numbers of particles, at keys sampled evenly from every rank, and move
+// each particle to the rank that owns its run. The particles travel with their labels in their IDs.
+template <glm::length_t D, typename Precision>
+inline void Domain<D, Precision>::decompose() {
+    trace::Scope scope("decompose");
+    const int size = ranks();
+    Box local;
+    for (const Particle& p : particles)
+        local.add(point(p));
+    Box bounds;
+    check(MPI_Allreduce(&local.lo, &bounds.lo, 3, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD), "MPI_Allreduce");
+    check(MPI_Allreduce(&local.hi, &bounds.hi, 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD), "MPI_Allreduce");
+    const double scale = static_cast<double>((uint64_t{1} << tree::MORTON_BITS<D>)-1)/std::max(1.0, bounds.size());
+    auto key_of = [&bounds, scale](const Particle& p) {
+        glm::vec<D, uint64_t> cell;
+        for (glm::length_t k = 0; k < D; ++k)
+            cell[k] = static_cast<uint64_t>((static_cast<double>(p.position[k])-bounds.lo[k])*scale);
+        return tree::morton_key<D>(cell);
+    };
+
+    // (key, label, index), so that equal keys are in label order on any number of ranks.
+    auto sorted_order = [&key_of](const Particles& ps, const std::vector<uint64_t>& ls) {
+        std::vector<std::tuple<uint64_t, uint64_t, uint32_t>> ret(ps.size());
+        parallel::for_blocks(ps.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i)
+                ret[i] = {key_of(ps[i]), ls[i], static_cast<uint32_t>(i)};
+        });
+        parallel::sort(ret.begin(), ret.end());
+        return ret;
+    };
+    const auto sorted = sorted_order(particles, labels);
+
+    uint64_t count = particles.size();
+    uint64_t total = 0;
+    check(MPI_Allreduce(&count, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD), "MPI_Allreduce");
+    if (total == 0)
+        return;
+    const size_t samples = std::min<size_t>(count, (SAMPLES_PER_RANK*size*count+total-1)/total);
+    std::vector<uint64_t> sample_keys(samples);
+    for (size_t s = 0; s < samples; ++s)
+        sample_keys[s] = std::get<0>(sorted[(2*s+1)*count/(2*samples)]);
+    std::vector<uint64_t> all_samples = all_gather(sample_keys);
+    std::sort(all_samples.begin(), all_samples.end());
+    std::vector<uint64_t> splitters(size-1);
+    for (int r = 1; r < size; ++r)
+        splitters[r-1] = all_samples[r*all_samples.size()/size];
+
+    std::vector<Particles> outgoing(size);
+    for (const auto& [key, label, index] : sorted) {
+        const size_t destination = std::upper_bound(splitters.begin(), splitters.end(), key)-splitters.begin();
+        outgoing[destination].push_back(particles[index]);
+        outgoing[destination].back().id = label;
+    }
+    Particles incoming = exchange(outgoing);
+
+    std::vector<uint64_t> incoming_labels(incoming.size());
+    for (size_t i = 0; i < incoming.size(); ++i)
+        incoming_labels[i] = incoming[i].id;
+    const auto resorted = sorted_order(incoming, incoming_labels);
+    particles.resize(incoming.size());
+    labels.resize(incoming.size());
+    keys.resize(incoming.size());
+    for (size_t i = 0; i < resorted.size(); ++i) {
+        const auto& [key, label, index] = resorted[i];
+        particles[i] = incoming[index];
+        particles[i].id = i;
+        labels[i] = label;
+        keys[i] = key;
+    }
+}
+
+// Summarise [begin, end) as one cell if it's small, otherwise split it by the next D bits of the keys, as
+// tree::Solver::split_node() does.
+template <glm::length_t D, typename Precision>
+inline void Domain<D, Precision>::split(std::vector<Cell>& cells, uint32_t begin, uint32_t end, unsigned level) const {
+    if (end-begin <= CELL_SIZE || level == tree::MORTON_BITS<D>) {
+        Cell cell;
+        cell.owner = rank();
+        cell.begin = begin;
+        cell.end = end;
+        glm::dvec3 moment(0.0);
+        for (uint32_t i = begin; i < end; ++i) {
+            const double radius = particles[i].diameter/2.0;
+            const double mass = glm::pi<double>()*radius*radius;
+            const glm::dvec3 p = point(particles[i]);
+            cell.box.add(p);
+            cell.mass += mass;
+            moment += mass*p;
+        }
+        cell.center = moment/cell.mass;
+        cells.push_back(cell);
+        return;
+    }
+    constexpr uint64_t child_slots = uint64_t{1} << D;
+    const unsigned shift = (tree::MORTON_BITS<D>-1-level)*D;
+    uint32_t child_begin = begin;
+    for (uint64_t slot = 0; slot < child_slots && child_begin < end; ++slot) {
+        const uint32_t child_end = static_cast<uint32_t>(std::partition_point(keys.begin()+child_begin, keys.begin()+end,
+            [shift, slot](uint64_t key) { return ((key >> shift) & (child_slots-1)) <= slot; })-keys.begin());
+        if (child_end != child_begin)
+            split(cells, child_begin, child_end, level+1);
+        child_begin = child_end;
+    }
+}
+
+template <glm::length_t D, typename Precision>
+inline void Domain<D, Precision>::step(float delta) {
+    const auto start = std::chrono::steady_clock::now();
+    decompose();
+    const std::vector<Edge> edges = ring ? accelerate_ring(store, delta) : accelerate_cells(store, delta);
+    merge(edges, store);
+    Particle::move_particles(store, delta);
+    particles.swap(store);
+    last.particles = particles.size();
+    last.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+// The ghosts and far cells. Returns the touching pairs.
+template <glm::length_t D, typename Precision>
+inline std::vector<Edge> Domain<D, Precision>::accelerate_cells(Particles& out_particles, float delta) {
+    const int me = rank();
+    const int size = ranks();
+    const size_t n = particles.size();
+
+    // Summaries of every rank's particles, and the box around each rank's particles.
+    std::vector<Cell> cells;
+    if (n != 0)
+        split(cells, 0, static_cast<uint32_t>(n), 0);
+    const std::vector<Cell> all_cells = all_gather(cells);
+    Box mine;
+    double radius = 0.0;
+    for (const Particle& p : particles) {
+        mine.add(point(p));
+        radius = std::max(radius, p.diameter/2.0);
+    }
+    const std::vector<Box> boxes = all_gather(std::vector<Box>{mine});
+    double largest = 0.0;
+    check(MPI_Allreduce(&radius, &largest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD), "MPI_Allreduce");
+    const double reach = 2.0*largest;
+
+    // Send the particles of each of this rank's cells that are near another rank. The other rank decides
+    // which cells are far with the same boxes, so every cell is either sent or summarised, never both.
+    Particles sources;
+    std::vector<uint64_t> source_labels;
+    {
+        trace::Scope scope("ghosts");
+        std::vector<Particles> outgoing(size);
+        for (const Cell& cell : cells)
+            for (int r = 0; r < size; ++r)
+                if (r != me && near(cell, boxes[r], theta, reach))
+                    for (uint32_t i = cell.begin; i < cell.end; ++i) {
+                        outgoing[r].push_back(particles[i]);
+                        outgoing[r].back().id = labels[i];
+                    }
+        const Particles ghosts = exchange(outgoing);
+        sources = particles;
+        source_labels = labels;
+        sources.insert(sources.end(), ghosts.begin(), ghosts.end());
+        for (size_t i = n; i < sources.size(); ++i) {
+            source_labels.push_back(sources[i].id);
+            sources[i].id = i;
+        }
+        last.ghosts = ghosts.size();
+    }
+    std::vector<Cell> far;
+    for (const Cell& cell : all_cells)
+        if (cell.owner != me && !near(cell, mine, theta, reach))
+            far.push_back(cell);
+    last.far_cells = far.size();
+    last.waiting = 0.0;
+
+    // This rank's particles are the targets, and its particles and the ghosts are the sources.
+    Particle::copy_particles(sources, out_particles);
+    std::vector<Collisions> collisions(parallel::thread_count());
+    {
+        trace::Scope scope("force");
+        parallel::for_chunks(n, 0, TARGET_TILE, [&](size_t begin, size_t end, size_t t) {
+            collisions[t].merge(Particle::template accelerate_particle_block_tiled<false>(sources, out_particles, delta, end-begin, begin, nullptr));
+        });
+        parallel::for_blocks(n, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                const glm::dvec3 p = point(sources[i]);
+                glm::dvec3 acceleration(0.0);
+                for (const Cell& cell : far) {
+                    // The same softened force as BasicParticle::accelerate_particle().
+                    const glm::dvec3 distances = cell.center-p;
+                    const double quadrance = glm::dot(distances, distances);
+                    acceleration += (GRAVITY*cell.mass/(std::max(quadrance, 3.0)*std::sqrt(quadrance)))*distances;
+                }
+                for (glm::length_t k = 0; k < D; ++k)
+                    out_particles[i].velocity[k] += static_cast<typename Precision::accumulator_type>(acceleration[k]*delta);
+            }
+        });
+    }
+    out_particles.resize(n);
+
+    std::vector<Edge> edges;
+    for (const Collisions& c : collisions)
+        for (const auto& [i, touching] : c)
+            for (size_t j : touching)
+                edges.emplace_back(source_labels[i], source_labels[j]);
+    return edges;
+}
+
+// The direct sum around the ring. Each pass sends the block this rank has to the next rank and receives the
+// following block from the previous one, while the workers sum the block it has into the targets. The
+// targets come first in the array the kernel reads, and the block after them. Returns the touching pairs.
+template <glm::length_t D, typename Precision>
+inline std::vector<Edge> Domain<D, Precision>::accelerate_ring(Particles& out_particles, float delta) {
+    trace::Scope scope("ring");
+    const int me = rank();
+    const int size = ranks();
+    const size_t n = particles.size();
+    const std::vector<uint64_t> counts = all_gather(std::vector<uint64_t>{n});
+    const int next_rank = (me+1)%size;
+    const int previous_rank = (me+size-1)%size;
+
+    Particles block = particles;    // Labelled, from rank (me-pass) mod size.
+    for (size_t i = 0; i < n; ++i)
+        block[i].id = labels[i];
+    Particles incoming;
+    Particles combined = particles;
+    combined.reserve(n+*std::max_element(counts.begin(), counts.end()));
+    Particle::copy_particles(particles, out_particles);
+    std::vector<Collisions> collisions(parallel::thread_count());
+    std::vector<Edge> edges;
+    last.ghosts = 0;
+    last.far_cells = 0;
+    last.waiting = 0.0;
+
+    for (int pass = 0; pass < size; ++pass) {
+        MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        if (pass+1 < size) {
+            incoming.resize(counts[(me+2*size-pass-1)%size]);
+            check(MPI_Irecv(incoming.data(), static_cast<int>(incoming.size()*sizeof(Particle)), MPI_BYTE, previous_rank, pass, MPI_COMM_WORLD, &requests[0]), "MPI_Irecv");
+            check(MPI_Isend(block.data(), static_cast<int>(block.size()*sizeof(Particle)), MPI_BYTE, next_rank, pass, MPI_COMM_WORLD, &requests[1]), "MPI_Isend");
+        }
+        // The first pass sums the targets as their own sources.
+        const size_t source_begin = pass == 0 ? 0 : n;
+        if (pass != 0) {
+            combined.resize(n);
+            combined.insert(combined.end(), block.begin(), block.end());
+            out_particles.resize(combined.size());
+            last.ghosts += block.size();
+        }
+
+        auto compute = std::async(std::launch::async, [&]() {
+            trace::Scope force_scope("force");
+            parallel::for_chunks(n, 0, TARGET_TILE, [&](size_t begin, size_t end, size_t t) {
+                collisions[t].merge(Particle::template accelerate_particle_block_sources<false>(combined, out_particles, delta, end-begin, begin, source_begin, combined.size()));
+            });
+        });
+        int done = 0;
+        while (compute.wait_for(std::chrono::microseconds(100)) != std::future_status::ready)
+            if (!done)
+                check(MPI_Testall(2, requests, &done, MPI_STATUSES_IGNORE), "MPI_Testall");
+        compute.get();
+        const auto waiting = std::chrono::steady_clock::now();
+        {
+            trace::Scope wait_scope("wait");
+            check(MPI_Waitall(2, requests, MPI_STATUSES_IGNORE), "MPI_Waitall");
+        }
+        last.waiting += std::chrono::duration<double>(std::chrono::steady_clock::now()-waiting).count();
+
+        for (Collisions& c : collisions) {
+            for (const auto& [i, touching] : c)
+                for (size_t j : touching)
+                    edges.emplace_back(labels[i], pass == 0 ? labels[j] : block[j-n].id);
+            c.clear();
+        }
+        std::swap(block, incoming);
+    }
+    out_particles.resize(n);
+    return edges;
+}
+
+// Merge every connected set of touching particles on any rank, the same way on every rank, then keep the
+// merged particles this rank owns and remove the rest of the sets. edges are the touching pairs this rank
+// found, and out_particles are this rank's particles after acceleration.
+template <glm::length_t D, typename Precision>
+inline void Domain<D, Precision>::merge(const std::vector<Edge>& edges, Particles& out_particles) {
+    trace::Scope scope("merge");
+    const std::vector<Edge> all_edges = all_gather(edges);
+    if (all_edges.empty())
+        return;
+    std::vector<uint64_t> involved;
+    for (const auto& [a, b] : all_edges) {
+        involved.push_back(a);
+        involved.push_back(b);
+    }
+    std::sort(involved.begin(), involved.end());
+    involved.erase(std::unique(involved.begin(), involved.end()), involved.end());
+    auto index_of = [&involved](uint64_t label) { return static_cast<size_t>(std::lower_bound(involved.begin(), involved.end(), label)-involved.begin()); };
+    auto is_involved = [&involved](uint64_t label) { return std::binary_search(involved.begin(), involved.end(), label); };
+
+    // Every involved particle as it was before this step's forces, from its owner, in label order.
+    const size_t n = out_particles.size();
+    Particles owned;
+    for (size_t i = 0; i < n; ++i)
+        if (is_involved(labels[i])) {
+            owned.push_back(particles[i]);
+            owned.back().id = labels[i];
+        }
+    Particles group = all_gather(owned);
+    std::sort(group.begin(), group.end(), [](const Particle& a, const Particle& b) { return a.id < b.id; });
+    if (group.size() != involved.size())
+        throw std::runtime_error("a colliding particle has no owner");
+    for (size_t k = 0; k < group.size(); ++k)
+        group[k].id = k;
+    Collisions group_collisions;
+    for (const auto& [a, b] : all_edges)
+        group_collisions[index_of(a)].insert(index_of(b));
+    Particles merged;
+    Particle::copy_particles(group, merged);
+    Particle::merge_collisions(group, merged, {group_collisions});
+
+    // merge_collisions() keeps each set's lowest member, in order, so find those the same way.
+    std::vector<size_t> parent(group.size());
+    for (size_t k = 0; k < parent.size(); ++k)
+        parent[k] = k;
+    auto find = [&parent](size_t k) {
+        while (parent[k] != k)
+            k = parent[k] = parent[parent[k]];
+        return k;
+    };
+    for (const auto& [a, b] : all_edges) {
+        const size_t ra = find(index_of(a));
+        const size_t rb = find(index_of(b));
+        parent[std::max(ra, rb)] = std::min(ra, rb);
+    }
+    std::vector<size_t> roots;
+    for (size_t k = 0; k < parent.size(); ++k)
+        if (find(k) == k)
+            roots.push_back(k);
+    if (roots.size() != merged.size())
+        throw std::runtime_error("merged sets don't match");
+
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (is_involved(labels[i])) {
+            const size_t k = index_of(labels[i]);
+            if (find(k) != k)
+                continue;
+            const Particle& m = merged[std::lower_bound(roots.begin(), roots.end(), k)-roots.begin()];
+            out_particles[i].position = m.position;
+            out_particles[i].velocity = m.velocity;
+            out_particles[i].diameter = m.diameter;
+            out_particles[i].color = m.color;
+        }
+        out_particles[kept] = out_particles[i];
+        out_particles[kept].id = kept;
+        labels[kept] = labels[i];
+        ++kept;
+    }
+    out_particles.resize(kept);
+    labels.resize(kept);
+}
+
+template <glm::length_t D, typename Precision>
+inline auto Domain<D, Precision>::gather() const -> Particles {
+    Particles labelled = particles;
+    for (size_t i = 0; i < labelled.size(); ++i)
+        labelled[i].id = labels[i];
+    Particles ret = distributed::gather(labelled);
+    std::sort(ret.begin(), ret.end(), [](const Particle& a, const Particle& b) { return a.id < b.id; });
+    for (size_t i = 0; i < ret.size(); ++i)
+        ret[i].id = i;
+    return ret;
+}
+
+}    // namespace distributed
@@ -0,0 +1,151 @@
+// entropy.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// An order-0 entropy coder for bytes, to squeeze the delta encoded frames of codec.hh. It's a range
+// asymmetric numeral system (rANS) with 32-bit states that emit whole bytes, after Fabian Giesen's public
+// domain ryg_rans, and four states interleaved so that consecutive bytes don't wait on each other.
+//
+// A block is the number of bytes as a varint, the frequency of each of the 256 byte values as varints, then
+// the coded bytes. Frequencies are scaled to sum to 2^PROB_BITS.
+namespace entropy {
+
+constexpr unsigned PROB_BITS = 12;
+constexpr uint32_t PROB_SCALE = 1u << PROB_BITS;
+constexpr uint32_t LOWER = 1u << 23;    // The states stay in [LOWER, 256*LOWER).
+constexpr size_t STATES = 4;
+
+inline void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64_t get_varint(const uint8_t*& in, const uint8_t* end) {
+    uint64_t ret = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        if (in == end || shift > 63)
+            throw std::runtime_error("truncated entropy block");
+        const uint8_t byte = *in++;
+        ret |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return ret;
+    }
+}
+
+// Counts scaled to sum to PROB_SCALE, with every byte that occurs at least 1.
+inline std::array<uint32_t, 256> normalize(const std::array<uint64_t, 256>& counts, uint64_t total) {
+    std::array<uint32_t, 256> ret{};
+    uint32_t sum = 0;
+    for (size_t s = 0; s < 256; ++s) {
+        if (counts[s] == 0)
+            continue;
+        ret[s] = std::max<uint32_t>(1, static_cast<uint32_t>(counts[s]*PROB_SCALE/total));
+        sum += ret[s];
+    }
+    // Rounding down leaves some over, which goes to the commonest byte. Rounding rare bytes up to 1 may take
+    // too much, which comes out of the largest frequencies.
+    if (sum < PROB_SCALE)
+        ret[std::max_element(ret.begin(), ret.end())-ret.begin()] += PROB_SCALE-sum;
+    while (sum > PROB_SCALE) {
+        uint32_t& largest = *std::max_element(ret.begin(), ret.end());
+        const uint32_t take = std::min(sum-PROB_SCALE, largest/2);
+        largest -= take;
+        sum -= take;
+    }
+    return ret;
+}
+
+// Appends the block for size bytes at data to out.
+inline void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    std::array<uint64_t, 256> counts{};
+    for (size_t i = 0; i < size; ++i)
+        ++counts[data[i]];
+    const std::array<uint32_t, 256> freq = normalize(counts, std::max<uint64_t>(1, size));
+    std::array<uint32_t, 256> start{};
+    for (size_t s = 1; s < 256; ++s)
+        start[s] = start[s-1]+freq[s-1];
+
+    put_varint(out, size);
+    for (uint32_t f : freq)
+        put_varint(out, f);
+
+    // The encoder runs backwards, writing backwards from the end of a buffer big enough for the worst case,
+    // 12 bits per byte, so the decoder reads forwards.
+    std::vector<uint8_t> buffer(size+size/2+4*STATES+16);
+    uint8_t* ptr = buffer.data()+buffer.size();
+    std::array<uint32_t, STATES> state;
+    state.fill(LOWER);
+    for (size_t i = size; i-- > 0; ) {
+        uint32_t& x = state[i%STATES];
+        const uint32_t f = freq[data[i]];
+        const uint32_t x_max = ((LOWER >> PROB_BITS) << 8)*f;
+        while (x >= x_max) {
+            *--ptr = static_cast<uint8_t>(x);
+            x >>= 8;
+        }
+        x = ((x/f) << PROB_BITS)+(x%f)+start[data[i]];
+    }
+    for (size_t k = STATES; k-- > 0; ) {
+        ptr -= 4;
+        for (unsigned b = 0; b < 4; ++b)
+            ptr[b] = static_cast<uint8_t>(state[k] >> (8*b));
+    }
+    const size_t coded = static_cast<size_t>(buffer.data()+buffer.size()-ptr);
+    put_varint(out, coded);
+    out.insert(out.end(), ptr, ptr+coded);
+}
+
+// Decodes the block at in, replacing out with its bytes, and advances in past it.
+inline void decompress(const uint8_t*& in, const uint8_t* end, std::vector<uint8_t>& out) {
+    const uint64_t size = get_varint(in, end);
+    std::array<uint32_t, 256> freq{}, start{};
+    std::array<uint8_t, PROB_SCALE> symbol{};
+    uint32_t sum = 0;
+    for (size_t s = 0; s < 256; ++s) {
+        freq[s] = static_cast<uint32_t>(get_varint(in, end));
+        if (freq[s] > PROB_SCALE-sum)
+            throw std::runtime_error("bad entropy block frequencies");
+        start[s] = sum;
+        std::fill(symbol.begin()+sum, symbol.begin()+sum+freq[s], static_cast<uint8_t>(s));
+        sum += freq[s];
+    }
+    if (size > 0 && sum != PROB_SCALE)
+        throw std::runtime_error("bad entropy block frequencies");
+    const uint64_t coded = get_varint(in, end);
+    if (coded < 4*STATES || coded > static_cast<uint64_t>(end-in))
+        throw std::runtime_error("truncated entropy block");
+    const uint8_t* ptr = in;
+    const uint8_t* const stop = in+coded;
+    in = stop;
+
+    std::array<uint32_t, STATES> state;
+    for (uint32_t& x : state) {
+        x = ptr[0] | ptr[1] << 8 | ptr[2] << 16 | static_cast<uint32_t>(ptr[3]) << 24;
+        ptr += 4;
+    }
+    out.resize(size);
+    constexpr uint32_t mask = PROB_SCALE-1;
+    for (size_t i = 0; i < size; ++i) {
+        uint32_t& x = state[i%STATES];
+        const uint8_t s = symbol[x & mask];
+        out[i] = s;
+        x = freq[s]*(x >> PROB_BITS)+(x & mask)-start[s];
+        while (x < LOWER) {
+            if (ptr == stop)
+                throw std::runtime_error("truncated entropy block");
+            x = x << 8 | *ptr++;
+        }
+    }
+}
+
+}    // namespace entropy
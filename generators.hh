@@ -0,0 +1,188 @@
+// generators.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "parallel.hh"
+#include "particles.hh"
+#include "randomize.hh"
+
+// Standard initial conditions for scaling benchmarks, as alternatives to BasicParticle::init_particle_grid().
+// Each generator depends only on the particle count and the seed. It runs across the worker threads, and its
+// random numbers are keyed by particle ID, so it gives the same particles for any thread count. Every particle
+// has the same diameter, so the same mass, and in 3-D the discs lie in the xy plane.
+namespace generators {
+
+constexpr float DIAMETER = 2.0F;
+constexpr double SCALE_RADIUS = 200.0;    // The default Plummer radius, disc scale length and ring radius.
+
+enum class Generator {
+    grid,    // BasicParticle::init_particle_grid(), sized to about the requested count.
+    plummer,    // A Plummer sphere in equilibrium. 3-D only.
+    exponential_disc,    // An exponential disc on circular orbits.
+    rosette,    // A Klemperer rosette: one ring of equal bodies, whose order is the count.
+    uniform_disc,    // A uniform disc at rest, for a cold collapse.
+};
+
+inline Generator generator_from_name(const std::string& name) {
+    if (name == "grid") return Generator::grid;
+    if (name == "plummer") return Generator::plummer;
+    if (name == "exponential_disc") return Generator::exponential_disc;
+    if (name == "rosette") return Generator::rosette;
+    if (name == "uniform_disc") return Generator::uniform_disc;
+    throw std::runtime_error("unknown generator: "+name);
+}
+
+inline double particle_mass() {
+    return glm::pi<double>()*(DIAMETER/2.0)*(DIAMETER/2.0);
+}
+
+// Makes count particles concurrently. make(p, rize) sets each particle's position and velocity.
+template <glm::length_t D, typename Precision, typename F>
+inline BasicParticles<D, Precision> generate(size_t count, std::optional<size_t> seed, F&& make) {
+    using Particle = BasicParticle<D, Precision>;
+    const CounterRandomize rize = seed ? CounterRandomize(0, 1, *seed) : CounterRandomize(0, 1);
+    BasicParticles<D, Precision> particles(count);
+    parallel::for_blocks(count, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            Particle& p = particles[i];
+            p.id = i;
+            p.diameter = DIAMETER;
+            p.color = Particle::choose_color_from_size(p.diameter);
+            make(p, rize);
+        }
+    });
+
+    // Remove any net momentum so the system stays in place. Summed in ID order, so it's the same on any thread count.
+    glm::vec<D, double> momentum(0.0);
+    for (const Particle& p : particles)
+        momentum += glm::vec<D, double>(p.velocity);
+    if (count > 0)
+        for (Particle& p : particles)
+            p.velocity -= typename Particle::Velocity(momentum/static_cast<double>(count));
+    return particles;
+}
+
+// A random unit vector, using draws [draw, draw+1].
+template <glm::length_t D>
+inline glm::vec<D, double> random_direction(const CounterRandomize& rize, size_t item, uint32_t draw) {
+    const double phi = glm::two_pi<double>()*rize.uniform(item, draw);
+    glm::vec<D, double> direction(0.0);
+    if constexpr (D == 3) {
+        const double z = 2.0*rize.uniform(item, draw+1)-1.0;
+        const double planar = std::sqrt(1.0-z*z);
+        direction[0] = planar*std::cos(phi);
+        direction[1] = planar*std::sin(phi);
+        direction[2] = z;
+    } else {
+        direction[0] = std::cos(phi);
+        direction[1] = std::sin(phi);
+    }
+    return direction;
+}
+
+// A Plummer sphere with scale radius a, sampled as in Aarseth, Henon and Wielen (1974), and truncated at
+// 99.9% of its mass so that no particle starts absurdly far out.
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> plummer(size_t count, std::optional<size_t> seed, double a = SCALE_RADIUS) {
+    static_assert(D == 3, "a Plummer sphere needs 3 dimensions");
+    const double total_mass = count*particle_mass();
+    return generate<D, Precision>(count, seed, [=](BasicParticle<D, Precision>& p, const CounterRandomize& rize) {
+        const double x = 0.999*(1.0-rize.uniform(p.id, 0));    // The fraction of the mass inside the particle.
+        const double r = a/std::sqrt(std::pow(x, -2.0/3.0)-1.0);
+        p.position = typename BasicParticle<D, Precision>::Position(r*random_direction<D>(rize, p.id, 1));
+
+        // Rejection sampling of the speed as a fraction q of the escape speed, from g(q) = q^2*(1-q^2)^(7/2).
+        uint32_t draw = 3;
+        double q = 0.0;
+        while (true) {
+            q = rize.uniform(p.id, draw++);
+            const double g = rize.uniform(p.id, draw++)*0.1;
+            if (g < q*q*std::pow(1.0-q*q, 3.5)) break;
+        }
+        const double escape = std::sqrt(2.0*GRAVITY*total_mass/std::sqrt(r*r+a*a));
+        p.velocity = typename BasicParticle<D, Precision>::Velocity(q*escape*random_direction<D>(rize, p.id, draw));
+    });
+}
+
+// An exponential disc, surface density proportional to exp(-R/scale_length), truncated at ten scale lengths.
+// Every particle is on a circular orbit at the speed for a razor-thin exponential disc, from Freeman (1970).
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> exponential_disc(size_t count, std::optional<size_t> seed, double scale_length = SCALE_RADIUS) {
+    const double surface_density = count*particle_mass()/(glm::two_pi<double>()*scale_length*scale_length);
+    return generate<D, Precision>(count, seed, [=](BasicParticle<D, Precision>& p, const CounterRandomize& rize) {
+        // The radius has density R*exp(-R/scale_length), which is a gamma distribution with shape 2.
+        double radius = 0.0;
+        for (uint32_t draw = 1; radius == 0.0 || radius > 10.0*scale_length; draw += 2)
+            radius = -scale_length*std::log((1.0-rize.uniform(p.id, draw))*(1.0-rize.uniform(p.id, draw+1)));
+        const double phi = glm::two_pi<double>()*rize.uniform(p.id, 0);
+        const double y = radius/(2.0*scale_length);
+        const double speed = std::sqrt(4.0*glm::pi<double>()*GRAVITY*surface_density*scale_length*y*y
+            *(std::cyl_bessel_i(0.0, y)*std::cyl_bessel_k(0.0, y)-std::cyl_bessel_i(1.0, y)*std::cyl_bessel_k(1.0, y)));
+        p.position[0] = radius*std::cos(phi);
+        p.position[1] = radius*std::sin(phi);
+        p.velocity[0] = -speed*std::sin(phi);
+        p.velocity[1] = speed*std::cos(phi);
+    });
+}
+
+// A Klemperer rosette of order count: equal bodies evenly spaced around a ring, each on the circular orbit
+// where the pull of all the others balances, v^2 = G*m/R*sum(1/(4*sin(pi*j/count))) for j in [1, count).
+// The seed only turns the ring. Neighbours must stay further apart than the softening, so the order should be
+// below a few hundred.
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> rosette(size_t count, std::optional<size_t> seed, double radius = SCALE_RADIUS) {
+    double sum = 0.0;
+    for (size_t j = 1; j < count; ++j)
+        sum += 1.0/(4.0*std::sin(glm::pi<double>()*j/count));
+    const double speed = std::sqrt(GRAVITY*particle_mass()/radius*sum);
+    return generate<D, Precision>(count, seed, [=](BasicParticle<D, Precision>& p, const CounterRandomize& rize) {
+        const double phi = glm::two_pi<double>()*(rize.uniform(0, 0)+static_cast<double>(p.id)/count);
+        p.position[0] = radius*std::cos(phi);
+        p.position[1] = radius*std::sin(phi);
+        p.velocity[0] = -speed*std::sin(phi);
+        p.velocity[1] = speed*std::cos(phi);
+    });
+}
+
+// A disc of uniform surface density, at rest.
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> uniform_disc(size_t count, std::optional<size_t> seed, double radius = 5.0*SCALE_RADIUS) {
+    return generate<D, Precision>(count, seed, [=](BasicParticle<D, Precision>& p, const CounterRandomize& rize) {
+        const double r = radius*std::sqrt(rize.uniform(p.id, 0));
+        const double phi = glm::two_pi<double>()*rize.uniform(p.id, 1);
+        p.position[0] = r*std::cos(phi);
+        p.position[1] = r*std::sin(phi);
+    });
+}
+
+// Makes about count particles with a run-time choice of generator.
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> make_particles(Generator generator, size_t count, std::optional<size_t> seed) {
+    switch (generator) {
+    case Generator::plummer:
+        if constexpr (D == 3)
+            return plummer<D, Precision>(count, seed);
+        else
+            throw std::runtime_error("a Plummer sphere needs 3 dimensions");
+    case Generator::exponential_disc: return exponential_disc<D, Precision>(count, seed);
+    case Generator::rosette: return rosette<D, Precision>(count, seed);
+    case Generator::uniform_disc: return uniform_disc<D, Precision>(count, seed);
+    case Generator::grid: break;
+    }
+    // The same lattice spacing and speeds as the default simulation, with the radius chosen for the count.
+    const double radius = D == 3 ? 20.0*std::cbrt(3.0*count/(4.0*glm::pi<double>())) : 20.0*std::sqrt(count/glm::pi<double>());
+    return BasicParticle<D, Precision>::init_particle_grid(0, 0, static_cast<int32_t>(radius), 10, 20, seed);
+}
+
+}    // namespace generators
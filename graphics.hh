@@ -35,13 +35,13 @@ inline const char *vertex_shader_text =
     "uniform mat4 model;"
     "uniform mat4 view;"
     "uniform mat4 projection;"
-    "layout (location = 0) in vec2 pos;\n"
+    "layout (location = 0) in vec3 pos;\n"
     "layout (location = 1) in float sz;\n"
     "layout (location = 2) in vec4 in_color;\n"
     "out vec4 star_color;\n"
     "void main()\n"
     "{\n"
-    "    gl_Position = projection * view * model * vec4(pos, 0.0, 1.0);\n"
+    "    gl_Position = projection * view * model * vec4(pos.xy, 0.0, 1.0);\n"
     "    gl_PointSize = sz;\n"
     "    star_color = in_color;\n"
     "}\n";
@@ -0,0 +1,987 @@
+// gravity_benchmark.cu
+// Copyright (C) 2023 by Shawn Yarbrough
+
+// Headless benchmarks of the simulation kernels. Usage: gravity-benchmark <benchmark> [options...]
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace std::literals;
+
+#include "counters.hh"
+#include "generators.hh"
+#include "hardware.hh"
+#include "infall.hh"
+#include "particles.hh"
+#include "precision.hh"
+#include "render.hh"
+#include "shared.hh"
+#include "stream.hh"
+#include "trajectory.hh"
+#include "tree.hh"
+
+namespace benchmark {
+
+constexpr float TIMESTEP = 1.0F/60.0F;
+constexpr size_t SAMPLES = 1000;    // Particles summed directly to measure the error of an approximate solver.
+constexpr double FLOPS_PER_PAIR = 20.0;    // The usual count for a softened gravity pair, with the sqrt and divisions as one each.
+
+// Kinetic and potential energy, summed in double across the worker threads. The potential matches the force
+// law in BasicParticle::accelerate_particle(), including its softening.
+struct Energies {
+    double kinetic{0.0};
+    double potential{0.0};
+
+    inline double total() const { return kinetic+potential; }
+};
+
+template <glm::length_t D, typename Precision>
+Energies energies(const BasicParticles<D, Precision>& particles) {
+    auto mass = [](const BasicParticle<D, Precision>& p) { double r = p.diameter/2.0; return glm::pi<double>()*r*r; };
+    std::vector<Energies> partials(parallel::thread_count());
+    parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t t) {
+        for (size_t i1 = begin; i1 < end; ++i1) {
+            const auto& p1 = particles[i1];
+            const glm::vec<D, double> v(p1.velocity);
+            partials[t].kinetic += 0.5*mass(p1)*glm::dot(v, v);
+            for (size_t i2 = i1+1; i2 < particles.size(); ++i2) {
+                const auto& p2 = particles[i2];
+                const glm::vec<D, double> d = glm::vec<D, double>(p2.position)-glm::vec<D, double>(p1.position);
+                partials[t].potential -= GRAVITY*mass(p1)*mass(p2)/std::sqrt(std::max(glm::dot(d, d), 3.0));
+            }
+        }
+    });
+    Energies ret;
+    for (const Energies& partial : partials) {
+        ret.kinetic += partial.kinetic;
+        ret.potential += partial.potential;
+    }
+    return ret;
+}
+
+// A heavy central body with light bodies on widely spaced circular orbits. Nothing collides, so any change
+// in the total energy is integration and rounding error.
+template <typename Precision>
+BasicParticles<2, Precision> orbits(size_t count) {
+    using Particle = BasicParticle<2, Precision>;
+    BasicParticles<2, Precision> particles;
+    Particle sun;
+    sun.id = 0;
+    sun.diameter = 100.0F;
+    particles.push_back(sun);
+    const double sun_mass = glm::pi<double>()*50.0*50.0;
+    for (size_t i = 0; i < count; ++i) {
+        const double radius = 150.0+i*(850.0/count);
+        const double angle = i*2.39996;    // The golden angle spreads the bodies around the sun.
+        Particle p;
+        p.id = particles.size();
+        p.diameter = 0.5F;    // Light enough that neighbouring orbits barely disturb each other.
+        p.position = typename Particle::Position(radius*std::cos(angle), radius*std::sin(angle));
+        const double speed = std::sqrt(GRAVITY*sun_mass/radius);
+        p.velocity = typename Particle::Velocity(-speed*std::sin(angle), speed*std::cos(angle));
+        particles.push_back(p);
+    }
+    // Give the sun the opposite momentum, so the system as a whole stays in place.
+    typename Particle::Velocity momentum(0.0F, 0.0F);
+    for (size_t i = 1; i < particles.size(); ++i)
+        momentum += particles[i].velocity*static_cast<typename Precision::accumulator_type>(glm::pi<double>()*0.25*0.25);
+    particles[0].velocity = -momentum/static_cast<typename Precision::accumulator_type>(sun_mass);
+    return particles;
+}
+
+// Throughput of the direct kernel against the energy error on long orbits, for each precision policy.
+// Options: [grid radius=600] [steps=20] [orbit steps=20000]
+int precision(int argc, char* argv[]) {
+    const int32_t radius = argc > 0 ? std::stoi(argv[0]) : 600;
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 20;
+    const size_t orbit_steps = argc > 2 ? std::stoul(argv[2]) : 20000;
+
+    std::cout << std::setw(8) << "policy" << std::setw(12) << "particles" << std::setw(16) << "Mpairs/s"
+              << std::setw(20) << "energy error" << std::setw(12) << "merges" << std::endl;
+    for (Precision precision : {Precision::single, Precision::mixed, Precision::double_}) {
+        with_precision(precision, [&]<typename Precision>() {
+            using Particle = BasicParticle<2, Precision>;
+            BasicParticles<2, Precision> particles = Particle::init_particle_grid(0, 0, radius, 10, 20, /*seed=*/1);
+            BasicParticles<2, Precision> store;
+            const size_t n = particles.size();
+            double pairs = 0.0;
+            auto ts1 = std::chrono::steady_clock::now();
+            for (size_t s = 0; s < steps; ++s) {
+                pairs += static_cast<double>(particles.size())*(particles.size()-1);
+                Particle::accelerate_particles(particles, store, TIMESTEP);
+                Particle::move_particles(particles, TIMESTEP);
+            }
+            auto ts2 = std::chrono::steady_clock::now();
+
+            BasicParticles<2, Precision> bodies = orbits<Precision>(16);
+            const size_t body_count = bodies.size();
+            const Energies energy1 = energies(bodies);
+            for (size_t s = 0; s < orbit_steps; ++s) {
+                Particle::accelerate_particles(bodies, store, TIMESTEP);
+                Particle::move_particles(bodies, TIMESTEP);
+            }
+            const Energies energy2 = energies(bodies);
+
+            std::cout << std::setw(8) << Precision::name << std::setw(12) << n
+                      << std::setw(16) << std::fixed << std::setprecision(1) << pairs/std::chrono::duration<double>(ts2-ts1).count()/1e6
+                      << std::setw(20) << std::scientific << std::setprecision(3) << std::abs((energy2.total()-energy1.total())/energy1.total())
+                      << std::setw(12) << body_count-bodies.size() << std::defaultfloat << std::endl;
+        });
+    }
+    return EXIT_SUCCESS;
+}
+
+// A ball of about count bodies on a cubic lattice, ten units apart, so that no two touch. Unless it spins,
+// the bodies start at rest, so a solver's output velocity is the acceleration.
+template <typename Precision>
+BasicParticles<3, Precision> cloud(size_t count, bool spin = false) {
+    const int32_t radius = static_cast<int32_t>(10.0*std::cbrt(3.0*count/(4.0*glm::pi<double>())));
+    BasicParticles<3, Precision> particles = BasicParticle<3, Precision>::init_particle_grid(0, 0, radius, 10, 10, /*seed=*/1);
+    if (!spin)
+        for (auto& p : particles)
+            p.velocity = typename BasicParticle<3, Precision>::Velocity(0.0F);
+    return particles;
+}
+
+// Direct-sum accelerations of every stride'th particle, so that approximate solvers can be checked
+// against them. Also returns the time a full direct sum would take on every thread.
+struct Sampled {
+    size_t stride;
+    std::vector<glm::dvec3> accelerations;
+    double direct_time;
+};
+
+inline Sampled sample_direct(const BasicParticles<3, SinglePrecision>& particles) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t n = particles.size();
+    Sampled sampled{std::max<size_t>(1, n/SAMPLES), {}, 0.0};
+    Collisions collisions;
+    auto ts1 = std::chrono::steady_clock::now();
+    for (size_t i1 = 0; i1 < n; i1 += sampled.stride) {
+        Particle exact = particles[i1];
+        for (size_t i2 = 0; i2 < n; ++i2)
+            if (i1 != i2)
+                Particle::accelerate_particle(particles[i1], particles[i2], exact, particles[i2], collisions, 1.0F);
+        sampled.accelerations.push_back(glm::dvec3(exact.velocity));
+    }
+    auto ts2 = std::chrono::steady_clock::now();
+    sampled.direct_time = std::chrono::duration<double>(ts2-ts1).count()*n/sampled.accelerations.size()/parallel::thread_count();
+    return sampled;
+}
+
+// The RMS and maximum relative error of a solver's accelerations against the sampled direct sum.
+inline std::pair<double, double> sampled_error(const Sampled& sampled, const BasicParticles<3, SinglePrecision>& approximate) {
+    double squares = 0.0;
+    double worst = 0.0;
+    for (size_t s = 0; s < sampled.accelerations.size(); ++s) {
+        const glm::dvec3& a = sampled.accelerations[s];
+        const double relative = glm::length(glm::dvec3(approximate[s*sampled.stride].velocity)-a)/glm::length(a);
+        squares += relative*relative;
+        worst = std::max(worst, relative);
+    }
+    return {std::sqrt(squares/sampled.accelerations.size()), worst};
+}
+
+// Speed and force error of the 3-D Barnes-Hut tree against the direct sum. The direct sum is only run for
+// SAMPLES particles on one thread, and its full time on every thread is extrapolated.
+// Options: [theta=0.5] [bodies...=10000 100000 1000000]
+int tree(int argc, char* argv[]) {
+    const float theta = argc > 0 ? std::stof(argv[0]) : tree::THETA;
+    std::vector<size_t> counts;
+    for (int a = 1; a < argc; ++a)
+        counts.push_back(std::stoul(argv[a]));
+    if (counts.empty())
+        counts = {10000, 100000, 1000000};
+
+    std::cout << std::setw(10) << "bodies" << std::setw(10) << "nodes" << std::setw(12) << "tree s" << std::setw(12) << "direct s"
+              << std::setw(10) << "speedup" << std::setw(14) << "rms error" << std::setw(14) << "max error" << std::endl;
+    for (size_t count : counts) {
+        const BasicParticles<3, SinglePrecision> particles = cloud<SinglePrecision>(count);
+
+        tree::Solver<3, SinglePrecision> solver(theta);
+        BasicParticles<3, SinglePrecision> approximate = particles;
+        auto ts1 = std::chrono::steady_clock::now();
+        solver.accelerate_particles(approximate, 1.0F);
+        auto ts2 = std::chrono::steady_clock::now();
+        if (approximate.size() != particles.size())
+            throw std::runtime_error("bodies merged");
+        const double tree_time = std::chrono::duration<double>(ts2-ts1).count();
+        const Sampled sampled = sample_direct(particles);
+        const auto [rms, worst] = sampled_error(sampled, approximate);
+
+        std::cout << std::setw(10) << particles.size() << std::setw(10) << solver.node_count()
+                  << std::setw(12) << std::fixed << std::setprecision(4) << tree_time << std::setw(12) << sampled.direct_time
+                  << std::setw(10) << std::setprecision(1) << sampled.direct_time/tree_time
+                  << std::setw(14) << std::scientific << std::setprecision(3) << rms
+                  << std::setw(14) << worst << std::defaultfloat << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+// The machine's peak float rate: independent multiply-add chains on every thread, which the compiler can vectorise.
+inline double peak_gflops() {
+    constexpr size_t lanes = 64;
+    constexpr size_t rounds = 4000000;
+    const size_t thread_count = parallel::thread_count();
+    std::vector<float> results(thread_count);
+    auto ts1 = std::chrono::steady_clock::now();
+    parallel::for_blocks(thread_count, [&](size_t begin, size_t end, size_t) {
+        for (size_t t = begin; t < end; ++t) {
+            float sums[lanes];
+            for (size_t k = 0; k < lanes; ++k)
+                sums[k] = static_cast<float>(t+k);
+            for (size_t r = 0; r < rounds; ++r)
+                for (size_t k = 0; k < lanes; ++k)
+                    sums[k] = sums[k]*0.999999F+0.000001F;
+            for (size_t k = 0; k < lanes; ++k)
+                results[t] += sums[k];
+        }
+    });
+    auto ts2 = std::chrono::steady_clock::now();
+    return 2.0*lanes*rounds*thread_count/std::chrono::duration<double>(ts2-ts1).count()/1e9;
+}
+
+// The machine's memory bandwidth, from the best of a few triads, a = b+s*c, over arrays much larger than cache.
+inline double memory_gbytes() {
+    const size_t n = std::max<size_t>(8 << 20, hardware::cache_size(3)/sizeof(float));
+    std::vector<float> a(n), b(n, 1.0F), c(n, 2.0F);
+    double best = 0.0;
+    for (int repeat = 0; repeat < 5; ++repeat) {
+        auto ts1 = std::chrono::steady_clock::now();
+        parallel::for_blocks(n, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i)
+                a[i] = b[i]+3.0F*c[i];
+        });
+        auto ts2 = std::chrono::steady_clock::now();
+        best = std::max(best, 3.0*n*sizeof(float)/std::chrono::duration<double>(ts2-ts1).count()/1e9);
+    }
+    return best;
+}
+
+// The roofline's streaming baseline: accelerate_particle() for each target in the block from every source in
+// turn, without cache blocking.
+inline Collisions streamed_block(const BasicParticles<3, SinglePrecision>& in_particles, BasicParticles<3, SinglePrecision>& out_particles, float delta, size_t block_size, size_t block_start, float*) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    Collisions collisions;
+    for (size_t i1 = block_start; i1 < block_start+block_size && i1 < in_particles.size(); ++i1)
+        for (size_t i2 = 0; i2 < in_particles.size(); ++i2)
+            if (i1 != i2)
+                Particle::accelerate_particle(in_particles[i1], in_particles[i2], out_particles[i1], out_particles[i2], collisions, delta);
+    return collisions;
+}
+
+// Achieved GFLOP/s of the direct force kernel, streaming and cache blocked, against the machine's peak and
+// the roofline bound, min(peak, arithmetic intensity*bandwidth). The streaming kernel reloads a whole
+// particle for every pair. The tiled kernel reloads a source's position, radius and mass from beyond level 1
+// only once per TARGET_TILE targets. On the 3-D cloud, which doesn't merge, so both kernels do the same pairs.
+// Options: [bodies=20000] [repeats=3]
+int roofline(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 20000;
+    const size_t repeats = argc > 1 ? std::stoul(argv[1]) : 3;
+    const BasicParticles<3, SinglePrecision> particles = cloud<SinglePrecision>(count);
+    const double pairs = static_cast<double>(particles.size())*(particles.size()-1);
+
+    const double peak = peak_gflops();
+    const double bandwidth = memory_gbytes();
+    std::cout << particles.size() << " bodies, " << parallel::thread_count() << " threads, L1d " << hardware::cache_size(1)/1024
+              << " KiB, L2 " << hardware::cache_size(2)/1024 << " KiB, source tile " << Particle::source_tile_size() << "\n"
+              << std::fixed << std::setprecision(1) << "peak " << peak << " GFLOP/s, triad " << bandwidth << " GB/s, "
+              << FLOPS_PER_PAIR << " flops per pair" << std::defaultfloat << std::endl;
+
+    using Kernel = Collisions (*)(const BasicParticles<3, SinglePrecision>&, BasicParticles<3, SinglePrecision>&, float, size_t, size_t, float*);
+    auto run = [&](Kernel kernel, BasicParticles<3, SinglePrecision>& out_particles) {
+        double best = std::numeric_limits<double>::max();
+        for (size_t r = 0; r < repeats; ++r) {
+            out_particles = particles;
+            auto ts1 = std::chrono::steady_clock::now();
+            parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t) {
+                if (!kernel(particles, out_particles, TIMESTEP, end-begin, begin, nullptr).empty())
+                    throw std::runtime_error("bodies touched");
+            });
+            auto ts2 = std::chrono::steady_clock::now();
+            best = std::min(best, std::chrono::duration<double>(ts2-ts1).count());
+        }
+        return best;
+    };
+    BasicParticles<3, SinglePrecision> streamed;
+    BasicParticles<3, SinglePrecision> tiled;
+    const double streamed_time = run(streamed_block, streamed);
+    const double tiled_time = run(Particle::accelerate_particle_block_tiled<false>, tiled);
+    // The arithmetic is the same, so the results are identical unless the compiler contracts a multiply and an
+    // add into an FMA in one kernel and not the other.
+    double difference = 0.0;
+    for (size_t i = 0; i < particles.size(); ++i)
+        difference = std::max<double>(difference, glm::length(streamed[i].velocity-tiled[i].velocity)/glm::length(streamed[i].velocity));
+
+    // Bytes from beyond level 1 per pair.
+    const double streamed_intensity = FLOPS_PER_PAIR/sizeof(Particle);
+    const double tiled_intensity = FLOPS_PER_PAIR/((3*sizeof(float)+2*sizeof(float))/static_cast<double>(TARGET_TILE));
+    std::cout << std::setw(10) << "kernel" << std::setw(12) << "seconds" << std::setw(12) << "GFLOP/s" << std::setw(12) << "% of peak"
+              << std::setw(14) << "flops/byte" << std::setw(14) << "bound" << std::endl;
+    for (const auto& [name, seconds, intensity] : {std::tuple{"streamed", streamed_time, streamed_intensity}, std::tuple{"tiled", tiled_time, tiled_intensity}}) {
+        const double gflops = pairs*FLOPS_PER_PAIR/seconds/1e9;
+        std::cout << std::setw(10) << name << std::fixed << std::setprecision(4) << std::setw(12) << seconds << std::setprecision(2)
+                  << std::setw(12) << gflops << std::setw(12) << 100.0*gflops/peak << std::setw(14) << intensity
+                  << std::setw(14) << std::min(peak, intensity*bandwidth) << std::defaultfloat << std::endl;
+    }
+    std::cout << "speedup " << std::fixed << std::setprecision(2) << streamed_time/tiled_time << "x, results ";
+    if (difference == 0.0) std::cout << "identical";
+    else std::cout << "differ by up to " << std::scientific << difference << " relative";
+    std::cout << std::defaultfloat << std::endl;
+    return difference < 1e-4 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Speed and force error of the fast reciprocal square root kernel against the exact tiled kernel, in float and
+// double, on the 3-D cloud. The error is in each body's change of velocity, which is its total force.
+// Options: [bodies=20000] [repeats=3]
+int rsqrt(int argc, char* argv[]) {
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 20000;
+    const size_t repeats = argc > 1 ? std::stoul(argv[1]) : 3;
+    auto compare = [&]<typename Precision>(const char* name) {
+        using Particle = BasicParticle<3, Precision>;
+        const BasicParticles<3, Precision> particles = cloud<Precision>(count);
+        using Kernel = Collisions (*)(const BasicParticles<3, Precision>&, BasicParticles<3, Precision>&, float, size_t, size_t, typename Precision::accumulator_type*);
+        auto run = [&](Kernel kernel, BasicParticles<3, Precision>& out_particles) {
+            double best = std::numeric_limits<double>::max();
+            for (size_t r = 0; r < repeats; ++r) {
+                out_particles = particles;
+                auto ts1 = std::chrono::steady_clock::now();
+                parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t) {
+                    if (!kernel(particles, out_particles, TIMESTEP, end-begin, begin, nullptr).empty())
+                        throw std::runtime_error("bodies touched");
+                });
+                auto ts2 = std::chrono::steady_clock::now();
+                best = std::min(best, std::chrono::duration<double>(ts2-ts1).count());
+            }
+            return best;
+        };
+        BasicParticles<3, Precision> exact;
+        BasicParticles<3, Precision> fast;
+        const double exact_time = run(Particle::template accelerate_particle_block_tiled<false>, exact);
+        const double fast_time = run(Particle::template accelerate_particle_block_tiled<true>, fast);
+        double worst = 0.0;
+        double squares = 0.0;
+        for (size_t i = 0; i < particles.size(); ++i) {
+            const glm::dvec3 force(exact[i].velocity-particles[i].velocity);
+            const glm::dvec3 approximate(fast[i].velocity-particles[i].velocity);
+            const double error = glm::length(approximate-force)/glm::length(force);
+            worst = std::max(worst, error);
+            squares += error*error;
+        }
+        std::cout << std::setw(8) << name << std::setw(8) << particles.size() << std::fixed << std::setprecision(4) << std::setw(12) << exact_time << std::setw(12) << fast_time
+                  << std::setprecision(2) << std::setw(10) << exact_time/fast_time << "x" << std::scientific << std::setprecision(2)
+                  << std::setw(14) << std::sqrt(squares/particles.size()) << std::setw(14) << worst << std::defaultfloat << std::endl;
+    };
+    std::cout << parallel::thread_count() << " threads" << std::endl;
+    std::cout << std::setw(8) << "type" << std::setw(8) << "bodies" << std::setw(12) << "exact s" << std::setw(12) << "fast s" << std::setw(11) << "speedup"
+              << std::setw(14) << "rms error" << std::setw(14) << "max error" << std::endl;
+    compare.template operator()<SinglePrecision>("float");
+    compare.template operator()<DoublePrecision>("double");
+    return EXIT_SUCCESS;
+}
+
+// Step time and worker idle time of the direct solver with one contiguous block per thread, as a chunk of
+// n/threads particles, against automatic chunks from a shared counter. On the spinning 3-D cloud, which
+// collapses and merges, so some particles have many collisions and some have none.
+// Options: [bodies=10000] [steps=20]
+int balance(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 10000;
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 20;
+    const BasicParticles<3, SinglePrecision> initial = cloud<SinglePrecision>(count, /*spin=*/true);
+    const size_t thread_count = parallel::thread_count();
+    std::cout << initial.size() << " bodies, " << steps << " steps, " << thread_count << " threads" << std::endl;
+    std::cout << std::setw(10) << "schedule" << std::setw(12) << "chunk" << std::setw(12) << "step s" << std::setw(12) << "slowest s"
+              << std::setw(14) << "efficiency" << std::endl;
+    for (size_t chunk : {(initial.size()+thread_count-1)/thread_count, size_t{0}}) {
+        parallel::chunk = chunk;
+        parallel::reset_balance();
+        BasicParticles<3, SinglePrecision> particles = initial;
+        BasicParticles<3, SinglePrecision> store;
+        double total = 0.0;
+        double slowest = 0.0;
+        for (size_t s = 0; s < steps; ++s) {
+            auto ts1 = std::chrono::steady_clock::now();
+            Particle::accelerate_particles(particles, store, TIMESTEP);
+            auto ts2 = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>(ts2-ts1).count();
+            total += seconds;
+            slowest = std::max(slowest, seconds);
+            Particle::move_particles(particles, TIMESTEP);
+        }
+        double busy = 0.0;
+        double idle = 0.0;
+        {
+            parallel::Balance& b = parallel::balance();
+            std::lock_guard lock(b.mutex);
+            for (size_t t = 0; t < b.busy.size(); ++t) {
+                busy += b.busy[t];
+                idle += b.idle[t];
+            }
+        }
+        std::cout << std::setw(10) << (chunk == 0 ? "dynamic" : "static") << std::setw(12) << (chunk == 0 ? "auto" : std::to_string(chunk))
+                  << std::fixed << std::setprecision(4) << std::setw(12) << total/steps << std::setw(12) << slowest << std::setprecision(1)
+                  << std::setw(13) << 100.0*busy/(busy+idle) << "%" << std::defaultfloat << std::endl;
+    }
+    parallel::chunk = 0;
+    return EXIT_SUCCESS;
+}
+
+// Direct solver step time on the CPUs of the first 1, 2, ... NUMA nodes with the workers pinned to them,
+// and on all of them unpinned, on the 3-D cloud. Each run copies the particles with the placement it uses.
+// Options: [bodies=20000] [steps=3]
+int numa(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 20000;
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 3;
+    const BasicParticles<3, SinglePrecision> initial = cloud<SinglePrecision>(count);
+    const auto& nodes = hardware::numa_nodes();
+    std::cout << initial.size() << " bodies, " << steps << " steps, " << nodes.size() << " NUMA nodes" << std::endl;
+    for (size_t node = 0; node < nodes.size(); ++node)
+        std::cout << "node " << node << ": " << nodes[node].size() << " CPUs" << std::endl;
+    std::cout << std::setw(8) << "nodes" << std::setw(10) << "pinned" << std::setw(10) << "threads" << std::setw(12) << "step s"
+              << std::setw(12) << "speedup" << std::endl;
+
+    const size_t saved_threads = parallel::threads;
+    double baseline = 0.0;
+    size_t cpus = 0;
+    for (size_t used = 1; used <= nodes.size()+1; ++used) {
+        const bool pinned = used <= nodes.size();
+        if (pinned)
+            cpus += nodes[used-1].size();
+        parallel::threads = cpus;
+        parallel::pin_nodes = pinned ? used : 0;
+        BasicParticles<3, SinglePrecision> particles;
+        BasicParticles<3, SinglePrecision> store;
+        Particle::copy_particles(initial, particles);
+        double best = std::numeric_limits<double>::max();
+        for (size_t s = 0; s < steps; ++s) {
+            auto ts1 = std::chrono::steady_clock::now();
+            Particle::accelerate_particles(particles, store, TIMESTEP);
+            auto ts2 = std::chrono::steady_clock::now();
+            best = std::min(best, std::chrono::duration<double>(ts2-ts1).count());
+            if (particles.size() != initial.size())
+                throw std::runtime_error("bodies merged");
+        }
+        if (used == 1)
+            baseline = best;
+        std::cout << std::setw(8) << (pinned ? used : nodes.size()) << std::setw(10) << (pinned ? "yes" : "no") << std::setw(10) << cpus
+                  << std::fixed << std::setprecision(4) << std::setw(12) << best << std::setprecision(2) << std::setw(11) << baseline/best
+                  << "x" << std::defaultfloat << std::endl;
+    }
+    parallel::threads = saved_threads;
+    parallel::pin_nodes = 0;
+    return EXIT_SUCCESS;
+}
+
+// Publishing each frame of the 3-D cloud to POSIX shared memory while another thread reads the latest frame
+// in place as fast as it can, as gravity-watch does from another process. The reader has its own mapping.
+// Options: [bodies=1000000] [frames=100]
+int shared_memory(int argc, char* argv[]) {
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 1000000;
+    const size_t frames = argc > 1 ? std::stoul(argv[1]) : 100;
+    const BasicParticles<3, SinglePrecision> particles = cloud<SinglePrecision>(count);
+    const std::string name = "/gravity-benchmark-"+std::to_string(getpid());
+    shared::Publisher publisher(name, 3);
+
+    std::atomic<bool> done{false};
+    size_t whole = 0;
+    size_t retried = 0;
+    volatile double sink = 0.0;    // So the reads aren't optimised away.
+    std::thread reading([&]() {
+        shared::Reader reader(name);
+        while (!done.load(std::memory_order_relaxed)) {
+            double sum = 0.0;
+            if (reader.read([&sum](const shared::Record* records, size_t n, uint64_t, double) {
+                for (size_t i = 0; i < n; ++i)
+                    sum += records[i].position[0];
+            })) {
+                ++whole;
+                sink = sum;
+            } else if (reader.frames() != 0) {
+                ++retried;
+            }
+        }
+    });
+
+    double total = 0.0;
+    double best = std::numeric_limits<double>::max();
+    for (size_t frame = 1; frame <= frames; ++frame) {
+        auto ts1 = std::chrono::steady_clock::now();
+        publisher.publish(particles, frame, frame*TIMESTEP);
+        auto ts2 = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(ts2-ts1).count();
+        total += seconds;
+        best = std::min(best, seconds);
+    }
+    done = true;
+    reading.join();
+    const double bytes = static_cast<double>(particles.size())*sizeof(shared::Record);
+    std::cout << particles.size() << " bodies, " << frames << " frames, " << bytes/1e6 << " MB per frame\n" << std::fixed << std::setprecision(4)
+              << "publish: " << total/frames << "s mean, " << best << "s best, " << std::setprecision(0) << bytes/best/1e6 << " MB/s\n"
+              << "reader: " << whole << " whole frames read in place, " << retried << " retried" << std::defaultfloat << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Streaming the frames of a Plummer sphere, which is near equilibrium and seldom merges, over a Unix domain
+// socket to three client stubs: one that takes every frame, one that takes every frame but is slow to read
+// them, and one at 10 frames per second. Two more ask for tolerances too fine for floats, one that the server
+// refuses as it subscribes and one that only the encoder can refuse, and fails if either gets a frame.
+// Reports how long publishing held up each step, what each client received, the bytes per frame against
+// the raw records, and the largest position error, from the frames the step loop kept.
+// Options: [bodies=5000] [frames=120] [bits=16]
+int stream(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 5000;
+    const size_t frames = argc > 1 ? std::stoul(argv[1]) : 120;
+    const unsigned bits = argc > 2 ? std::stoul(argv[2]) : 16;
+    BasicParticles<3, SinglePrecision> particles = generators::make_particles<3, SinglePrecision>(generators::Generator::plummer, count, /*seed=*/1);
+    const std::string path = "/tmp/gravity-benchmark-"+std::to_string(getpid())+".sock";
+    ::stream::Server server(path);
+
+    // Every published frame's positions, to measure the clients' errors.
+    std::mutex mutex;
+    std::map<uint64_t, std::vector<shared::Record>> history;
+    struct Result {
+        std::string name;
+        std::string subscription;
+        double delay;    // Seconds the client sleeps after each frame.
+        bool refused{false};    // The server should drop it without a frame.
+        size_t frames{0};
+        size_t bytes{0};
+        size_t raw{0};    // Of the records of the frames it received.
+        double error{0.0};
+        uint64_t last{0};
+    };
+    std::vector<Result> results = {
+        {"all frames", "rate=1000 fields=all bits="+std::to_string(bits), 0.0},
+        {"slow reader", "rate=1000 fields=position bits="+std::to_string(bits), 0.5},
+        {"10 fps", "rate=10 fields=position,diameter bits="+std::to_string(bits), 0.0},
+        {"bad tolerance", "rate=10 fields=position tolerance=1e-12", 0.0, true},
+        {"fine tolerance", "rate=10 fields=position tolerance=1e-6", 0.0, true},
+    };
+    std::vector<std::thread> clients;
+    for (Result& result : results)
+        clients.emplace_back([&path, &result, &mutex, &history]() {
+            ::stream::Client client(path, result.subscription);
+            shared::Frame frame;
+            while (client.receive(frame)) {
+                ++result.frames;
+                result.last = frame.frame;
+                {
+                    std::lock_guard lock(mutex);
+                    const std::vector<shared::Record>& original = history.at(frame.frame);
+                    result.raw += original.size()*sizeof(shared::Record);
+                    for (size_t i = 0; i < original.size(); ++i)
+                        for (size_t k = 0; k < 3; ++k)
+                            result.error = std::max<double>(result.error, std::abs(frame.records[i].position[k]-original[i].position[k]));
+                }
+                if (result.delay > 0.0)
+                    std::this_thread::sleep_for(std::chrono::duration<double>(result.delay));
+            }
+            result.bytes = client.bytes;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));    // For every client to subscribe.
+
+    BasicParticles<3, SinglePrecision> store;
+    double step_total = 0.0;
+    double publish_total = 0.0;
+    double publish_worst = 0.0;
+    for (size_t frame = 1; frame <= frames; ++frame) {
+        auto ts1 = std::chrono::steady_clock::now();
+        Particle::accelerate_particles(particles, store, TIMESTEP);
+        Particle::move_particles(particles, TIMESTEP);
+        auto ts2 = std::chrono::steady_clock::now();
+        {
+            std::vector<shared::Record> records(particles.size());
+            shared::copy_records(particles, records.data());
+            std::lock_guard lock(mutex);
+            history[frame] = std::move(records);
+        }
+        auto ts3 = std::chrono::steady_clock::now();
+        server.publish(particles, frame, frame*TIMESTEP);
+        auto ts4 = std::chrono::steady_clock::now();
+        step_total += std::chrono::duration<double>(ts2-ts1).count();
+        const double publish = std::chrono::duration<double>(ts4-ts3).count();
+        publish_total += publish;
+        publish_worst = std::max(publish_worst, publish);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));    // For the queues to drain.
+    server.stop();
+    for (std::thread& client : clients)
+        client.join();
+
+    const ::stream::Stats& totals = server.totals();
+    std::cout << particles.size() << " bodies, " << frames << " frames, " << bits << " bits\n" << std::fixed << std::setprecision(4)
+              << "step " << step_total/frames << "s mean, publish " << publish_total/frames << "s mean, " << publish_worst << "s worst\n"
+              << "server: " << totals.sent << " frames sent, " << totals.key_frames << " key frames, " << totals.dropped << " dropped"
+              << std::defaultfloat << std::endl;
+    std::cout << std::setw(14) << "client" << std::setw(10) << "frames" << std::setw(8) << "last" << std::setw(14) << "bytes/frame"
+              << std::setw(12) << "of raw" << std::setw(14) << "max error" << std::endl;
+    for (const Result& result : results) {
+        const double per_frame = result.frames == 0 ? 0.0 : static_cast<double>(result.bytes)/result.frames;
+        std::cout << std::setw(14) << result.name << std::setw(10) << result.frames << std::setw(8) << result.last << std::fixed
+                  << std::setprecision(0) << std::setw(14) << per_frame << std::setprecision(1) << std::setw(11)
+                  << 100.0*result.bytes/std::max<size_t>(1, result.raw) << "%" << std::scientific << std::setprecision(2)
+                  << std::setw(14) << result.error << std::defaultfloat << std::endl;
+    }
+    for (const Result& result : results)
+        if (result.refused && result.frames != 0)
+            throw std::runtime_error("the server sent frames to the "+result.name+" client");
+    return EXIT_SUCCESS;
+}
+
+// Encoding and decoding throughput, in MB/s of raw float32 fields, and the size and the largest errors of
+// the frames of a 2-D exponential disc, with the positions, velocities and diameters that a trajectory needs,
+// for a range of codec settings. The disc first settles for a few frames, since its overlapping particles
+// merge in a rush at the start. Fails if an error is over its tolerance. See codec.hh and trajectory.hh.
+// Options: [bodies=100000] [frames=20]
+int codec(int argc, char* argv[]) {
+    using Particle = BasicParticle<2, SinglePrecision>;
+    constexpr size_t SETTLE = 10;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 100000;
+    const size_t frame_count = argc > 1 ? std::stoul(argv[1]) : 20;
+    BasicParticles<2, SinglePrecision> particles = generators::make_particles<2, SinglePrecision>(generators::Generator::exponential_disc, count, /*seed=*/1);
+    tree::Solver<2, SinglePrecision> solver;
+    std::vector<std::vector<shared::Record>> frames;
+    for (size_t f = 0; f < SETTLE+frame_count; ++f) {
+        solver.accelerate_particles(particles, TIMESTEP);
+        Particle::move_particles(particles, TIMESTEP);
+        if (f < SETTLE)
+            continue;
+        frames.emplace_back(particles.size());
+        shared::copy_records(particles, frames.back().data());
+    }
+
+    const std::string fields = "fields=position,velocity,diameter ";
+    const std::vector<std::string> settings = {
+        "bits=16",
+        "bits=16 entropy=1",
+        "tolerance=0.01",
+        "tolerance=0.01 entropy=1",
+        "tolerance=0.001 entropy=1",
+        "tolerance=0.01 velocity-tolerance=0.1 entropy=1",
+    };
+    double raw = 0.0;
+    for (const std::vector<shared::Record>& records : frames)
+        raw += static_cast<double>(records.size())*::codec::components(::codec::position | ::codec::velocity | ::codec::diameter, 2).size()*sizeof(float);
+    std::cout << particles.size() << " bodies, " << frame_count << " frames, " << raw/1e6 << " MB raw" << std::endl;
+    std::cout << std::setw(48) << "settings" << std::setw(10) << "of raw" << std::setw(12) << "encode MB/s"
+              << std::setw(12) << "decode MB/s" << std::setw(16) << "position error" << std::setw(16) << "velocity error" << std::endl;
+    for (const std::string& setting : settings) {
+        std::vector<uint8_t> encoded;
+        std::vector<size_t> ends;
+        double encode = std::numeric_limits<double>::max();
+        double decode = std::numeric_limits<double>::max();
+        double position_error = 0.0, velocity_error = 0.0;
+        const ::codec::Settings parsed = ::codec::parse_settings(fields+setting);
+        for (int repeat = 0; repeat < 3; ++repeat) {
+            ::codec::Encoder encoder(parsed);
+            encoded.clear();
+            ends.clear();
+            auto ts1 = std::chrono::steady_clock::now();
+            for (size_t f = 0; f < frames.size(); ++f) {
+                encoder.encode(frames[f], 2, f, f*TIMESTEP, encoded);
+                ends.push_back(encoded.size());
+            }
+            auto ts2 = std::chrono::steady_clock::now();
+            ::codec::Decoder decoder;
+            shared::Frame frame;
+            for (size_t f = 0, begin = 0; f < frames.size(); begin = ends[f++]) {
+                decoder.decode(encoded.data()+begin, ends[f]-begin, frame);
+                for (size_t i = 0; repeat == 0 && i < frame.records.size(); ++i)
+                    for (size_t k = 0; k < 2; ++k) {
+                        position_error = std::max<double>(position_error, std::abs(frame.records[i].position[k]-frames[f][i].position[k]));
+                        velocity_error = std::max<double>(velocity_error, std::abs(frame.records[i].velocity[k]-frames[f][i].velocity[k]));
+                    }
+            }
+            auto ts3 = std::chrono::steady_clock::now();
+            encode = std::min(encode, std::chrono::duration<double>(ts2-ts1).count());
+            if (repeat > 0)    // The first decode also measured the error.
+                decode = std::min(decode, std::chrono::duration<double>(ts3-ts2).count());
+        }
+        std::cout << std::setw(48) << setting << std::fixed << std::setprecision(1) << std::setw(9) << 100.0*encoded.size()/raw << "%"
+                  << std::setprecision(0) << std::setw(12) << raw/encode/1e6 << std::setw(12) << raw/decode/1e6
+                  << std::scientific << std::setprecision(2) << std::setw(16) << position_error << std::setw(16) << velocity_error
+                  << std::defaultfloat << std::endl;
+        const double velocity_tolerance = parsed.velocity_tolerance > 0.0 ? parsed.velocity_tolerance : parsed.tolerance;
+        if (parsed.tolerance > 0.0 && (position_error > parsed.tolerance || velocity_error > velocity_tolerance))
+            throw std::runtime_error("error over the tolerance with "+setting);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Milliseconds per 1920x1080 frame to rasterize a 2-D exponential disc, to encode it as a PNG, and for the
+// whole of render::Renderer writing PNG files, where the encoding overlaps the rasterizing of the next frame.
+// The particles only drift between frames, without forces. See render.hh and png.hh.
+// Options: [bodies=100000] [frames=20]
+int render(int argc, char* argv[]) {
+    using Particle = BasicParticle<2, SinglePrecision>;
+    constexpr unsigned WIDTH = 1920, HEIGHT = 1080;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 100000;
+    const size_t frames = argc > 1 ? std::stoul(argv[1]) : 20;
+    BasicParticles<2, SinglePrecision> particles = generators::make_particles<2, SinglePrecision>(generators::Generator::exponential_disc, count, /*seed=*/1);
+    std::cout << particles.size() << " bodies, " << frames << " frames of " << WIDTH << "x" << HEIGHT << std::endl;
+
+    BasicParticles<2, SinglePrecision> start = particles;
+    std::vector<float> canvas;
+    std::vector<uint8_t> rgb, encoded, scratch;
+    double rasterize = 0.0, encode = 0.0, bytes = 0.0;
+    for (size_t f = 0; f < frames; ++f) {
+        auto ts1 = std::chrono::steady_clock::now();
+        ::render::rasterize(particles, WIDTH, HEIGHT, canvas, rgb);
+        auto ts2 = std::chrono::steady_clock::now();
+        png::encode(rgb.data(), WIDTH, HEIGHT, encoded, scratch);
+        auto ts3 = std::chrono::steady_clock::now();
+        rasterize += std::chrono::duration<double>(ts2-ts1).count();
+        encode += std::chrono::duration<double>(ts3-ts2).count();
+        bytes += static_cast<double>(encoded.size());
+        Particle::move_particles(particles, TIMESTEP);
+    }
+
+    particles = start;
+    const std::string pattern = "/tmp/gravity-benchmark-"+std::to_string(getpid())+"-%05d.png";
+    auto ts1 = std::chrono::steady_clock::now();
+    ::render::Renderer renderer(pattern, WIDTH, HEIGHT);
+    for (size_t f = 0; f < frames; ++f) {
+        renderer.render(particles);
+        Particle::move_particles(particles, TIMESTEP);
+    }
+    renderer.stop();
+    auto ts2 = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames; ++f)
+        std::remove(::render::frame_path(pattern, f).c_str());
+
+    const double raw = 3.0*WIDTH*HEIGHT;
+    std::cout << std::fixed << std::setprecision(1) << 1e3*rasterize/frames << " ms rasterize, " << 1e3*encode/frames
+              << " ms PNG encode (" << raw*frames/encode/1e6 << " MB/s), " << bytes/frames/1e3 << " KB per PNG, "
+              << 100.0*bytes/frames/raw << "% of raw" << std::endl;
+    std::cout << 1e3*std::chrono::duration<double>(ts2-ts1).count()/frames << " ms per frame rendered to files, "
+              << std::setprecision(3) << renderer.waited << "s waiting for the encoder" << std::defaultfloat << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Hardware counters for the direct force kernel and the collision merge, per particle pair, on the 3-D
+// spinning cloud. Needs Linux perf_event_open(2), which may need kernel.perf_event_paranoid set to 2 or less.
+// Options: [bodies=10000] [steps=5]
+int counters(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 10000;
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 5;
+    BasicParticles<3, SinglePrecision> particles = cloud<SinglePrecision>(count, /*spin=*/true);
+    std::cout << particles.size() << " bodies, " << steps << " steps, " << parallel::thread_count() << " threads" << std::endl;
+
+    ::counters::enabled = true;
+    BasicParticles<3, SinglePrecision> store;
+    double pairs = 0.0;
+    for (size_t s = 0; s < steps; ++s) {
+        pairs += static_cast<double>(particles.size())*(particles.size()-1);
+        Particle::accelerate_particles(particles, store, TIMESTEP, /*reproducible=*/false);
+        Particle::move_particles(particles, TIMESTEP);
+    }
+    if (!::counters::enabled)
+        return EXIT_FAILURE;
+    ::counters::report(std::cout, pairs);
+    return EXIT_SUCCESS;
+}
+
+// Accuracy against throughput of monopole and quadrupole tree nodes over a range of opening angles, on the
+// 3-D version of the spinning-collapse initial condition.
+// Options: [bodies=100000]
+int multipole(int argc, char* argv[]) {
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 100000;
+    const BasicParticles<3, SinglePrecision> particles = cloud<SinglePrecision>(count);
+    const Sampled sampled = sample_direct(particles);
+
+    std::cout << particles.size() << " bodies" << std::endl;
+    std::cout << std::setw(12) << "moments" << std::setw(8) << "theta" << std::setw(12) << "tree s"
+              << std::setw(14) << "Mbodies/s" << std::setw(14) << "rms error" << std::setw(14) << "max error" << std::endl;
+    for (bool quadrupole : {false, true}) {
+        for (float theta : {0.3F, 0.5F, 0.7F, 0.9F, 1.1F}) {
+            tree::Solver<3, SinglePrecision> solver(theta, quadrupole);
+            BasicParticles<3, SinglePrecision> approximate = particles;
+            auto ts1 = std::chrono::steady_clock::now();
+            solver.accelerate_particles(approximate, 1.0F);
+            auto ts2 = std::chrono::steady_clock::now();
+            if (approximate.size() != particles.size())
+                throw std::runtime_error("bodies merged");
+            const double tree_time = std::chrono::duration<double>(ts2-ts1).count();
+            const auto [rms, worst] = sampled_error(sampled, approximate);
+
+            std::cout << std::setw(12) << (quadrupole ? "quadrupole" : "monopole")
+                      << std::setw(8) << std::fixed << std::setprecision(1) << theta
+                      << std::setw(12) << std::setprecision(4) << tree_time
+                      << std::setw(14) << std::setprecision(3) << particles.size()/tree_time/1e6
+                      << std::setw(14) << std::scientific << std::setprecision(3) << rms
+                      << std::setw(14) << worst << std::defaultfloat << std::endl;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Generation time and virial ratio, 2K/|W|, for each initial condition in generators.hh. The ratio is 1 for a
+// system in equilibrium.
+// Options: [bodies=10000] [rosette order=16]
+int generators(int argc, char* argv[]) {
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 10000;
+    const size_t order = argc > 1 ? std::stoul(argv[1]) : 16;
+    const std::vector<std::pair<std::string, generators::Generator>> names = {
+        {"grid", generators::Generator::grid},
+        {"plummer", generators::Generator::plummer},
+        {"exponential_disc", generators::Generator::exponential_disc},
+        {"rosette", generators::Generator::rosette},
+        {"uniform_disc", generators::Generator::uniform_disc},
+    };
+
+    std::cout << std::setw(18) << "generator" << std::setw(6) << "D" << std::setw(10) << "bodies"
+              << std::setw(12) << "seconds" << std::setw(12) << "2K/|W|" << std::endl;
+    for (const auto& [name, generator] : names) {
+        for (glm::length_t dimensions : {2, 3}) {
+            if (generator == generators::Generator::plummer && dimensions == 2) continue;
+            with_dimensions(dimensions, [&]<glm::length_t D>() {
+                const size_t n = generator == generators::Generator::rosette ? order : count;
+                auto ts1 = std::chrono::steady_clock::now();
+                const BasicParticles<D, SinglePrecision> particles = generators::make_particles<D, SinglePrecision>(generator, n, /*seed=*/1);
+                auto ts2 = std::chrono::steady_clock::now();
+                const Energies energy = energies(particles);
+                std::cout << std::setw(18) << name << std::setw(6) << D << std::setw(10) << particles.size()
+                          << std::setw(12) << std::fixed << std::setprecision(4) << std::chrono::duration<double>(ts2-ts1).count()
+                          << std::setw(12) << std::setprecision(3) << 2.0*energy.kinetic/std::abs(energy.potential) << std::defaultfloat << std::endl;
+            });
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Steady-state throughput of the tree solver on a 3-D Plummer sphere with particles falling in at rate per
+// second. Reports how often the store had to grow, which with the reserve in infall.hh should be rare.
+// Options: [bodies=20000] [rate=6000] [steps=300]
+int infall(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 20000;
+    const double rate = argc > 1 ? std::stod(argv[1]) : 6000.0;
+    const size_t steps = argc > 2 ? std::stoul(argv[2]) : 300;
+    BasicParticles<3, SinglePrecision> particles = generators::plummer<3, SinglePrecision>(count, /*seed=*/1);
+    tree::Solver<3, SinglePrecision> solver;
+    ::infall::Emitter<3, SinglePrecision> emitter(rate, ::infall::Distribution::shell, /*seed=*/3);
+
+    std::cout << std::setw(6) << "step" << std::setw(10) << "bodies" << std::setw(10) << "emitted"
+              << std::setw(10) << "merged" << std::setw(12) << "capacity" << std::setw(12) << "step s" << std::endl;
+    size_t merged = 0;
+    size_t growths = 0;
+    size_t body_steps = 0;
+    double seconds = 0.0;
+    for (size_t s = 0; s < steps; ++s) {
+        const auto start = std::chrono::steady_clock::now();
+        const size_t capacity = particles.capacity();
+        const size_t before = particles.size();
+        solver.accelerate_particles(particles, TIMESTEP);
+        merged += before-particles.size();
+        Particle::move_particles(particles, TIMESTEP);
+        emitter.emit(particles, TIMESTEP);
+        growths += particles.capacity() != capacity;
+        const double step = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        seconds += step;
+        body_steps += before;
+        if (s%(steps/10 > 0 ? steps/10 : 1) == 0 || s+1 == steps)
+            std::cout << std::setw(6) << s << std::setw(10) << particles.size() << std::setw(10) << emitter.total()
+                      << std::setw(10) << merged << std::setw(12) << particles.capacity()
+                      << std::fixed << std::setprecision(4) << std::setw(12) << step << std::defaultfloat << std::endl;
+    }
+    std::cout << emitter.total() << " emitted, " << merged << " merged, " << growths << " reallocations, "
+              << std::fixed << std::setprecision(0) << body_steps/seconds << " body-steps/s" << std::defaultfloat << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Per-step time of a tree that is refit between frames against one rebuilt every frame, on the spinning
+// 3-D cloud. Both run the same frames, so their particles drift apart only by rounding.
+// Options: [bodies=100000] [steps=30]
+int refit(int argc, char* argv[]) {
+    using Particle = BasicParticle<3, SinglePrecision>;
+    const size_t count = argc > 0 ? std::stoul(argv[0]) : 100000;
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 30;
+    BasicParticles<3, SinglePrecision> refit_particles = cloud<SinglePrecision>(count, /*spin=*/true);
+    BasicParticles<3, SinglePrecision> rebuild_particles = refit_particles;
+    tree::Solver<3, SinglePrecision> refit_solver(tree::THETA, tree::QUADRUPOLE, /*refit=*/true);
+    tree::Solver<3, SinglePrecision> rebuild_solver(tree::THETA, tree::QUADRUPOLE, /*refit=*/false);
+
+    std::cout << refit_particles.size() << " bodies" << std::endl;
+    std::cout << std::setw(6) << "step" << std::setw(12) << "build s" << std::setw(12) << "walk s"
+              << std::setw(12) << "refit s" << std::setw(12) << "walk s" << std::setw(10) << "rebuilt" << std::endl;
+    tree::Timings rebuild_total;
+    tree::Timings refit_total;
+    size_t rebuilds = 0;
+    for (size_t s = 0; s < steps; ++s) {
+        rebuild_solver.accelerate_particles(rebuild_particles, TIMESTEP);
+        Particle::move_particles(rebuild_particles, TIMESTEP);
+        refit_solver.accelerate_particles(refit_particles, TIMESTEP);
+        Particle::move_particles(refit_particles, TIMESTEP);
+
+        const tree::Timings& a = rebuild_solver.timings();
+        const tree::Timings& b = refit_solver.timings();
+        rebuild_total.build += a.build;
+        rebuild_total.walk += a.walk;
+        refit_total.refit += b.refit;
+        refit_total.build += b.build;
+        refit_total.walk += b.walk;
+        rebuilds += b.rebuilt;
+        std::cout << std::setw(6) << s << std::fixed << std::setprecision(4)
+                  << std::setw(12) << a.build << std::setw(12) << a.walk
+                  << std::setw(12) << b.refit+b.build << std::setw(12) << b.walk
+                  << std::setw(10) << (b.rebuilt ? "yes" : "") << std::defaultfloat << std::endl;
+    }
+    std::cout << std::fixed << std::setprecision(4)
+              << "rebuild every step: " << rebuild_total.build/steps << "s build + " << rebuild_total.walk/steps << "s walk per step\n"
+              << "refit:              " << (refit_total.refit+refit_total.build)/steps << "s refit/build + " << refit_total.walk/steps
+              << "s walk per step, " << rebuilds << " rebuilds" << std::defaultfloat << std::endl;
+    return EXIT_SUCCESS;
+}
+
+}    // namespace benchmark
+
+int main(int argc, char* argv[]) {
+    const std::map<std::string, std::function<int(int, char*[])>> benchmarks = {
+        {"balance", benchmark::balance},
+        {"codec", benchmark::codec},
+        {"counters", benchmark::counters},
+        {"generators", benchmark::generators},
+        {"infall", benchmark::infall},
+        {"multipole", benchmark::multipole},
+        {"numa", benchmark::numa},
+        {"precision", benchmark::precision},
+        {"refit", benchmark::refit},
+        {"render", benchmark::render},
+        {"roofline", benchmark::roofline},
+        {"rsqrt", benchmark::rsqrt},
+        {"shared", benchmark::shared_memory},
+        {"stream", benchmark::stream},
+        {"tree", benchmark::tree},
+    };
+    try {
+        if (argc < 2 || !benchmarks.contains(argv[1])) {
+            std::cout << "usage: " << argv[0] << " <benchmark> [options...]\nbenchmarks:";
+            for (const auto& item : benchmarks)
+                std::cout << " " << item.first;
+            std::cout << std::endl;
+            return 1;
+        }
+        return benchmarks.at(argv[1])(argc-2, argv+2);
+    } catch(const std::exception& err) {
+        std::cout << "EXCEPTION: " << err.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,71 @@
+// gravity_compare.cu
+// Copyright (C) 2023 by Shawn Yarbrough
+
+// Compares two .csv files of particles, as written by --output, such as the same reproducible run on different
+// numbers of threads or MPI ranks. Prints the largest relative difference of any particle's position, velocity
+// and diameter, each against the larger of its two magnitudes, and fails if the particles differ in number or
+// any difference is over the tolerance.
+// Usage: gravity-compare expected.csv actual.csv [tolerance=0]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#include "particles.hh"
+#include "precision.hh"
+#include "snapshot.hh"
+
+// |a-b| over the larger of |a| and |b|, or 0 if both are 0.
+inline double relative_difference(double difference, double a, double b) {
+    const double larger = std::max(a, b);
+    return larger > 0.0 ? difference/larger : 0.0;
+}
+
+template <glm::length_t D>
+int compare(const std::string& expected_csv, const std::string& actual_csv, double tolerance) {
+    const BasicParticles<D, DoublePrecision> expected = load_particles_from_csv<D, DoublePrecision>(expected_csv);
+    const BasicParticles<D, DoublePrecision> actual = load_particles_from_csv<D, DoublePrecision>(actual_csv);
+    if (expected.size() != actual.size())
+        throw std::runtime_error(std::to_string(actual.size())+" particles instead of "+std::to_string(expected.size()));
+    double position = 0.0, velocity = 0.0, diameter = 0.0;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        const auto& e = expected[i];
+        const auto& a = actual[i];
+        position = std::max(position, relative_difference(glm::length(e.position-a.position), glm::length(e.position), glm::length(a.position)));
+        velocity = std::max(velocity, relative_difference(glm::length(e.velocity-a.velocity), glm::length(e.velocity), glm::length(a.velocity)));
+        diameter = std::max(diameter, relative_difference(std::abs(e.diameter-a.diameter), std::abs(e.diameter), std::abs(a.diameter)));
+    }
+    std::cout << expected.size() << " particles, " << D << "-D, largest relative difference: position " << position
+              << ", velocity " << velocity << ", diameter " << diameter << ", tolerance " << tolerance << std::endl;
+    if (std::max({position, velocity, diameter}) > tolerance)
+        throw std::runtime_error("difference over the tolerance");
+    return EXIT_SUCCESS;
+}
+
+int main2(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "usage: " << argv[0] << " expected.csv actual.csv [tolerance=0]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const double tolerance = argc > 3 ? std::stod(argv[3]) : 0.0;
+    const glm::length_t dimensions = csv_dimensions(argv[1]);
+    if (csv_dimensions(argv[2]) != dimensions)
+        throw std::runtime_error("the files have different dimensions");
+    return with_dimensions(dimensions, [&]<glm::length_t D>() {
+        return compare<D>(argv[1], argv[2], tolerance);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return main2(argc, argv);
+    } catch(const std::exception& err) {
+        std::cout << "EXCEPTION: " << err.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,120 @@
+// gravity_distributed.cu
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "distributed.hh"
+#include "generators.hh"
+#include "options.hh"
+#include "particles.hh"
+#include "precision.hh"
+#include "snapshot.hh"
+#include "trace.hh"
+
+// The simulation across MPI processes, without a window, for a fixed number of steps with a fixed timestep.
+// It takes the same options as gravity-simulation. The tree solver sends each rank's distant cells as single
+// bodies with the tree's opening angle, and the direct solver passes every particle around a ring of ranks.
+// Usage: mpirun -np 4 gravity-distributed --steps=100 [options...] [particles.csv]
+
+constexpr size_t REPORT_STEPS = 10;    // Steps between the statistics printed by rank 0.
+
+template <glm::length_t D, typename Precision>
+int run_distributed(const options::Options& options) {
+    using Particle = BasicParticle<D, Precision>;
+    using options::ForceSolver;
+
+    // Rank 0 makes every particle, and the first step spreads them out.
+    BasicParticles<D, Precision> particles;
+    if (distributed::rank() == 0) {
+        const size_t seed = options.seed.value_or(std::random_device{}());
+        std::cout << "seed " << seed << std::endl;
+        if (!options.csv.empty())
+            particles = load_particles_from_csv<D, Precision>(options.csv);
+        else if (options.generator == generators::Generator::grid)
+            particles = Particle::init_particle_grid(options.width, options.height, options.grid_radius, options.grid_max_velocity, options.grid_step, seed);
+        else
+            particles = generators::make_particles<D, Precision>(options.generator, options.particles, seed);
+    }
+    std::cout << particles.size() << " particles, " << D << "-D, " << Precision::name << " precision, "
+              << distributed::ranks() << " ranks" << std::endl;
+
+    distributed::Domain<D, Precision> domain(std::move(particles), options.theta, options.solver == ForceSolver::direct);
+    for (size_t step = 1; step <= options.steps; ++step) {
+        trace::Scope step_scope("step");
+        domain.step(options.timestep.value_or(options::DEFAULT_TIMESTEP));
+        if (step%REPORT_STEPS != 0 && step != options.steps)
+            continue;
+        const std::vector<distributed::Stats> all = distributed::gather(std::vector<distributed::Stats>{domain.stats()});
+        if (all.empty())
+            continue;
+        size_t total = 0, most = 0, ghosts = 0, far_cells = 0;
+        double seconds = 0.0, waiting = 0.0;
+        for (const distributed::Stats& s : all) {
+            total += s.particles;
+            most = std::max(most, s.particles);
+            ghosts += s.ghosts;
+            far_cells += s.far_cells;
+            seconds = std::max(seconds, s.seconds);
+            waiting = std::max(waiting, s.waiting);
+        }
+        // Imbalance is the most particles on one rank over the mean, 1 when they're even.
+        std::cout << "step " << step << ": " << total << " particles, imbalance " << std::fixed << std::setprecision(3)
+                  << static_cast<double>(most)*all.size()/std::max<size_t>(1, total) << ", " << ghosts << " ghosts, "
+                  << far_cells << " far cells, " << seconds << "s, waited " << waiting << "s" << std::defaultfloat << std::endl;
+    }
+
+    const BasicParticles<D, Precision> final_particles = domain.gather();
+    std::cout << options.steps << " steps, " << final_particles.size() << " particles" << std::endl;
+    if (!options.output.empty() && distributed::rank() == 0)
+        save_particles_to_csv(final_particles, options.output);
+    if (!options.trace.empty())
+        trace::write_chrome_json(options.trace+"."+std::to_string(distributed::rank()));
+    return EXIT_SUCCESS;
+}
+
+int main2(int argc, char* argv[]) {
+    // Only rank 0 prints.
+    if (distributed::rank() != 0)
+        std::cout.setstate(std::ios::failbit);
+    const std::optional<options::Options> options = options::parse(argc, argv);
+    if (!options)
+        return EXIT_SUCCESS;
+    if (options->steps == 0)
+        throw std::runtime_error("gravity-distributed needs --steps");
+    if (options->solver == options::ForceSolver::p3m)
+        throw std::runtime_error("gravity-distributed supports the direct and tree solvers");
+    const glm::length_t dimensions = !options->csv.empty() ? csv_dimensions(options->csv) : options->dimensions;
+    return with_dimensions(dimensions, [&]<glm::length_t D>() {
+        return with_precision(options->precision, [&]<typename Precision>() {
+            return run_distributed<D, Precision>(*options);
+        });
+    });
+}
+
+int main(int argc, char* argv[]) {
+    // The workers never call MPI, only the main thread.
+    int provided = 0;
+    distributed::check(MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided), "MPI_Init_thread");
+    int ret = EXIT_SUCCESS;
+    try {
+        ret = main2(argc, argv);
+    } catch(const std::exception& err) {
+        std::cerr << "rank " << distributed::rank() << " EXCEPTION: " << err.what() << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    } catch(...) {
+        std::cerr << "rank " << distributed::rank() << " UNKNOWN EXCEPTION" << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    MPI_Finalize();
+    return ret;
+}
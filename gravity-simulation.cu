@@ -5,109 +5,213 @@
 #include <cstdlib>
 #include <cstdio>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <optional>
+#include <random>
 #include <string>
+#include <tuple>
 
 using namespace std::literals;
 
+#include "counters.hh"
+#include "diagnostics.hh"
+#include "generators.hh"
 #include "graphics.hh"
+#include "infall.hh"
+#include "options.hh"
+#include "p3m.hh"
 #include "particles.hh"
+#include "precision.hh"
+#include "render.hh"
+#include "shared.hh"
+#include "snapshot.hh"
+#include "stream.hh"
+#include "trace.hh"
+#include "trajectory.hh"
+#include "tree.hh"
 #include "utility.hh"
 
-const unsigned int SCR_WIDTH = 1920;
-const unsigned int SCR_HEIGHT = 1080;
-
-Particles load_particles_from_csv(const std::string& csv_filename) {
-    Particles particles;
-
-    Csv::Parser csv;
-    std::vector<std::vector<Csv::CellReference>> cells;
-    std::ifstream ifile(csv_filename, std::ios::binary);
-    std::string data((std::istreambuf_iterator<char>(ifile)), (std::istreambuf_iterator<char>()));
-    csv.parseTo(data, cells);
-
-    if (cells.size() > 0) {
-        std::vector<std::string> headings;
-        size_t cols = cells.size();
-        size_t rows = cells[0].size();
-        for (std::size_t col = 0; col < cols; ++col) {
-            if (cells[col].size() != rows)
-                throw std::runtime_error(".csv column #"+std::to_string(col+1)+" unexpected size");
-            const auto& cell = cells[col][0];
-            if (cell.getType() != Csv::CellType::String)
-                throw std::runtime_error("unexpected type for string heading column #"+std::to_string(col+1));
-            std::optional<std::string> s = cell.getCleanString().value();
-            headings.push_back(utility::strip(s.value_or("")));
-        }
-        size_t next_id = 0;
-        for (std::size_t row = 1; row < rows; ++row) {
-            Particle p;
-            p.id = next_id++;
-            for (std::size_t col = 0; col < cols; ++col) {
-                const auto& cell = cells[col][row];
-                if (cell.getType() != Csv::CellType::Double)
-                    throw std::runtime_error("unexpected type for number in column #"+std::to_string(col+1)+" row #"+std::to_string(row+1));
-                double d = cell.getDouble().value();
-                const std::string& heading = headings[col];
-                if (heading == "xposition")
-                    p.position[0] = d;
-                else if (heading == "yposition")
-                    p.position[1] = d;
-                else if (heading == "xvelocity")
-                    p.velocity[0] = d;
-                else if (heading == "yvelocity")
-                    p.velocity[1] = d;
-                else if (heading == "diameter")
-                    p.diameter = d;
-                else
-                    throw std::runtime_error("unexpected name for .csv col #"+std::to_string(col+1)+": "+heading);
-            }
-            particles.push_back(std::move(p));
-        }
-    }
-
-    return particles;
-}
-
-int main2(int argc, char* argv[]) {
-    auto [window, shader_program] = graphics::setup_app_window(SCR_WIDTH, SCR_HEIGHT);
-
-    Particles particles;
-    if (argc > 1) {
-        particles = load_particles_from_csv(argv[1]);
-    } else {
-        particles = Particle::init_particle_grid(SCR_WIDTH, SCR_HEIGHT, /*radius=*/1000, /*max_velocity=*/10, /*step=*/20);
+// Runs until the window closes, or for options.steps frames. There's no window when headless.
+template <glm::length_t D, typename Precision>
+int run_simulation(const options::Options& options, GLFWwindow* window, unsigned int shader_program) {
+    using Particle = BasicParticle<D, Precision>;
+    using accumulator_type = typename Precision::accumulator_type;
+    using options::ForceSolver;
+
+    // A run without a seed gets a random one, printed so that it can be replayed with --seed.
+    const size_t seed = options.seed.value_or(std::random_device{}());
+    std::cout << "seed " << seed << std::endl;
+    BasicParticles<D, Precision> particles;
+    if (!options.csv.empty())
+        particles = load_particles_from_csv<D, Precision>(options.csv);
+    else if (options.generator == generators::Generator::grid)
+        particles = Particle::init_particle_grid(options.width, options.height, options.grid_radius, options.grid_max_velocity, options.grid_step, seed);
+    else
+        particles = generators::make_particles<D, Precision>(options.generator, options.particles, seed);
+    std::cout << particles.size() << " particles, " << D << "-D, " << Precision::name << " precision" << std::endl;
+    {
+        // Placed for pinned workers, like the solvers' stores when they grow. See parallel::first_touch().
+        BasicParticles<D, Precision> placed;
+        Particle::copy_particles(particles, placed);
+        particles.swap(placed);
     }
-    std::cout << particles.size() << " particles" << std::endl;
+    BasicParticles<D, Precision> store;    // The direct solver's. The others keep their own.
+
+    std::optional<p3m::Solver<D, Precision>> p3m_solver;    // Its meshes are large in 3-D, so only when used.
+    if (options.solver == ForceSolver::p3m)
+        p3m_solver.emplace();
+    tree::Solver<D, Precision> tree_solver(options.theta, options.quadrupole, options.refit);
+    infall::Emitter<D, Precision> emitter(options.infall_rate, options.infall_distribution, seed+2);
+    std::optional<diagnostics::Series> series;
+    if (!options.diagnostics.empty())
+        series.emplace(options.diagnostics);
+    std::optional<shared::Publisher> publisher;
+    if (!options.shared.empty())
+        publisher.emplace(options.shared, D);
+    std::optional<stream::Server> server;
+    if (!options.stream.empty())
+        server.emplace(options.stream);
+    std::optional<trajectory::Writer> recorder;
+    if (!options.record.empty())
+        recorder.emplace(options.record, codec::parse_settings(options.record_settings));
+    std::optional<render::Renderer> renderer;
+    if (!options.render.empty())
+        renderer.emplace(options.render, options.width, options.height);
+    std::vector<accumulator_type> potentials;
+    double time = 0.0;
 
     auto ts1 = std::chrono::system_clock::now();
     auto ts2 = ts1;
-    while (!glfwWindowShouldClose(window))
+    size_t frame = 0;
+    double pairs = 0.0;    // Summed by the direct solver, for the hardware counters.
+    double bodies = 0.0;
+    while (window ? !glfwWindowShouldClose(window) : frame < options.steps)
     {
-        graphics::center_app_window(window, shader_program);
+        trace::Scope frame_scope("frame");
+        if (window)
+            graphics::center_app_window(window, shader_program);
 
         ts2 = std::chrono::system_clock::now();
         double delta = std::chrono::duration<double>(ts2-ts1).count();
-        if (delta == 0.0) throw std::runtime_error("zero time passed");
-        if (delta > 0.2) {
-            std::cout << std::fixed << delta << "s hitch" << std::endl;
-            delta = 0.2;
+        if (options.timestep) {
+            delta = *options.timestep;
+        } else {
+            if (delta == 0.0) throw std::runtime_error("zero time passed");
+            if (delta > options.hitch) {
+                std::cout << std::fixed << delta << "s hitch" << std::endl;
+                delta = options.hitch;
+            }
+        }
+        pairs += static_cast<double>(particles.size())*(particles.size()-1);
+        bodies += static_cast<double>(particles.size());
+        // The potential energy is summed with the forces on the frames that are sampled. P3M doesn't provide it.
+        const bool sampled = series && frame%options.diagnostics_frames == 0;
+        std::vector<accumulator_type>* wanted = sampled ? &potentials : nullptr;
+        potentials.clear();
+        const auto step_start = std::chrono::steady_clock::now();
+        const size_t before = particles.size();
+        if (options.solver == ForceSolver::p3m)
+            p3m_solver->accelerate_particles(particles, delta);
+        else if (options.solver == ForceSolver::tree)
+            tree_solver.accelerate_particles(particles, delta, wanted);
+        else
+            Particle::accelerate_particles(particles, store, delta, options.reproducible, wanted, options.fast_rsqrt);
+        if (sampled) {
+            const double step_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-step_start).count();
+            // The potentials are of the particles before the step, which the solver swapped into its store.
+            const BasicParticles<D, Precision>& stepped = options.solver == ForceSolver::p3m ? p3m_solver->previous()
+                : options.solver == ForceSolver::tree ? tree_solver.previous() : store;
+            diagnostics::Sample sample = diagnostics::measure(stepped, potentials);
+            sample.frame = frame;
+            sample.time = time;
+            sample.step_seconds = step_seconds;
+            series->write(sample);
         }
-        particles = Particle::accelerate_particles(particles, delta);
+        if (particles.size() != before)
+            std::cout << particles.size() << " particles" << std::endl;
+        time += delta;
         Particle::move_particles(particles, delta);
-        Particle::draw_particles(particles, shader_program);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        emitter.emit(particles, delta);
+        if (publisher)
+            publisher->publish(particles, frame+1, time);
+        if (server)
+            server->publish(particles, frame+1, time);
+        if (recorder)
+            recorder->write(particles, frame+1, time);
+        if (renderer && frame%options.render_frames == 0)
+            renderer->render(particles);
+        if (window)
+            Particle::draw_particles(particles, shader_program);
+
+        ++frame;
+        if (options.snapshot_frames.value_or(0) != 0 && frame%*options.snapshot_frames == 0)
+            save_particles_to_csv(particles, "snapshot-"+std::to_string(frame)+".csv");
+
+        if (window) {
+            trace::Scope swap_scope("swap");
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            if (frame == options.steps)
+                glfwSetWindowShouldClose(window, GLFW_TRUE);
+        }
 
         ts1 = std::move(ts2);
     }
+    std::cout << frame << " frames, " << particles.size() << " particles" << std::endl;
+    if (!options.output.empty())
+        save_particles_to_csv(particles, options.output);
+    if (!options.trace.empty())
+        trace::write_chrome_json(options.trace);
+    if (counters::enabled) {
+        if (options.solver == ForceSolver::direct)
+            counters::report(std::cout, pairs);
+        else
+            counters::report(std::cout, bodies, "body");
+    }
+    if (options.balance)
+        parallel::report_balance(std::cout);
+    if (recorder) {
+        recorder->flush();
+        std::cout << "recorded " << recorder->frames << " frames (" << recorder->key_frames << " key frames) in " << recorder->bytes
+                  << " bytes, " << std::fixed << std::setprecision(1) << 100.0*recorder->bytes/std::max<uint64_t>(1, recorder->raw)
+                  << "% of raw" << std::defaultfloat << std::endl;
+    }
+    if (renderer) {
+        renderer->stop();
+        std::cout << "rendered " << renderer->frames << " frames, " << renderer->bytes << " bytes, waited "
+                  << std::fixed << std::setprecision(3) << renderer->waited << "s for encoding" << std::defaultfloat << std::endl;
+    }
+    if (server) {
+        server->stop();
+        const stream::Stats& totals = server->totals();
+        std::cout << "streamed " << totals.sent << " frames (" << totals.key_frames << " key frames, " << totals.bytes
+                  << " bytes) to " << totals.clients << " clients, dropped " << totals.dropped << std::endl;
+    }
 
-    glfwTerminate();
+    if (window)
+        glfwTerminate();
     return EXIT_SUCCESS;
 }
 
+int main2(int argc, char* argv[]) {
+    const std::optional<options::Options> options = options::parse(argc, argv);
+    if (!options)
+        return EXIT_SUCCESS;
+    GLFWwindow* window = nullptr;
+    unsigned int shader_program = 0;
+    if (!options->headless)
+        std::tie(window, shader_program) = graphics::setup_app_window(options->width, options->height);
+    const glm::length_t dimensions = !options->csv.empty() ? csv_dimensions(options->csv) : options->dimensions;
+    return with_dimensions(dimensions, [&]<glm::length_t D>() {
+        return with_precision(options->precision, [&]<typename Precision>() {
+            return run_simulation<D, Precision>(*options, window, shader_program);
+        });
+    });
+}
+
 int main(int argc, char* argv[]) {
     try {
         return main2(argc, argv);
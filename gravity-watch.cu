@@ -0,0 +1,143 @@
+// gravity_watch.cu
+// Copyright (C) 2023 by Shawn Yarbrough
+
+// Attaches to a simulation running with --shared=NAME and prints the particle count, mass, center of mass,
+// momentum and kinetic energy of its latest frame every few seconds, until the simulation exits. The frame
+// is summed in place in the shared memory, without copying it. See shared.hh.
+//
+// With --stream, connects to a simulation running with --stream=PATH instead, and prints the same for each
+// frame it receives, with the bytes per frame. The subscription is a line such as "rate=2 fields=all bits=16".
+// See stream.hh.
+//
+// With --trajectory, reads a file recorded with --record=PATH instead, and prints the same for each frame, or
+// only for the first frame numbered at least frame. See trajectory.hh.
+// Usage: gravity-watch [name=/gravity] [seconds=1]
+//        gravity-watch --stream [path=/tmp/gravity.sock] [subscription="rate=1"]
+//        gravity-watch --trajectory path [frame]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "shared.hh"
+#include "stream.hh"
+#include "trajectory.hh"
+
+struct Totals {
+    uint64_t frame{0};
+    double time{0.0};
+    size_t particles{0};
+    double mass{0.0};
+    double kinetic{0.0};
+    glm::dvec3 momentum{0.0};
+    glm::dvec3 moment{0.0};
+};
+
+// Mass is pi*r^2, as in BasicParticle::accelerate_particle().
+Totals summarise(const shared::Record* records, size_t count, uint64_t frame, double time) {
+    Totals ret;
+    ret.frame = frame;
+    ret.time = time;
+    ret.particles = count;
+    for (size_t i = 0; i < count; ++i) {
+        const shared::Record& r = records[i];
+        const glm::dvec3 position(r.position[0], r.position[1], r.position[2]);
+        const glm::dvec3 velocity(r.velocity[0], r.velocity[1], r.velocity[2]);
+        const double radius = r.diameter/2.0;
+        const double mass = glm::pi<double>()*radius*radius;
+        ret.mass += mass;
+        ret.kinetic += 0.5*mass*glm::dot(velocity, velocity);
+        ret.momentum += mass*velocity;
+        ret.moment += mass*position;
+    }
+    return ret;
+}
+
+void print(const Totals& totals) {
+    const glm::dvec3 center = totals.mass > 0.0 ? totals.moment/totals.mass : glm::dvec3(0.0);
+    std::cout << "frame " << totals.frame << std::fixed << std::setprecision(3) << "  time " << totals.time
+              << "  particles " << totals.particles << "  mass " << totals.mass << "  kinetic " << totals.kinetic
+              << "  momentum (" << totals.momentum.x << ", " << totals.momentum.y << ", " << totals.momentum.z << ")"
+              << "  center (" << center.x << ", " << center.y << ", " << center.z << ")" << std::defaultfloat;
+}
+
+int watch_shared(const std::string& name, double seconds) {
+    shared::Reader reader(name);
+    std::cout << "attached to " << name << ", " << reader.dimensions() << "-D" << std::endl;
+    uint64_t last_frame = 0;
+    size_t torn = 0;
+    while (!reader.closed()) {
+        Totals totals;
+        const bool whole = reader.read([&totals](const shared::Record* records, size_t count, uint64_t frame, double time) {
+            totals = summarise(records, count, frame, time);
+        });
+        if (!whole) {
+            torn += reader.frames() != 0;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (totals.frame != last_frame) {
+            last_frame = totals.frame;
+            print(totals);
+            std::cout << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+    std::cout << name << " closed after " << reader.frames() << " frames, " << torn << " reads retried" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int watch_stream(const std::string& path, const std::string& subscription) {
+    stream::Client client(path, subscription);
+    std::cout << "connected to " << path << ": " << subscription << std::endl;
+    shared::Frame frame;
+    size_t frames = 0;
+    for (size_t bytes = client.bytes; client.receive(frame); bytes = client.bytes) {
+        ++frames;
+        print(summarise(frame.records.data(), frame.records.size(), frame.frame, frame.time));
+        std::cout << "  " << client.bytes-bytes << " bytes" << std::endl;
+    }
+    std::cout << path << " closed after " << frames << " frames, " << client.bytes << " bytes" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int watch_trajectory(const std::string& path, std::optional<uint64_t> only) {
+    trajectory::Reader reader(path);
+    if (only && !reader.seek(*only))
+        throw std::runtime_error(path+" has no frame "+std::to_string(*only));
+    shared::Frame frame;
+    size_t frames = 0;
+    while (reader.read(frame)) {
+        ++frames;
+        print(summarise(frame.records.data(), frame.records.size(), frame.frame, frame.time));
+        std::cout << std::endl;
+        if (only)
+            return EXIT_SUCCESS;
+    }
+    std::cout << path << ": " << frames << " frames" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int main2(int argc, char* argv[]) {
+    if (argc > 2 && std::string(argv[1]) == "--trajectory")
+        return watch_trajectory(argv[2], argc > 3 ? std::optional<uint64_t>(std::stoull(argv[3])) : std::nullopt);
+    if (argc > 1 && std::string(argv[1]) == "--stream")
+        return watch_stream(argc > 2 ? argv[2] : "/tmp/gravity.sock", argc > 3 ? argv[3] : "rate=1");
+    return watch_shared(argc > 1 ? argv[1] : "/gravity", argc > 2 ? std::stod(argv[2]) : 1.0);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return main2(argc, argv);
+    } catch(const std::exception& err) {
+        std::cout << "EXCEPTION: " << err.what() << std::endl;
+        return 1;
+    }
+}
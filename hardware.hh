@@ -0,0 +1,125 @@
+// hardware.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "utility.hh"
+
+// What the machine has, for sizing work to fit it.
+namespace hardware {
+
+// Reads a small sysfs file, or returns an empty string.
+inline std::string read_sys(const std::string& path) {
+    std::ifstream ifile(path);
+    std::string ret;
+    std::getline(ifile, ret);
+    return utility::strip(ret);
+}
+
+// The size in bytes of the first CPU's level 1 data cache, or its level 2 or 3 cache, or 0 if unknown.
+// Asks sysconf() first, which glibc answers from CPUID, then /sys/devices/system/cpu/cpu0/cache.
+inline size_t cache_size(unsigned level) {
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    const long size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return static_cast<size_t>(size);
+#endif
+    for (unsigned index = 0; index < 8; ++index) {
+        const std::string dir = "/sys/devices/system/cpu/cpu0/cache/index"+std::to_string(index)+"/";
+        const std::string type = read_sys(dir+"type");
+        if (type.empty())
+            break;
+        if (read_sys(dir+"level") != std::to_string(level) || type == "Instruction")
+            continue;
+        const std::string size = read_sys(dir+"size");    // Such as "48K".
+        try {
+            size_t ret = std::stoul(size);
+            if (size.back() == 'K') ret <<= 10;
+            else if (size.back() == 'M') ret <<= 20;
+            return ret;
+        } catch (const std::logic_error&) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+inline size_t page_size() {
+    const long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? static_cast<size_t>(size) : 4096;
+}
+
+// CPU numbers from a sysfs list such as "0-3,8-11".
+inline std::vector<unsigned> parse_cpu_list(const std::string& list) {
+    std::vector<unsigned> ret;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        range = utility::strip(range);
+        if (range.empty())
+            continue;
+        try {
+            const size_t dash = range.find('-');
+            const unsigned first = std::stoul(range.substr(0, dash));
+            const unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash+1));
+            for (unsigned cpu = first; cpu <= last; ++cpu)
+                ret.push_back(cpu);
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("bad CPU list: "+list);
+        }
+    }
+    return ret;
+}
+
+// The CPUs of each NUMA node that has any, from /sys/devices/system/node. One node with every CPU if the
+// machine doesn't say, such as outside Linux.
+inline const std::vector<std::vector<unsigned>>& numa_nodes() {
+    static const std::vector<std::vector<unsigned>> ret = []() {
+        std::vector<std::vector<unsigned>> nodes;
+        // The online nodes are in the same format as a CPU list, such as "0-1".
+        for (unsigned node : parse_cpu_list(read_sys("/sys/devices/system/node/online"))) {
+            std::vector<unsigned> cpus = parse_cpu_list(read_sys("/sys/devices/system/node/node"+std::to_string(node)+"/cpulist"));
+            if (!cpus.empty())    // Memory-only nodes have no CPUs.
+                nodes.push_back(std::move(cpus));
+        }
+        if (nodes.empty()) {
+            nodes.emplace_back();
+            for (unsigned cpu = 0; cpu < std::max(1U, std::thread::hardware_concurrency()); ++cpu)
+                nodes.back().push_back(cpu);
+        }
+        return nodes;
+    }();
+    return ret;
+}
+
+// Restricts the calling thread to the given CPUs. Returns false if it can't, such as when none of them are
+// allowed to this process.
+inline bool pin_thread(const std::vector<unsigned>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+}    // namespace hardware
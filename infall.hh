@@ -0,0 +1,99 @@
+// infall.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#include "generators.hh"
+#include "particles.hh"
+#include "randomize.hh"
+#include "trace.hh"
+
+// A steady source of new particles falling in from far away, for long accretion simulations.
+//
+// New particles are appended to the end of the store, where they keep ID's matching their indexes. Merging
+// shrinks the store but keeps its capacity, and the solvers' own stores grow to the same capacity, so the
+// slots freed by merges are refilled first. When the store is full it grows to at least twice its capacity,
+// and at least RESERVE_SECONDS of inflow, so reallocation is rare and amortised.
+namespace infall {
+
+constexpr double RADIUS = 1500.0;    // How far from the origin particles appear.
+constexpr double SPEED = 30.0;    // How fast they start falling.
+constexpr double TANGENTIAL = 0.3;    // Sideways speed around the z axis, as a fraction of SPEED, so the infall carries spin.
+constexpr double STREAM_SPREAD = 0.2;    // The width of a stream, in radians.
+constexpr double RESERVE_SECONDS = 10.0;
+
+enum class Distribution {
+    shell,    // From every direction.
+    stream,    // From one direction, along the x axis.
+};
+
+inline Distribution distribution_from_name(const std::string& name) {
+    if (name == "shell") return Distribution::shell;
+    if (name == "stream") return Distribution::stream;
+    throw std::runtime_error("unknown infall distribution: "+name);
+}
+
+template <glm::length_t D, typename Precision>
+class Emitter {
+    using Particle = BasicParticle<D, Precision>;
+    using Particles = BasicParticles<D, Precision>;
+
+    double rate;    // Particles per second.
+    Distribution distribution;
+    CounterRandomize rize;
+    size_t emitted{0};
+    double owed{0.0};    // The fraction of a particle due but not yet emitted.
+
+public:
+    inline Emitter(double rate, Distribution distribution, std::optional<size_t> seed)
+        : rate(rate)
+        , distribution(distribution)
+        , rize(seed ? CounterRandomize(1, 3, *seed) : CounterRandomize(1, 3)) {}
+
+    inline size_t total() const { return emitted; }
+
+    // Append the particles due after another delta seconds. Returns how many.
+    inline size_t emit(Particles& particles, float delta);
+};    // class Emitter
+
+template <glm::length_t D, typename Precision>
+inline size_t Emitter<D, Precision>::emit(Particles& particles, float delta) {
+    trace::Scope scope("infall");
+    owed += rate*delta;
+    const size_t count = static_cast<size_t>(owed);
+    owed -= static_cast<double>(count);
+    if (particles.size()+count > particles.capacity())
+        Particle::reserve_particles(particles, std::max(2*particles.capacity(), particles.size()+count+static_cast<size_t>(rate*RESERVE_SECONDS)));
+
+    for (size_t k = 0; k < count; ++k, ++emitted) {
+        // The random numbers are keyed by how many particles came before, so a fixed timestep replays exactly.
+        glm::vec<D, double> direction = generators::random_direction<D>(rize, emitted, 1);
+        if (distribution == Distribution::stream) {
+            direction *= STREAM_SPREAD;
+            direction[0] += 1.0;
+            direction = glm::normalize(direction);
+        }
+        glm::vec<D, double> sideways(0.0);
+        sideways[0] = -direction[1];
+        sideways[1] = direction[0];
+
+        Particle p;
+        p.id = particles.size();
+        p.position = typename Particle::Position(direction*RADIUS);
+        p.velocity = typename Particle::Velocity((sideways*TANGENTIAL-direction)*SPEED);
+        p.diameter = static_cast<typename Precision::pair_type>(rize.get(emitted, 0));
+        p.color = Particle::choose_color_from_size(p.diameter);
+        particles.push_back(p);
+    }
+    return count;
+}
+
+}    // namespace infall
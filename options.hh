@@ -0,0 +1,256 @@
+// options.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#include "counters.hh"
+#include "diagnostics.hh"
+#include "generators.hh"
+#include "infall.hh"
+#include "parallel.hh"
+#include "particles.hh"
+#include "precision.hh"
+#include "trace.hh"
+#include "trajectory.hh"
+#include "tree.hh"
+#include "utility.hh"
+
+// Run-time settings for gravity-simulation, so that parameter sweeps can be scripted without rebuilding.
+//
+// Every setting is a --name=value (or --name value) option, and the same names can be given one per line as
+// name = value in a config file passed with --config. Settings apply in order, so options after --config
+// override the file. Blank lines and lines starting with # are ignored. Usage: gravity-simulation --help
+namespace options {
+
+enum class ForceSolver {
+    direct,    // Exact O(n^2) sum over every pair of particles.
+    p3m,    // Mesh long-range forces plus direct short-range forces between neighbouring cells.
+    tree,    // Barnes-Hut quadtree or octree. Distant groups of particles act as one body.
+};
+
+inline ForceSolver solver_from_name(const std::string& name) {
+    if (name == "direct") return ForceSolver::direct;
+    if (name == "p3m") return ForceSolver::p3m;
+    if (name == "tree") return ForceSolver::tree;
+    throw std::runtime_error("unknown solver: "+name);
+}
+
+constexpr float DEFAULT_TIMESTEP = 1.0F/60.0F;
+
+struct Options {
+    std::string csv;    // Initial particles. A .csv with zposition and zvelocity columns is always simulated in 3-D.
+
+    ForceSolver solver = ForceSolver::direct;
+    Precision precision = Precision::single;
+    glm::length_t dimensions = 2;
+
+    // Reproducible mode uses a fixed timestep and seed, and the direct solver sums forces in a fixed order, so
+    // the same input gives bit-identical output on any number of threads. The tree's build is split by the
+    // thread count, and P3M has no fixed order, so parse() rejects them with it. parse() fills in the settings
+    // it needs that weren't given: a timestep of DEFAULT_TIMESTEP, seed 1 and a .csv snapshot every 600
+    // frames. Headless runs get the default timestep too, since their frames are only as long as the step takes.
+    bool reproducible = false;
+    std::optional<float> timestep;    // Seconds per frame. Without one, each frame advances by the time it took.
+    std::optional<size_t> seed;    // Without one, the initial particles are random.
+    std::optional<size_t> snapshot_frames;    // Frames between .csv snapshots. 0 or none for none.
+    double hitch = 0.2;    // Longer frames advance only this far, without a timestep.
+    bool fast_rsqrt = false;    // The direct solver approximates 1/r^3, with a few parts per million error.
+
+    // The initial particles when no .csv is given. See generators.hh. particles is ignored for the default grid.
+    generators::Generator generator = generators::Generator::grid;
+    size_t particles = 10000;
+    int32_t grid_radius = 1000;
+    size_t grid_max_velocity = 10;
+    size_t grid_step = 20;
+
+    // New particles per second falling in from far away, or 0 for none. See infall.hh.
+    double infall_rate = 0.0;
+    infall::Distribution infall_distribution = infall::Distribution::shell;
+
+    float theta = tree::THETA;
+    bool quadrupole = tree::QUADRUPOLE;
+    bool refit = tree::REFIT;
+
+    unsigned int width = 1920;
+    unsigned int height = 1080;
+    bool headless = false;    // No window. Stops after steps frames.
+    size_t steps = 0;    // 0 runs until the window closes.
+    std::string output;    // The particles are written to this .csv at exit.
+    std::string shared;    // Each frame is published to this POSIX shared memory segment. See shared.hh.
+    std::string stream;    // Frames are streamed to clients of a Unix domain socket at this path. See stream.hh.
+    std::string record;    // Every frame is recorded to this trajectory file. See trajectory.hh.
+    std::string record_settings = trajectory::SETTINGS;
+    std::string render;    // Frames are rendered without a window to PNG files or a command. See render.hh.
+    size_t render_frames = 1;
+    std::string trace;    // A Chrome trace of the last frames is written here at exit. See trace.hh.
+    bool counters = false;    // Hardware counters per phase are printed at exit. See counters.hh.
+    bool balance = false;    // Each worker's busy and idle time in the direct solver is printed at exit.
+    std::string diagnostics;    // A .csv time series of energy and momentum. See diagnostics.hh.
+    size_t diagnostics_frames = diagnostics::FRAMES;
+};
+
+inline bool bool_from_name(const std::string& name) {
+    if (name == "true" || name == "1" || name == "yes" || name == "on") return true;
+    if (name == "false" || name == "0" || name == "no" || name == "off") return false;
+    throw std::runtime_error("expected true or false: "+name);
+}
+
+struct Setting {
+    const char* help;
+    std::function<void(Options&, const std::string&)> set;
+    bool flag{false};    // On the command line, --name alone means --name=true.
+};
+
+constexpr bool FLAG = true;
+
+// Every setting, by name. The physics constants are globals in particles.hh shared by every solver.
+inline const std::map<std::string, Setting>& settings() {
+    static const std::map<std::string, Setting> ret = {
+        {"solver", {"direct, p3m or tree", [](Options& o, const std::string& v) { o.solver = solver_from_name(v); }}},
+        {"precision", {"float, double or mixed", [](Options& o, const std::string& v) { o.precision = precision_from_name(v); }}},
+        {"dimensions", {"2 or 3", [](Options& o, const std::string& v) { o.dimensions = std::stoi(v); }}},
+        {"threads", {"worker threads, 0 for one per hardware thread", [](Options&, const std::string& v) { parallel::threads = std::stoul(v); }}},
+        {"numa-nodes", {"pin the worker threads to the first this many NUMA nodes, 0 not to pin", [](Options&, const std::string& v) { parallel::pin_nodes = std::stoul(v); }}},
+        {"chunk", {"particles per chunk scheduled on a worker by the direct solver, 0 for automatic", [](Options&, const std::string& v) { parallel::chunk = std::stoul(v); }}},
+        {"reproducible", {"fixed timestep, seed and summation order, direct solver only", [](Options& o, const std::string& v) { o.reproducible = bool_from_name(v); }, FLAG}},
+        {"timestep", {"fixed seconds per frame, 1/60 by default when reproducible or headless", [](Options& o, const std::string& v) { o.timestep = std::stof(v); }}},
+        {"seed", {"random seed, 1 by default when reproducible", [](Options& o, const std::string& v) { o.seed = std::stoul(v); }}},
+        {"snapshot-frames", {"frames between .csv snapshots, 600 by default when reproducible, 0 for none", [](Options& o, const std::string& v) { o.snapshot_frames = std::stoul(v); }}},
+        {"hitch", {"longest timestep in seconds without a fixed timestep", [](Options& o, const std::string& v) { o.hitch = std::stod(v); }}},
+        {"fast-rsqrt", {"approximate reciprocal square root in the direct solver when not reproducible", [](Options& o, const std::string& v) { o.fast_rsqrt = bool_from_name(v); }, FLAG}},
+        {"generator", {"grid, plummer, exponential_disc, rosette or uniform_disc", [](Options& o, const std::string& v) { o.generator = generators::generator_from_name(v); }}},
+        {"particles", {"particle count for generators other than grid", [](Options& o, const std::string& v) { o.particles = std::stoul(v); }}},
+        {"grid-radius", {"radius of the grid", [](Options& o, const std::string& v) { o.grid_radius = std::stoi(v); }}},
+        {"grid-max-velocity", {"largest random speed per axis on the grid", [](Options& o, const std::string& v) { o.grid_max_velocity = std::stoul(v); }}},
+        {"grid-step", {"grid spacing", [](Options& o, const std::string& v) { o.grid_step = std::stoul(v); }}},
+        {"gravity", {"gravitational constant", [](Options&, const std::string& v) { GRAVITY = std::stof(v); }}},
+        {"spin", {"rim speed of the grid", [](Options&, const std::string& v) { SPIN = std::stof(v); }}},
+        {"infall-rate", {"new particles per second, 0 for none", [](Options& o, const std::string& v) { o.infall_rate = std::stod(v); }}},
+        {"infall-distribution", {"shell or stream", [](Options& o, const std::string& v) { o.infall_distribution = infall::distribution_from_name(v); }}},
+        {"theta", {"tree opening angle", [](Options& o, const std::string& v) { o.theta = std::stof(v); }}},
+        {"quadrupole", {"tree quadrupole moments", [](Options& o, const std::string& v) { o.quadrupole = bool_from_name(v); }, FLAG}},
+        {"refit", {"refit the tree between frames", [](Options& o, const std::string& v) { o.refit = bool_from_name(v); }, FLAG}},
+        {"width", {"window and rendered frame width", [](Options& o, const std::string& v) { o.width = std::stoul(v); }}},
+        {"height", {"window and rendered frame height", [](Options& o, const std::string& v) { o.height = std::stoul(v); }}},
+        {"headless", {"run without a window", [](Options& o, const std::string& v) { o.headless = bool_from_name(v); }, FLAG}},
+        {"steps", {"frames to run, 0 until the window closes", [](Options& o, const std::string& v) { o.steps = std::stoul(v); }}},
+        {"output", {"write the particles to this .csv at exit", [](Options& o, const std::string& v) { o.output = v; }}},
+        {"shared", {"publish each frame to this POSIX shared memory segment, such as /gravity", [](Options& o, const std::string& v) { o.shared = v; }}},
+        {"stream", {"stream frames to clients of a Unix domain socket at this path", [](Options& o, const std::string& v) { o.stream = v; }}},
+        {"record", {"record every frame to this trajectory file", [](Options& o, const std::string& v) { o.record = v; }}},
+        {"record-settings", {"how frames are recorded, such as \"tolerance=0.01 entropy=1\"", [](Options& o, const std::string& v) { o.record_settings = v; }}},
+        {"render", {"render frames to PNG files such as frames/%05d.png, or as raw RGB to |command", [](Options& o, const std::string& v) { o.render = v; }}},
+        {"render-frames", {"frames between rendered frames", [](Options& o, const std::string& v) { o.render_frames = std::max<size_t>(1, std::stoul(v)); }}},
+        {"trace", {"write a Chrome trace of the last frames to this file", [](Options& o, const std::string& v) {
+            o.trace = v;
+            trace::enabled = !v.empty();
+        }}},
+        {"diagnostics", {"write energy and momentum every diagnostics-frames to this .csv", [](Options& o, const std::string& v) { o.diagnostics = v; }}},
+        {"diagnostics-frames", {"frames between diagnostics samples", [](Options& o, const std::string& v) { o.diagnostics_frames = std::max<size_t>(1, std::stoul(v)); }}},
+        {"balance", {"print each worker's busy and idle time in the direct solver at exit", [](Options& o, const std::string& v) { o.balance = bool_from_name(v); }, FLAG}},
+        {"counters", {"print hardware counters for the force and merge phases at exit", [](Options& o, const std::string& v) {
+            o.counters = bool_from_name(v);
+            counters::enabled = o.counters;
+        }, FLAG}},
+    };
+    return ret;
+}
+
+inline void set(Options& options, const std::string& name, const std::string& value) {
+    const auto& all = settings();
+    auto it = all.find(name);
+    if (it == all.end())
+        throw std::runtime_error("unknown setting: "+name);
+    try {
+        it->second.set(options, value);
+    } catch (const std::logic_error&) {    // std::stoi() and friends.
+        throw std::runtime_error("bad value for "+name+": "+value);
+    }
+}
+
+inline void load_config(Options& options, const std::string& filename) {
+    std::ifstream ifile(filename);
+    if (!ifile)
+        throw std::runtime_error("can't read "+filename);
+    std::string line;
+    for (size_t number = 1; std::getline(ifile, line); ++number) {
+        line = utility::strip(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        const size_t equals = line.find('=');
+        if (equals == std::string::npos)
+            throw std::runtime_error(filename+":"+std::to_string(number)+": expected name = value");
+        set(options, utility::strip(line.substr(0, equals)), utility::strip(line.substr(equals+1)));
+    }
+}
+
+inline void usage(const char* program) {
+    std::cout << "usage: " << program << " [options...] [particles.csv]\n"
+              << "  --config=FILE    settings as name = value lines\n"
+              << "  --help\n";
+    for (const auto& item : settings())
+        std::cout << "  --" << item.first << "=VALUE    " << item.second.help << "\n";
+    std::cout << "Flags such as --headless may omit =true." << std::endl;
+}
+
+// Returns no options if the program should exit, after --help.
+inline std::optional<Options> parse(int argc, char* argv[]) {
+    Options options;
+    for (int a = 1; a < argc; ++a) {
+        const std::string arg = argv[a];
+        if (arg.rfind("--", 0) != 0) {
+            options.csv = arg;
+            continue;
+        }
+        if (arg == "--help") {
+            usage(argv[0]);
+            return std::nullopt;
+        }
+        std::string name = arg.substr(2);
+        std::string value;
+        const size_t equals = name.find('=');
+        if (equals != std::string::npos) {
+            value = name.substr(equals+1);
+            name.resize(equals);
+        } else {
+            const auto it = settings().find(name);
+            if (name != "config" && it == settings().end())
+                throw std::runtime_error("unknown setting: "+name);
+            if (name != "config" && it->second.flag)
+                value = "true";
+            else if (a+1 < argc)
+                value = argv[++a];
+            else
+                throw std::runtime_error("missing value for --"+name);
+        }
+        if (name == "config")
+            load_config(options, value);
+        else
+            set(options, name, value);
+    }
+    if (options.headless && options.steps == 0)
+        throw std::runtime_error("--headless needs --steps");
+    if (options.reproducible && options.solver != ForceSolver::direct)
+        throw std::runtime_error("--reproducible needs --solver=direct");
+    if ((options.reproducible || options.headless) && !options.timestep)
+        options.timestep = DEFAULT_TIMESTEP;
+    if (options.reproducible && !options.seed)
+        options.seed = 1;
+    if (options.reproducible && !options.snapshot_frames)
+        options.snapshot_frames = 600;
+    return options;
+}
+
+}    // namespace options
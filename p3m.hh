@@ -0,0 +1,390 @@
+// p3m.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <future>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "parallel.hh"
+#include "counters.hh"
+#include "particles.hh"
+#include "trace.hh"
+
+// Particle-Particle/Particle-Mesh (P3M) gravity.
+//
+// The force law is split into two parts, F = F*S(r) + F*(1-S(r)), where S(r) falls smoothly from 1 to 0
+// over a few mesh cells. The long-range part F*(1-S(r)) is solved on a mesh by FFT convolution in
+// O(m^D log m) time. The short-range part F*S(r) is summed directly between particles in neighbouring
+// cells, and that same neighbour search also finds every pair of touching particles.
+namespace p3m {
+
+template <glm::length_t D>
+constexpr size_t MESH_SIZE = D == 2 ? 128 : 64;    // Mesh cells per side. Must be a power of two.
+constexpr float SPLIT_CELLS = 1.25F;    // The force split scale, r_s, measured in mesh cells.
+constexpr float CUTOFF_SPLITS = 5.0F;    // The short-range cutoff measured in r_s. S(5*r_s) < 0.6%.
+
+using Complex = std::complex<double>;
+
+// The fraction of the force handled by the short-range direct sum, with r measured in units of r_s.
+inline double short_range_fraction(double r) {
+    return std::erfc(r/2.0)+(r/std::sqrt(glm::pi<double>()))*std::exp(-(r*r)/4.0);
+}
+
+// In-place radix-2 FFT of n complex values spaced stride apart.
+inline void fft(Complex* data, size_t n, size_t stride, bool inverse) {
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n>>1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(data[i*stride], data[j*stride]);
+    }
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const double angle = (inverse ? 2.0 : -2.0)*glm::pi<double>()/len;
+        const Complex wlen(std::cos(angle), std::sin(angle));
+        for (size_t i = 0; i < n; i += len) {
+            Complex w(1.0, 0.0);
+            for (size_t k = 0; k < len/2; ++k) {
+                Complex& a = data[(i+k)*stride];
+                Complex& b = data[(i+k+len/2)*stride];
+                const Complex t = b*w;
+                b = a-t;
+                a += t;
+                w *= wlen;
+            }
+        }
+    }
+}
+
+// In-place FFT of an n^dimensions grid with the first axis varying fastest. The inverse transform is unnormalized.
+inline void fftn(std::vector<Complex>& grid, size_t n, size_t dimensions, bool inverse) {
+    const size_t lines = grid.size()/n;
+    for (size_t axis = 0, stride = 1; axis < dimensions; ++axis, stride *= n) {
+        parallel::for_blocks(lines, [&grid, n, stride, inverse](size_t begin, size_t end, size_t) {
+            for (size_t line = begin; line < end; ++line) {
+                // Insert a zero digit for this axis into the line number to find the line's first element.
+                const size_t low = line%stride;
+                const size_t high = line/stride;
+                fft(&grid[high*stride*n+low], n, stride, inverse);
+            }
+        });
+    }
+}
+
+template <glm::length_t D, typename Precision>
+class Solver {
+    using Particle = BasicParticle<D, Precision>;
+    using Particles = BasicParticles<D, Precision>;
+    using Position = typename Particle::Position;
+    using position_type = typename Precision::position_type;
+    using pair_type = typename Precision::pair_type;
+    using accumulator_type = typename Precision::accumulator_type;
+    using Acceleration = glm::vec<D, accumulator_type>;
+
+    static constexpr size_t mesh_size = MESH_SIZE<D>;
+    static constexpr size_t padded_size = mesh_size*2;    // Zero padding gives isolated, not periodic, boundaries.
+    static constexpr size_t grids = (D+1)/2;    // Each complex grid carries two acceleration components as x+iy.
+
+    // The transformed long-range acceleration kernels in mesh cell units. Scaled by GRAVITY/h^2 later.
+    std::array<std::vector<Complex>, grids> kernels;
+
+    // The mesh for the current frame.
+    Position origin{0.0F};
+    double h{1.0};
+    std::vector<Complex> density;
+    std::array<std::vector<Complex>, grids> meshes;
+
+    // The cell list used by the short-range pass.
+    Position cell_origin{0.0F};
+    double cell_size{1.0};
+    std::array<size_t, D> cells{};
+    std::vector<size_t> cell_start;
+    std::vector<size_t> cell_particles;
+    double max_radius{0.0};
+
+    Particles store;    // The accelerated particles, swapped with the caller's each frame.
+
+    template <typename F>
+    inline void for_each_node(const Position& position, F&& f) const;
+    inline size_t cell_index(const Position& position) const;
+    inline void build_mesh(const Particles& particles);
+    inline void build_cells(const Particles& particles);
+    inline Acceleration interpolate_mesh(const Position& position) const;
+    inline Collisions accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start) const;
+
+public:
+    inline Solver();
+    // Advances particles in place.
+    inline void accelerate_particles(Particles& particles, float delta);
+    inline const Particles& previous() const { return store; }    // The particles before the last step.
+};    // class Solver
+
+template <glm::length_t D, typename Precision>
+inline Solver<D, Precision>::Solver() {
+    const long n = static_cast<long>(padded_size);
+    const long m = static_cast<long>(mesh_size);
+    size_t total = 1;
+    for (glm::length_t k = 0; k < D; ++k)
+        total *= padded_size;
+    for (auto& kernel : kernels)
+        kernel.assign(total, Complex(0.0, 0.0));
+    for (size_t index = 0; index < total; ++index) {
+        // The offset from a source cell to a target cell, wrapped so that negative offsets land at the end.
+        std::array<long, D> offset;
+        size_t rest = index;
+        long quadrance = 0;
+        bool outside = false;
+        for (glm::length_t k = 0; k < D; ++k) {
+            const long digit = static_cast<long>(rest%padded_size);
+            rest /= padded_size;
+            offset[k] = digit < m ? digit : digit-n;
+            outside = outside || offset[k] == -m;
+            quadrance += offset[k]*offset[k];
+        }
+        if (outside || quadrance == 0) continue;
+        const double r = std::sqrt(static_cast<double>(quadrance));
+        const double long_range = (1.0-short_range_fraction(r/SPLIT_CELLS))/(r*r*r);
+        for (glm::length_t k = 0; k < D; ++k) {
+            if (k%2 == 0)
+                kernels[k/2][index].real(-offset[k]*long_range);
+            else
+                kernels[k/2][index].imag(-offset[k]*long_range);
+        }
+    }
+    for (auto& kernel : kernels)
+        fftn(kernel, padded_size, D, false);
+}
+
+// Calls f(index, weight) for each of the 2^D mesh nodes around a position, with cloud-in-cell weights.
+template <glm::length_t D, typename Precision>
+template <typename F>
+inline void Solver<D, Precision>::for_each_node(const Position& position, F&& f) const {
+    const glm::vec<D, double> u = (glm::vec<D, double>(position)-glm::vec<D, double>(origin))/h;
+    std::array<size_t, D> base;
+    std::array<double, D> fraction;
+    for (glm::length_t k = 0; k < D; ++k) {
+        base[k] = static_cast<size_t>(u[k]);
+        fraction[k] = u[k]-static_cast<double>(base[k]);
+    }
+    for (size_t corner = 0; corner < (size_t{1} << D); ++corner) {
+        size_t index = 0;
+        size_t stride = 1;
+        double weight = 1.0;
+        for (glm::length_t k = 0; k < D; ++k) {
+            const size_t upper = (corner >> k) & 1;
+            index += (base[k]+upper)*stride;
+            stride *= padded_size;
+            weight *= upper ? fraction[k] : 1.0-fraction[k];
+        }
+        f(index, weight);
+    }
+}
+
+// The cell holding a position, with the first axis varying fastest.
+template <glm::length_t D, typename Precision>
+inline size_t Solver<D, Precision>::cell_index(const Position& position) const {
+    const glm::vec<D, double> u = glm::vec<D, double>(position-cell_origin)/cell_size;
+    size_t c = 0;
+    for (glm::length_t k = D; k-- > 0;)
+        c = c*cells[k]+std::min(static_cast<size_t>(u[k]), cells[k]-1);
+    return c;
+}
+
+// Deposit the particle masses onto the mesh using cloud-in-cell weights, then convolve with the long-range kernel.
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::build_mesh(const Particles& particles) {
+    Position lo{std::numeric_limits<position_type>::max()};
+    Position hi{std::numeric_limits<position_type>::lowest()};
+    for (const Particle& p : particles) {
+        lo = glm::min(lo, p.position);
+        hi = glm::max(hi, p.position);
+    }
+    double extent = 1.0;
+    for (glm::length_t k = 0; k < D; ++k)
+        extent = std::max(extent, static_cast<double>(hi[k]-lo[k]));
+    h = extent/static_cast<double>(mesh_size-3);
+    origin = lo-Position(static_cast<position_type>(h));
+
+    density.assign(kernels[0].size(), Complex(0.0, 0.0));
+    for (const Particle& p : particles) {
+        const double r = p.diameter/2.0;
+        const double mass = glm::pi<double>()*r*r;
+        for_each_node(p.position, [this, mass](size_t index, double weight) { density[index] += mass*weight; });
+    }
+    fftn(density, padded_size, D, false);
+
+    // Both kernel components in a grid are real, so their accelerations come back as the real and imaginary parts.
+    const double scale = GRAVITY/(h*h*static_cast<double>(density.size()));
+    for (size_t g = 0; g < grids; ++g) {
+        meshes[g].resize(density.size());
+        for (size_t k = 0; k < density.size(); ++k)
+            meshes[g][k] = density[k]*kernels[g][k];
+        fftn(meshes[g], padded_size, D, true);
+        for (Complex& c : meshes[g])
+            c *= scale;
+    }
+}
+
+// Sort the particles into square cells no smaller than the short-range cutoff.
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::build_cells(const Particles& particles) {
+    Position lo{std::numeric_limits<position_type>::max()};
+    Position hi{std::numeric_limits<position_type>::lowest()};
+    max_radius = 0.0;
+    for (const Particle& p : particles) {
+        lo = glm::min(lo, p.position);
+        hi = glm::max(hi, p.position);
+        max_radius = std::max(max_radius, p.diameter/2.0);
+    }
+    cell_size = CUTOFF_SPLITS*SPLIT_CELLS*h;
+    cell_origin = lo;
+    size_t cell_count = 1;
+    for (glm::length_t k = 0; k < D; ++k) {
+        cells[k] = static_cast<size_t>((hi[k]-lo[k])/cell_size)+1;
+        cell_count *= cells[k];
+    }
+
+    // Counting sort of particle indexes by cell.
+    cell_start.assign(cell_count+1, 0);
+    std::vector<size_t> cell_of(particles.size());
+    for (size_t i = 0; i < particles.size(); ++i) {
+        cell_of[i] = cell_index(particles[i].position);
+        ++cell_start[cell_of[i]+1];
+    }
+    for (size_t c = 0; c < cell_count; ++c)
+        cell_start[c+1] += cell_start[c];
+    cell_particles.resize(particles.size());
+    std::vector<size_t> fill(cell_start.begin(), cell_start.end()-1);
+    for (size_t i = 0; i < particles.size(); ++i)
+        cell_particles[fill[cell_of[i]]++] = i;
+}
+
+// Cloud-in-cell interpolation of the long-range acceleration at a position.
+template <glm::length_t D, typename Precision>
+inline auto Solver<D, Precision>::interpolate_mesh(const Position& position) const -> Acceleration {
+    glm::vec<D, double> a(0.0);
+    for_each_node(position, [this, &a](size_t index, double weight) {
+        for (glm::length_t k = 0; k < D; ++k)
+            a[k] += weight*(k%2 == 0 ? meshes[k/2][index].real() : meshes[k/2][index].imag());
+    });
+    return Acceleration(a);
+}
+
+template <glm::length_t D, typename Precision>
+inline Collisions Solver<D, Precision>::accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start) const {
+    trace::Scope scope("block");
+    counters::Scope counted("force");
+    Collisions collisions;
+    const pair_type cutoff = static_cast<pair_type>(cell_size);
+    const pair_type split = static_cast<pair_type>(SPLIT_CELLS*h);
+    for (size_t i1 = block_start; i1 < block_start+block_size && i1 < in_particles.size(); ++i1) {
+        const Particle& ip1 = in_particles[i1];
+        Particle& op1 = out_particles[i1];
+        const pair_type r1 = ip1.diameter/2.0F;
+        Acceleration acceleration = interpolate_mesh(ip1.position);
+
+        // Search far enough to find every short-range neighbour and every particle that could be touching this one.
+        const double reach = std::max(cell_size, r1+max_radius);
+        const long span = static_cast<long>(std::ceil(reach/cell_size));
+        const glm::vec<D, double> u = glm::vec<D, double>(ip1.position-cell_origin)/cell_size;
+        std::array<long, D> first, last, cell;
+        for (glm::length_t k = 0; k < D; ++k) {
+            const long c = std::min(static_cast<long>(u[k]), static_cast<long>(cells[k])-1);
+            first[k] = std::max(c-span, 0L);
+            last[k] = std::min(c+span, static_cast<long>(cells[k])-1);
+        }
+        cell = first;
+        while (true) {
+            size_t c = 0;
+            for (glm::length_t k = D; k-- > 0;)
+                c = c*cells[k]+static_cast<size_t>(cell[k]);
+            for (size_t k = cell_start[c]; k < cell_start[c+1]; ++k) {
+                const size_t i2 = cell_particles[k];
+                if (i1 == i2) continue;
+                const Particle& ip2 = in_particles[i2];
+                const glm::vec<D, pair_type> distances(ip2.position-ip1.position);
+                const pair_type quadrance = glm::dot(distances, distances);
+                const pair_type distance = sqrt(quadrance);
+                const pair_type r2 = ip2.diameter/2.0F;
+
+                if (distance <= r1+r2) {
+                    // Collision. Same as Particle::accelerate_particle().
+                    collisions[op1.id].insert(out_particles[i2].id);
+                } else if (distance < cutoff) {
+                    // The short-range part of the force, with the same softening as Particle::accelerate_particle().
+                    const pair_type mass2 = glm::pi<pair_type>()*r2*r2;
+                    const pair_type quadrance2 = std::max(quadrance, pair_type{3});
+                    const pair_type fraction = static_cast<pair_type>(short_range_fraction(distance/split));
+                    const pair_type gacceleration1 = fraction*static_cast<pair_type>(GRAVITY)*mass2/quadrance2;
+                    for (glm::length_t axis = 0; axis < D; ++axis)
+                        acceleration[axis] += (gacceleration1*distances[axis])/distance;
+                }
+            }
+
+            // Step to the next neighbouring cell like an odometer.
+            glm::length_t k = 0;
+            for (; k < D && cell[k] == last[k]; ++k)
+                cell[k] = first[k];
+            if (k == D) break;
+            ++cell[k];
+        }
+        op1.velocity += acceleration*static_cast<accumulator_type>(delta);
+    }
+    return collisions;
+}
+
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::accelerate_particles(Particles& particles, float delta) {
+    const Particles& in_particles = particles;
+    Particles& out_particles = store;
+    Particle::copy_particles(in_particles, out_particles);
+    if (in_particles.empty())
+        return;
+
+    {
+        trace::Scope scope("mesh");
+        build_mesh(in_particles);
+    }
+    {
+        trace::Scope scope("cells");
+        build_cells(in_particles);
+    }
+
+    size_t thread_count = parallel::thread_count();
+    size_t block_size = in_particles.size()/thread_count;
+    if (in_particles.size()%thread_count != 0)
+        ++block_size;
+    std::vector<Collisions> collisions;
+    {
+        trace::Scope scope("force");
+        std::vector<std::future<Collisions>> threads;
+        threads.reserve(thread_count);
+        for (size_t t = 0; t < thread_count; ++t) {
+            threads.push_back(std::async(&Solver::accelerate_particle_block, this, std::cref(in_particles), std::ref(out_particles), delta, block_size, t*block_size));
+        }
+        for (auto& f : threads)
+            collisions.push_back(f.get());
+    }
+
+    Particle::merge_collisions(in_particles, out_particles, collisions);
+    particles.swap(store);
+}
+
+extern template class Solver<2, SinglePrecision>;
+extern template class Solver<2, DoublePrecision>;
+extern template class Solver<2, MixedPrecision>;
+extern template class Solver<3, SinglePrecision>;
+extern template class Solver<3, DoublePrecision>;
+extern template class Solver<3, MixedPrecision>;
+
+}    // namespace p3m
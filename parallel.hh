@@ -0,0 +1,231 @@
+// parallel.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "counters.hh"
+#include "hardware.hh"
+#include "trace.hh"
+
+namespace parallel {
+
+// The number of worker threads. Zero means one per hardware thread.
+inline size_t threads = 0;
+
+// Items per chunk taken by for_chunks() callers that don't choose. Zero means automatic.
+inline size_t chunk = 0;
+
+constexpr size_t CHUNKS_PER_THREAD = 16;    // Automatic chunks are sized so each thread takes about this many.
+
+// Pin the workers to the first this many NUMA nodes, or 0 not to pin them. Workers are spread over the nodes
+// in order, so with 8 workers on 2 nodes, workers 0 to 3 run on node 0 and work on the first half of [0, n),
+// and first_touch() places that half's memory there.
+inline size_t pin_nodes = 0;
+
+// The NUMA node of worker t of thread_count, or 0 when not pinning.
+inline size_t worker_node(size_t t, size_t thread_count) {
+    const size_t nodes = std::min({pin_nodes, hardware::numa_nodes().size(), thread_count});
+    return nodes == 0 ? 0 : t*nodes/thread_count;
+}
+
+// Restricts the calling thread to worker t's node, if pinning.
+inline void pin_worker(size_t t, size_t thread_count) {
+    if (pin_nodes != 0)
+        hardware::pin_thread(hardware::numa_nodes()[worker_node(t, thread_count)]);
+}
+
+inline size_t thread_count() {
+    if (threads != 0)
+        return threads;
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Split [0, n) into one contiguous block per thread and call f(begin, end, t) for each block concurrently.
+// Each block is traced, so a trace shows any imbalance between them, and counted under the caller's phase.
+template <typename F>
+inline void for_blocks(size_t n, F&& f) {
+    size_t thread_count = parallel::thread_count();
+    size_t block_size = n/thread_count;
+    if (n%thread_count != 0)
+        ++block_size;
+    const char* phase = counters::current_phase();
+    std::vector<std::future<void>> futures;
+    futures.reserve(thread_count);
+    for (size_t t = 0; t < thread_count; ++t) {
+        size_t begin = std::min(n, t*block_size);
+        size_t end = std::min(n, begin+block_size);
+        futures.push_back(std::async(std::launch::async, [&f, begin, end, t, thread_count, phase]() {
+            pin_worker(t, thread_count);
+            trace::Scope scope("block");
+            counters::Scope counted(phase);
+            f(begin, end, t);
+        }));
+    }
+    for (auto& future : futures)
+        future.get();
+}
+
+// Busy and idle seconds of each worker, summed over every call to for_chunks() since the last reset_balance().
+// A worker is busy from the start of a call until it finds no more chunks, then idle until the last finishes.
+struct Balance {
+    std::mutex mutex;
+    std::vector<double> busy;
+    std::vector<double> idle;
+    std::vector<size_t> chunks;
+    size_t calls{0};
+};
+
+inline Balance& balance() {
+    static Balance ret;
+    return ret;
+}
+
+inline void reset_balance() {
+    Balance& b = balance();
+    std::lock_guard lock(b.mutex);
+    b.busy.clear();
+    b.idle.clear();
+    b.chunks.clear();
+    b.calls = 0;
+}
+
+// Prints each worker's busy and idle time, and the efficiency, the busy fraction of all the workers' time.
+inline void report_balance(std::ostream& out) {
+    Balance& b = balance();
+    std::lock_guard lock(b.mutex);
+    double busy = 0.0;
+    double total = 0.0;
+    for (size_t t = 0; t < b.busy.size(); ++t) {
+        out << "worker " << std::setw(3) << t << std::fixed << std::setprecision(4) << "  busy " << b.busy[t] << " s  idle "
+            << b.idle[t] << " s  chunks " << b.chunks[t] << std::defaultfloat << std::endl;
+        busy += b.busy[t];
+        total += b.busy[t]+b.idle[t];
+    }
+    if (total > 0.0)
+        out << b.calls << " calls, efficiency " << std::fixed << std::setprecision(1) << 100.0*busy/total << "%" << std::defaultfloat << std::endl;
+}
+
+// Call f(begin, end, t) for chunks of [0, n) on one worker per thread, where t is the worker. Each worker takes
+// the next chunk from a shared counter until none are left, so a worker that gets cheap chunks takes more of
+// them, and no worker waits on a slow contiguous block. chunk is the items per chunk, or 0 for
+// parallel::chunk, or if that's 0 too, enough for each thread to take about CHUNKS_PER_THREAD, rounded up to
+// a multiple of align. Each chunk is traced, and each worker is counted under the caller's phase.
+//
+// When pinning, each NUMA node has its own counter over the part of [0, n) that for_blocks() gives its
+// workers, with both ends rounded up to a multiple of align, and a worker only helps the other nodes when its
+// own has no chunks left.
+template <typename F>
+inline void for_chunks(size_t n, size_t chunk, size_t align, F&& f) {
+    const size_t thread_count = parallel::thread_count();
+    if (chunk == 0)
+        chunk = parallel::chunk;
+    if (chunk == 0)
+        chunk = std::max<size_t>(1, n/(thread_count*CHUNKS_PER_THREAD));
+    align = std::max<size_t>(1, align);
+    chunk = (chunk+align-1)/align*align;
+    size_t block_size = n/thread_count;
+    if (n%thread_count != 0)
+        ++block_size;
+    const size_t nodes = worker_node(thread_count-1, thread_count)+1;
+    std::vector<std::atomic<size_t>> next(nodes);
+    std::vector<size_t> ends(nodes);
+    const auto boundary = [&](size_t i) { return std::min(n, (i+align-1)/align*align); };
+    for (size_t t = 0; t < thread_count; ++t) {
+        const size_t node = worker_node(t, thread_count);
+        if (t == 0 || node != worker_node(t-1, thread_count))
+            next[node].store(boundary(t*block_size), std::memory_order_relaxed);
+        ends[node] = boundary((t+1)*block_size);
+    }
+
+    const char* phase = counters::current_phase();
+    std::vector<double> busy(thread_count);
+    std::vector<size_t> chunks(thread_count);
+    std::vector<std::chrono::steady_clock::time_point> finished(thread_count);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> futures;
+    futures.reserve(thread_count);
+    for (size_t t = 0; t < thread_count; ++t) {
+        futures.push_back(std::async(std::launch::async, [&, t]() {
+            pin_worker(t, thread_count);
+            counters::Scope counted(phase);
+            const size_t home = worker_node(t, thread_count);
+            for (size_t k = 0; k < nodes; ++k) {
+                const size_t node = (home+k)%nodes;
+                for (size_t begin = next[node].fetch_add(chunk, std::memory_order_relaxed); begin < ends[node]; begin = next[node].fetch_add(chunk, std::memory_order_relaxed)) {
+                    trace::Scope scope("chunk");
+                    f(begin, std::min(ends[node], begin+chunk), t);
+                    ++chunks[t];
+                }
+            }
+            finished[t] = std::chrono::steady_clock::now();
+            busy[t] = std::chrono::duration<double>(finished[t]-start).count();
+        }));
+    }
+    for (auto& future : futures)
+        future.get();
+    const auto last = *std::max_element(finished.begin(), finished.end());
+
+    Balance& b = balance();
+    std::lock_guard lock(b.mutex);
+    b.busy.resize(std::max(b.busy.size(), thread_count));
+    b.idle.resize(b.busy.size());
+    b.chunks.resize(b.busy.size());
+    for (size_t t = 0; t < thread_count; ++t) {
+        b.busy[t] += busy[t];
+        b.idle[t] += std::chrono::duration<double>(last-finished[t]).count();
+        b.chunks[t] += chunks[t];
+    }
+    ++b.calls;
+}
+
+// Writes a zero into each page of an array of count items of size bytes, from the worker that for_blocks()
+// gives that part of the array to. Linux places a page on the NUMA node of the thread that first writes it, so
+// call it on newly allocated memory before filling it. Does nothing unless pinning on a machine with more than
+// one node.
+inline void first_touch(void* data, size_t count, size_t size) {
+    if (pin_nodes == 0 || hardware::numa_nodes().size() < 2 || count == 0)
+        return;
+    const size_t page = hardware::page_size();
+    volatile char* bytes = static_cast<char*>(data);
+    const uintptr_t base = reinterpret_cast<uintptr_t>(data);
+    for_blocks(count, [bytes, base, page, size](size_t begin, size_t end, size_t) {
+        // Each page whose first byte is in this block.
+        for (uintptr_t address = (base+begin*size+page-1)/page*page; address < base+end*size; address += page)
+            bytes[address-base] = 0;
+    });
+}
+
+// Sort [first, last) by sorting one block per thread concurrently, then merging neighbouring blocks in rounds.
+template <typename Iterator, typename Compare = std::less<>>
+inline void sort(Iterator first, Iterator last, Compare compare = {}) {
+    const size_t n = static_cast<size_t>(last-first);
+    if (n == 0)
+        return;
+    size_t thread_count = parallel::thread_count();
+    size_t block_size = n/thread_count;
+    if (n%thread_count != 0)
+        ++block_size;
+    for_blocks(n, [&first, &compare](size_t begin, size_t end, size_t) { std::sort(first+begin, first+end, compare); });
+    for (size_t width = block_size; width < n; width *= 2) {
+        for_blocks((n+2*width-1)/(2*width), [&first, &compare, n, width](size_t begin, size_t end, size_t) {
+            for (size_t m = begin; m < end; ++m) {
+                const size_t lo = m*2*width;
+                std::inplace_merge(first+lo, first+std::min(n, lo+width), first+std::min(n, lo+2*width), compare);
+            }
+        });
+    }
+}
+
+}    // namespace parallel
@@ -0,0 +1,34 @@
+// particles.cu
+// Copyright (C) 2023 by Shawn Yarbrough
+
+// Explicit instantiations of every dimension and precision policy, so each is compiled once and can be chosen at run time.
+
+#include "p3m.hh"
+#include "particles.hh"
+#include "precision.hh"
+#include "tree.hh"
+
+template struct BasicParticle<2, SinglePrecision>;
+template struct BasicParticle<2, DoublePrecision>;
+template struct BasicParticle<2, MixedPrecision>;
+template struct BasicParticle<3, SinglePrecision>;
+template struct BasicParticle<3, DoublePrecision>;
+template struct BasicParticle<3, MixedPrecision>;
+
+namespace p3m {
+template class Solver<2, SinglePrecision>;
+template class Solver<2, DoublePrecision>;
+template class Solver<2, MixedPrecision>;
+template class Solver<3, SinglePrecision>;
+template class Solver<3, DoublePrecision>;
+template class Solver<3, MixedPrecision>;
+}    // namespace p3m
+
+namespace tree {
+template class Solver<2, SinglePrecision>;
+template class Solver<2, DoublePrecision>;
+template class Solver<2, MixedPrecision>;
+template class Solver<3, SinglePrecision>;
+template class Solver<3, DoublePrecision>;
+template class Solver<3, MixedPrecision>;
+}    // namespace tree
@@ -3,10 +3,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cmath>
+#include <cstdint>
 #include <future>
 #include <iostream>
-#include <queue>
+#include <optional>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -15,34 +22,93 @@
 #include <glm/glm.hpp>
 #include "csv_parser/csv_parser.h"
 
+#include "parallel.hh"
+#include "precision.hh"
+#include "counters.hh"
+#include "hardware.hh"
 #include "randomize.hh"
+#include "trace.hh"
 
-constexpr float GRAVITY = 50.0F;
-constexpr float SPIN = 37.0F;
+// Physics constants, which can be changed at run time before simulating. See options.hh.
+inline float GRAVITY = 50.0F;
+inline float SPIN = 37.0F;    // The rim speed of init_particle_grid().
+constexpr size_t REDUCTION_TILE = 64;    // Source particles per partial sum in reproducible mode.
+constexpr size_t TARGET_TILE = 8;    // Target particles held in registers by the tiled kernel. One SIMD register of floats.
 
 using Collisions = std::unordered_map<size_t, std::unordered_set<size_t>>;
 
-struct Particle;
-using Particles = std::vector<Particle>;
+// 1/sqrt(x) from an estimate made by halving the exponent bits, then Newton-Raphson steps. There's no sqrt
+// or divide, only integer and multiply instructions, so it vectorises. The estimate is within 3.5%, and each
+// step squares the error, so two steps give about 5e-6 in float and three about 3e-11 in double. x = 0 gives
+// a large finite number.
+template <typename T>
+inline T fast_inverse_sqrt(T x) {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
+    using Bits = std::conditional_t<std::is_same_v<T, float>, uint32_t, uint64_t>;
+    constexpr Bits MAGIC = static_cast<Bits>(std::is_same_v<T, float> ? 0x5f3759dfULL : 0x5fe6eb50c7b537a9ULL);
+    constexpr int STEPS = std::is_same_v<T, float> ? 2 : 3;
+    T y = std::bit_cast<T>(static_cast<Bits>(MAGIC-(std::bit_cast<Bits>(x) >> 1)));
+    for (int step = 0; step < STEPS; ++step)
+        y = y*(T{1.5}-T{0.5}*x*y*y);
+    return y;
+}
+
+// A particle in D dimensions (2 or 3), stored and simulated with the types chosen by a precision policy.
+// See precision.hh. Every loop over the D axes has a constant trip count, so the compiler unrolls it.
+template <glm::length_t D, typename Precision>
+struct BasicParticle {
+    static_assert(D == 2 || D == 3, "only 2-D and 3-D simulations are supported");
+    static constexpr glm::length_t dimensions = D;
+    using position_type = typename Precision::position_type;
+    using pair_type = typename Precision::pair_type;
+    using accumulator_type = typename Precision::accumulator_type;
+    using Position = glm::vec<D, position_type>;
+    using Velocity = glm::vec<D, accumulator_type>;
+    using Particles = std::vector<BasicParticle>;
 
-struct Particle {
     size_t id{std::numeric_limits<size_t>::max()};
-    glm::vec2 position{0, 0};
-    glm::vec2 velocity{0, 0};
-    glm::vec2 temporary_velocity{0, 0};
-    float diameter{1};
+    Position position{0};
+    Velocity velocity{0};
+    Velocity temporary_velocity{0};
+    pair_type diameter{1};
     glm::vec4 color{1, 1, 1, 1};
 
     static inline glm::vec4 choose_color_from_size(float sz);
-    static inline Particles init_particle_grid(size_t width, size_t height, int32_t radius, size_t max_velocity, size_t step);
-    static inline void accelerate_particle(const Particle& ip1, const Particle& ip2, Particle& op1, const Particle& op2, Collisions& collisions, float delta);
-    static inline Collisions accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start);
-    static inline Particles accelerate_particles(const Particles& in_particles, float delta);
+    static inline void reserve_particles(Particles& particles, size_t capacity);
+    static inline void copy_particles(const Particles& particles, Particles& copy);
+    static inline Particles init_particle_grid(size_t width, size_t height, int32_t radius, size_t max_velocity, size_t step, std::optional<size_t> seed = std::nullopt);
+    template <bool Potential = false>
+    static inline void accelerate_particle(const BasicParticle& ip1, const BasicParticle& ip2, BasicParticle& op1, const BasicParticle& op2, Collisions& collisions, float delta, accumulator_type* potential = nullptr);
+    static inline size_t source_tile_size();
+    template <bool Fast = false>
+    static inline Collisions accelerate_particle_block_tiled(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, accumulator_type* potentials);
+    template <bool Fast = false, bool Potential = false, bool Reproducible = false>
+    static inline Collisions accelerate_particle_block_sources(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, size_t source_begin, size_t source_end, accumulator_type* potentials = nullptr);
+    static inline Collisions accelerate_particle_block_reproducible(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, accumulator_type* potentials);
+    static inline void accelerate_particles(Particles& particles, Particles& store, float delta, bool reproducible = false, std::vector<accumulator_type>* potentials = nullptr, bool fast = false);
+    static inline void merge_collisions(const Particles& in_particles, Particles& out_particles, const std::vector<Collisions>& collisions);
     static inline void move_particles(Particles& particles, float delta);
     static inline void draw_particles(const Particles& particles, unsigned int shader_program);
-};    // struct Particle
+};    // struct BasicParticle
+
+template <glm::length_t D, typename Precision>
+using BasicParticles = std::vector<BasicParticle<D, Precision>>;
+
+using Particle = BasicParticle<2, SinglePrecision>;
+using Particles = BasicParticles<2, SinglePrecision>;
+
+// Calls f.template operator()<D>() for a run-time choice of 2 or 3 dimensions.
+template <typename F>
+inline auto with_dimensions(glm::length_t dimensions, F&& f) {
+    if (dimensions == 3)
+        return f.template operator()<3>();
+    if (dimensions != 2)
+        throw std::runtime_error("unsupported number of dimensions: "+std::to_string(dimensions));
+    return f.template operator()<2>();
+}
 
-inline glm::vec4 Particle::choose_color_from_size(float sz) {
+template <glm::length_t D, typename Precision>
+inline glm::vec4 BasicParticle<D, Precision>::choose_color_from_size(float sz) {
     if (sz <= 5) return glm::vec4(0.1f, 0.1f, 0.1f, 1.0f);
     else if (sz <= 15) return glm::vec4(0.2f, 0.2f, 0.2f, 1.0f);
     else if (sz <= 25) return glm::vec4(0.3f, 0.3f, 0.3f, 1.0f);
@@ -54,53 +120,106 @@ inline glm::vec4 Particle::choose_color_from_size(float sz) {
     else return glm::vec4(1.0f, 1.0f, 0.3f, 1.0f);
 }
 
-inline Particles Particle::init_particle_grid(size_t width, size_t height, int32_t radius, size_t max_velocity, size_t step) {
-    Particles ret;
-    ret.reserve(((width*height)/step)/step);
-
-    Randomize rize1(-max_velocity, +max_velocity);    // particle velocities
-    Randomize rize2(1, 3);    // particle sizes
-    size_t next_id = 0;
-
-    glm::vec2 center(0.0F, 0.0F);
-    for (int32_t y = -radius; y < +radius; y += step) {
-        for (int32_t x = -radius; x < +radius; x += step) {
-            Particle p;
-            p.id = next_id++;
-            p.position = glm::vec2(x+0.5F, y+0.5F);
-            glm::vec2 dcenter = center-p.position;
-            float len = glm::length(dcenter);
-            if (len > radius) continue;
-            if (dcenter[0] != 0.0F || dcenter[1] != 0.0F) {
-                auto ncenter = glm::normalize(dcenter);
-                p.velocity = glm::vec2(-ncenter[1], ncenter[0]);
-                p.velocity *= len/radius;
-                p.velocity *= SPIN;
-                p.velocity[0] += rize1.get();
-                p.velocity[1] += rize1.get();
-            } else {
-                p.velocity = glm::vec2(0.0F, 0.0F);
+// Like particles.reserve(capacity), except that when pinning workers to NUMA nodes, the new memory is first
+// touched by the workers that will use it. Memory that's already there isn't touched again.
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::reserve_particles(Particles& particles, size_t capacity) {
+    if (particles.capacity() >= capacity)
+        return;
+    Particles grown;
+    grown.reserve(capacity);
+    parallel::first_touch(grown.data(), grown.capacity(), sizeof(BasicParticle));
+    grown.assign(particles.begin(), particles.end());
+    particles.swap(grown);
+}
+
+// Copies particles into copy, reusing its memory. It only grows when particles has more spare capacity, such
+// as room reserved for infalling particles (see infall.hh), so a store kept between frames rarely allocates.
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::copy_particles(const Particles& particles, Particles& copy) {
+    if (copy.capacity() < particles.capacity()) {
+        copy.clear();    // Nothing to keep when it grows.
+        reserve_particles(copy, particles.capacity());
+    }
+    copy.assign(particles.begin(), particles.end());
+}
+
+template <glm::length_t D, typename Precision>
+inline auto BasicParticle<D, Precision>::init_particle_grid(size_t /*width*/, size_t /*height*/, int32_t radius, size_t max_velocity, size_t step, std::optional<size_t> seed) -> Particles {
+    const CounterRandomize rize1 = seed ? CounterRandomize(-max_velocity, +max_velocity, *seed) : CounterRandomize(-max_velocity, +max_velocity);    // particle velocities
+    const CounterRandomize rize2 = seed ? CounterRandomize(1, 3, *seed+1) : CounterRandomize(1, 3);    // particle sizes
+
+    // A square lattice cropped to a disc, or in 3-D a cubic lattice cropped to a ball, spinning around the z axis.
+    // Each row of the lattice is counted and then filled concurrently. ID's must match indexes, so a row's
+    // first ID is the number of particles in the rows before it, and the random numbers are keyed by ID.
+    const size_t side = (2*static_cast<size_t>(radius)+step-1)/step;
+    const size_t rows = (D == 3 ? side : 1)*side;
+    auto lattice_point = [radius, step, side](size_t row, size_t column) {
+        Position position;
+        position[0] = -radius+static_cast<int32_t>(column*step)+0.5F;
+        position[1] = -radius+static_cast<int32_t>((row%side)*step)+0.5F;
+        if constexpr (D == 3)
+            position[2] = -radius+static_cast<int32_t>((row/side)*step)+0.5F;
+        return position;
+    };
+    std::vector<size_t> row_start(rows+1, 0);
+    parallel::for_blocks(rows, [&](size_t begin, size_t end, size_t) {
+        for (size_t row = begin; row < end; ++row)
+            for (size_t column = 0; column < side; ++column)
+                row_start[row+1] += glm::length(lattice_point(row, column)) <= radius;
+    });
+    for (size_t row = 0; row < rows; ++row)
+        row_start[row+1] += row_start[row];
+
+    Particles ret(row_start[rows]);
+    parallel::for_blocks(rows, [&](size_t begin, size_t end, size_t) {
+        for (size_t row = begin; row < end; ++row) {
+            size_t next_id = row_start[row];
+            for (size_t column = 0; column < side; ++column) {
+                BasicParticle p;
+                p.position = lattice_point(row, column);
+                Position dcenter = -p.position;
+                position_type len = glm::length(dcenter);
+                if (len > radius) continue;
+                p.id = next_id++;
+                if (dcenter[0] != 0.0F || dcenter[1] != 0.0F) {
+                    const glm::vec<2, position_type> planar(dcenter[0], dcenter[1]);
+                    auto ncenter = glm::vec<2, accumulator_type>(glm::normalize(planar));
+                    p.velocity[0] = -ncenter[1];
+                    p.velocity[1] = ncenter[0];
+                    p.velocity *= static_cast<accumulator_type>(glm::length(planar)/radius);
+                    p.velocity *= static_cast<accumulator_type>(SPIN);
+                    for (glm::length_t k = 0; k < D; ++k)
+                        p.velocity[k] += rize1.get(p.id, k);
+                } else {
+                    p.velocity = Velocity(0.0F);
+                }
+                p.diameter=rize2.get(p.id, 0);
+                p.color = choose_color_from_size(p.diameter);
+                ret[p.id] = p;
             }
-            p.diameter=rize2.get();
-            p.color = Particle::choose_color_from_size(p.diameter);
-            ret.push_back(p);
         }
-    }
+    });
     return ret;
 }
 
-inline void Particle::accelerate_particle(const Particle& ip1, const Particle& ip2, Particle& op1, const Particle& op2, Collisions& collisions, float delta) {
-    const float xdistance = ip2.position[0]-ip1.position[0];
-    const float ydistance = ip2.position[1]-ip1.position[1];
-    const float quadrance = (xdistance*xdistance)+(ydistance*ydistance);
-    const float distance = sqrt(quadrance);
+// With Potential, also subtracts the pair's potential energy, G*m1*m2/sqrt(max(r^2, 3)) with the same softening, from *potential.
+template <glm::length_t D, typename Precision>
+template <bool Potential>
+inline void BasicParticle<D, Precision>::accelerate_particle(const BasicParticle& ip1, const BasicParticle& ip2, BasicParticle& op1, const BasicParticle& op2, Collisions& collisions, float delta, accumulator_type* potential) {
+    // The positions are subtracted at full precision before narrowing to the pair type.
+    const glm::vec<D, pair_type> distances(ip2.position-ip1.position);
+    const pair_type quadrance = glm::dot(distances, distances);
+    const pair_type distance = sqrt(quadrance);
 
     // Collision detection.
-    float r1 = ip1.diameter/2.0F;
-    float r2 = ip2.diameter/2.0F;
-    // For simplicity, the mass is assumed to equal the area of the particle. (A=pi*r^2)
-    const float mass1 = glm::pi<float>()*r1*r1;
-    const float mass2 = glm::pi<float>()*r2*r2;
+    pair_type r1 = ip1.diameter/2.0F;
+    pair_type r2 = ip2.diameter/2.0F;
+    // For simplicity, the mass is assumed to equal the area of the particle, even in 3-D. (A=pi*r^2)
+    const pair_type mass1 = glm::pi<pair_type>()*r1*r1;
+    const pair_type mass2 = glm::pi<pair_type>()*r2*r2;
+    if constexpr (Potential)
+        *potential -= static_cast<accumulator_type>(static_cast<pair_type>(GRAVITY)*(mass1*mass2)/sqrt(std::max(quadrance, pair_type{3})));
 
     if (distance <= r1+r2) {
         // Collision.
@@ -111,154 +230,405 @@ inline void Particle::accelerate_particle(const Particle& ip1, const Particle& i
         collisions[op1.id].insert(op2.id);
     } else {
         // Apply the acceleration from the force felt between two particles.
-        const float quadrance2 = std::max(quadrance, 3.0F);    // Don't divide by a number too close to zero.
-        const float gforce = GRAVITY*(mass1*mass2)/quadrance2;    // TODO
-        const float gacceleration1 = gforce/mass1;
-        const float gacceleration2 = -(gforce/mass2);
-
-        const float xacceleration1 = (gacceleration1*xdistance)/distance;
-        const float yacceleration1 = (gacceleration1*ydistance)/distance;
-        const float xacceleration2 = (gacceleration2*xdistance)/distance;
-        const float yacceleration2 = (gacceleration2*ydistance)/distance;
-
-        op1.velocity[0] += xacceleration1*delta;
-        op1.velocity[1] += yacceleration1*delta;
-        // op2.velocity[0] += xacceleration2*delta;
-        // op2.velocity[1] += yacceleration2*delta;
+        const pair_type quadrance2 = std::max(quadrance, pair_type{3});    // Don't divide by a number too close to zero.
+        const pair_type gforce = static_cast<pair_type>(GRAVITY)*(mass1*mass2)/quadrance2;    // TODO
+        const pair_type gacceleration1 = gforce/mass1;
+        // const pair_type gacceleration2 = -(gforce/mass2);
+
+        for (glm::length_t k = 0; k < D; ++k) {
+            const pair_type acceleration1 = (gacceleration1*distances[k])/distance;
+            // const pair_type acceleration2 = (gacceleration2*distances[k])/distance;
+            op1.velocity[k] += acceleration1*delta;
+            // op2.velocity[k] += acceleration2*delta;
+        }
+    }
+}
+
+// Sources per tile in accelerate_particle_block_tiled(): as many as fill half the level 1 data cache, or a
+// quarter of level 2 if level 1 is unknown, so a tile stays cached while every target in a block visits it.
+template <glm::length_t D, typename Precision>
+inline size_t BasicParticle<D, Precision>::source_tile_size() {
+    static const size_t ret = []() {
+        constexpr size_t source_bytes = D*sizeof(position_type)+2*sizeof(pair_type);
+        const size_t l1 = hardware::cache_size(1);
+        const size_t bytes = l1 != 0 ? l1/2 : hardware::cache_size(2)/4;
+        return std::clamp<size_t>(bytes/source_bytes/TARGET_TILE*TARGET_TILE, 256, 16384);
+    }();
+    return ret;
+}
+
+// accelerate_particle() for every target in the block from every source, with the same arithmetic in the same
+// order for each target, but cache blocked. The results are identical to the plain loop unless the compiler
+// contracts to FMAs differently. The sources are copied a tile at a time into separate arrays of positions,
+// radii and masses that fit in cache, and TARGET_TILE targets at a time sum the whole tile in registers. The
+// inner loop runs across the targets, which keeps each target's sum in order and lets the compiler vectorise it
+// without reassociating. Collisions are rare, so they're found in a second pass over any target that touched
+// something other than itself.
+//
+// Fast replaces the sqrt and the three divisions per pair with fast_inverse_sqrt(), which gives 1/r^3 in a
+// few multiplies, and tests for touching with the squared distance. The forces are approximate, with a
+// relative error of a few parts per million in float, and so are the potentials. See gravity-benchmark rsqrt.
+template <glm::length_t D, typename Precision>
+template <bool Fast>
+inline Collisions BasicParticle<D, Precision>::accelerate_particle_block_tiled(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, accumulator_type* potentials) {
+    if (potentials != nullptr) {
+        const size_t n = std::min(in_particles.size(), out_particles.size());
+        std::fill(potentials+std::min(n, block_start), potentials+std::min(n, block_start+block_size), accumulator_type{0});
+        return accelerate_particle_block_sources<Fast, true>(in_particles, out_particles, delta, block_size, block_start, 0, in_particles.size(), potentials);
     }
+    return accelerate_particle_block_sources<Fast>(in_particles, out_particles, delta, block_size, block_start, 0, in_particles.size());
 }
 
-inline Collisions Particle::accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start) {
+// accelerate_particle_block_tiled() from only the sources in [source_begin, source_end), so that the sources
+// can arrive in parts, such as the blocks of a ring in distributed.hh. With Potential, also subtracts each
+// pair's potential energy from the target's entry in potentials, as accelerate_particle() does. Reproducible
+// sums the sources in tiles of REDUCTION_TILE, from source_begin, and adds the tiles pairwise at the end.
+template <glm::length_t D, typename Precision>
+template <bool Fast, bool Potential, bool Reproducible>
+inline Collisions BasicParticle<D, Precision>::accelerate_particle_block_sources(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, size_t source_begin, size_t source_end, accumulator_type* potentials) {
+    trace::Scope scope("block");
+    counters::Scope counted("force");
     Collisions collisions;
-    for (size_t i1 = block_start; i1 < block_start+block_size && i1 < in_particles.size() && i1 < out_particles.size(); ++i1) {
-        const Particle& ip1 = in_particles[i1];
-        Particle &op1 = out_particles[i1];
-        for (size_t i2 = 0; i2 < in_particles.size() && i2 < out_particles.size(); ++i2) {
-            if (i1 == i2) continue;
-            const Particle& ip2 = in_particles[i2];
-            Particle &op2 = out_particles[i2];
-            accelerate_particle(ip1, ip2, op1, op2, collisions, delta);
+    const size_t n = std::min(in_particles.size(), out_particles.size());
+    const size_t begin = std::min(n, block_start);
+    const size_t end = std::min(n, block_start+block_size);
+    source_end = std::min(n, source_end);
+    const size_t tile = Reproducible ? REDUCTION_TILE : source_tile_size();
+    // With Reproducible, each target's sum over each tile, for the pairwise additions.
+    const size_t tiles = Reproducible && source_end > source_begin ? (source_end-source_begin+tile-1)/tile : 0;
+    std::vector<Velocity> sums((end-begin)*tiles);
+    std::array<std::vector<position_type>, D> source_positions;
+    for (auto& v : source_positions)
+        v.resize(tile);
+    std::vector<pair_type> source_radii(tile);
+    std::vector<pair_type> source_masses(tile);
+
+    // Sums sources [j0, j1) into targets [i0, i0+COUNT).
+    auto sum_tile = [&]<size_t COUNT>(size_t i0, size_t j0, size_t j1) {
+        position_type positions[D][COUNT];
+        pair_type radii[COUNT];
+        pair_type masses[COUNT];
+        accumulator_type velocities[D][COUNT];
+        accumulator_type potential[COUNT] = {};
+        for (size_t t = 0; t < COUNT; ++t) {
+            if constexpr (Potential)
+                potential[t] = potentials[i0+t];
+            const BasicParticle& ip1 = in_particles[i0+t];
+            for (glm::length_t k = 0; k < D; ++k) {
+                positions[k][t] = ip1.position[k];
+                velocities[k][t] = Reproducible ? accumulator_type{0} : out_particles[i0+t].velocity[k];
+            }
+            radii[t] = ip1.diameter/2.0F;
+            masses[t] = glm::pi<pair_type>()*radii[t]*radii[t];
+        }
+        // Touching sources per target, counting itself. Counted rather than or'ed, because a reduction of a
+        // flag across the targets stops GCC vectorising the loop.
+        unsigned touches[COUNT] = {};
+        const pair_type gravity = static_cast<pair_type>(GRAVITY);
+        const pair_type sqrt3 = sqrt(pair_type{3});    // The softened distance of a pair closer than that.
+        const pair_type one_over_sqrt3 = pair_type{1}/sqrt3;
+        for (size_t j = j0; j < j1; ++j) {
+            const size_t s = j-j0;
+            position_type source[D];
+            for (glm::length_t k = 0; k < D; ++k)
+                source[k] = source_positions[k][s];
+            const pair_type r2 = source_radii[s];
+            const pair_type mass2 = source_masses[s];
+            for (size_t t = 0; t < COUNT; ++t) {
+                pair_type distances[D];
+                pair_type quadrance{0};
+                for (glm::length_t k = 0; k < D; ++k) {
+                    distances[k] = static_cast<pair_type>(source[k]-positions[k][t]);
+                    quadrance += distances[k]*distances[k];    // In the same order as glm::dot().
+                }
+                if constexpr (Fast) {
+                    const pair_type reach = radii[t]+r2;
+                    const bool touching = quadrance <= reach*reach;
+                    touches[t] += touching;
+                    // G*m2/max(r^2, 3) along the unit vector d/r, so G*m2*d/(r*max(r^2, 3)).
+                    const pair_type inverse = fast_inverse_sqrt(quadrance);
+                    const pair_type inverse_quadrance2 = quadrance < pair_type{3} ? pair_type{1}/pair_type{3} : inverse*inverse;
+                    const pair_type keep = touching ? pair_type{0} : pair_type{1};
+                    const pair_type scale = keep*gravity*mass2*inverse*inverse_quadrance2*delta;
+                    for (glm::length_t k = 0; k < D; ++k)
+                        velocities[k][t] += scale*distances[k];
+                    if constexpr (Potential) {
+                        const pair_type inverse_softened = quadrance < pair_type{3} ? one_over_sqrt3 : inverse;
+                        potential[t] -= i0+t == j ? accumulator_type{0} : static_cast<accumulator_type>(gravity*(masses[t]*mass2)*inverse_softened);
+                    }
+                } else {
+                    const pair_type distance = sqrt(quadrance);
+                    const bool touching = distance <= radii[t]+r2;
+                    touches[t] += touching;
+                    const pair_type quadrance2 = quadrance < pair_type{3} ? pair_type{3} : quadrance;
+                    const pair_type gforce = gravity*(masses[t]*mass2)/quadrance2;
+                    const pair_type gacceleration1 = gforce/masses[t];
+                    // Always computed, then multiplied by 0 or 1, so there's no branch to stop vectorisation. A
+                    // touching pair divides by 1 instead, so a target with itself gives 0 and not 0/0.
+                    const pair_type divisor = touching ? pair_type{1} : distance;
+                    const pair_type keep = touching ? pair_type{0} : pair_type{1};
+                    for (glm::length_t k = 0; k < D; ++k) {
+                        const pair_type acceleration1 = (gacceleration1*distances[k])/divisor;
+                        velocities[k][t] += (keep*acceleration1)*delta;
+                    }
+                    if constexpr (Potential) {
+                        const pair_type softened = quadrance < pair_type{3} ? sqrt3 : distance;
+                        potential[t] -= i0+t == j ? accumulator_type{0} : static_cast<accumulator_type>(gravity*(masses[t]*mass2)/softened);
+                    }
+                }
+            }
+        }
+        for (size_t t = 0; t < COUNT; ++t)
+            for (glm::length_t k = 0; k < D; ++k) {
+                if constexpr (Reproducible)
+                    sums[(i0+t-begin)*tiles+(j0-source_begin)/tile][k] = velocities[k][t];
+                else
+                    out_particles[i0+t].velocity[k] = velocities[k][t];
+            }
+        if constexpr (Potential)
+            for (size_t t = 0; t < COUNT; ++t)
+                potentials[i0+t] = potential[t];
+        for (size_t t = 0; t < COUNT; ++t) {
+            if (touches[t] <= (i0+t >= j0 && i0+t < j1 ? 1U : 0U))
+                continue;
+            for (size_t j = j0; j < j1; ++j) {
+                if (i0+t == j) continue;
+                const glm::vec<D, pair_type> distances(in_particles[j].position-in_particles[i0+t].position);
+                const pair_type quadrance = glm::dot(distances, distances);
+                const pair_type reach = radii[t]+source_radii[j-j0];
+                if (Fast ? quadrance <= reach*reach : sqrt(quadrance) <= reach)
+                    collisions[i0+t].insert(j);
+            }
+        }
+    };
+
+    for (size_t j0 = source_begin; j0 < source_end; j0 += tile) {
+        const size_t j1 = std::min(source_end, j0+tile);
+        for (size_t j = j0; j < j1; ++j) {
+            const BasicParticle& ip2 = in_particles[j];
+            for (glm::length_t k = 0; k < D; ++k)
+                source_positions[k][j-j0] = ip2.position[k];
+            source_radii[j-j0] = ip2.diameter/2.0F;
+            source_masses[j-j0] = glm::pi<pair_type>()*source_radii[j-j0]*source_radii[j-j0];
+        }
+        size_t i0 = begin;
+        for (; i0+TARGET_TILE <= end; i0 += TARGET_TILE)
+            sum_tile.template operator()<TARGET_TILE>(i0, j0, j1);
+        for (; i0 < end; ++i0)
+            sum_tile.template operator()<1>(i0, j0, j1);
+    }
+    if constexpr (Reproducible) {
+        for (size_t i = begin; i < end; ++i) {
+            Velocity* sum = sums.data()+(i-begin)*tiles;
+            for (size_t count = tiles; count > 1; count = (count+1)/2) {
+                for (size_t k = 0; k < count/2; ++k)
+                    sum[k] = sum[2*k]+sum[2*k+1];
+                if (count%2 != 0)
+                    sum[count/2] = sum[count-1];
+            }
+            if (tiles != 0)
+                out_particles[i].velocity += sum[0];
         }
     }
     return collisions;
 }
 
-inline Particles Particle::accelerate_particles(const Particles& in_particles, float delta) {
-    // auto ts1 = std::chrono::system_clock::now();
-    Particles out_particles;
-    out_particles.reserve(in_particles.size());
+// The same as accelerate_particle_block_tiled(), except each particle's acceleration is summed in tiles of
+// REDUCTION_TILE sources and the tiles are then added pairwise. The order of the additions depends only on
+// the number of particles, and pairwise summation also loses less precision than one long running sum. The
+// tiles are summed by the loop of accelerate_particle_block_tiled(), without Fast.
+template <glm::length_t D, typename Precision>
+inline Collisions BasicParticle<D, Precision>::accelerate_particle_block_reproducible(const Particles& in_particles, Particles& out_particles, float delta, size_t block_size, size_t block_start, accumulator_type* potentials) {
+    if (potentials != nullptr) {
+        const size_t n = std::min(in_particles.size(), out_particles.size());
+        std::fill(potentials+std::min(n, block_start), potentials+std::min(n, block_start+block_size), accumulator_type{0});
+        return accelerate_particle_block_sources<false, true, true>(in_particles, out_particles, delta, block_size, block_start, 0, in_particles.size(), potentials);
+    }
+    return accelerate_particle_block_sources<false, false, true>(in_particles, out_particles, delta, block_size, block_start, 0, in_particles.size());
+}
 
-    for (const Particle& p : in_particles) {
-        out_particles.emplace_back(p);
+// Advances particles in place. The results are summed into store, which the caller keeps between frames so
+// that its memory is reused, and then the two are swapped. If potentials isn't null, it's resized to hold each
+// particle's potential energy in the field of all the others. fast uses the approximate reciprocal square
+// root, unless reproducible. See accelerate_particle_block_tiled().
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::accelerate_particles(Particles& particles, Particles& store, float delta, bool reproducible, std::vector<accumulator_type>* potentials, bool fast) {
+    const Particles& in_particles = particles;
+    Particles& out_particles = store;
+    copy_particles(in_particles, out_particles);
+    accumulator_type* potential_data = nullptr;
+    if (potentials != nullptr) {
+        potentials->assign(in_particles.size(), 0);
+        potential_data = potentials->data();
     }
 
     // Iterate over the set of particle pairs. O(n^2) time complexity because each particle must accelerate every other particle.
-    size_t thread_count = std::thread::hardware_concurrency();
-    size_t block_size = in_particles.size()/thread_count;
-    if (in_particles.size()%thread_count != 0)
-        ++block_size;
-    Collisions collisions;
-    std::vector<std::future<Collisions>> threads;
-    threads.reserve(thread_count);
-    auto ts2 = std::chrono::system_clock::now();
-    for (size_t t = 0; t < thread_count; ++t) {
-        threads.push_back(std::async(accelerate_particle_block, std::cref(in_particles), std::ref(out_particles), delta, block_size, t*block_size));
+    // The targets are scheduled in chunks, because merged giants and collision inserts make some much slower than others.
+    auto kernel = reproducible ? accelerate_particle_block_reproducible : fast ? accelerate_particle_block_tiled<true> : accelerate_particle_block_tiled<false>;
+    std::vector<Collisions> collisions(parallel::thread_count());
+    {
+        trace::Scope scope("force");
+        parallel::for_chunks(in_particles.size(), 0, TARGET_TILE, [&](size_t begin, size_t end, size_t t) {
+            collisions[t].merge(kernel(in_particles, out_particles, delta, end-begin, begin, potential_data));
+        });
     }
-    // auto ts3 = std::chrono::system_clock::now();
-    // std::cout << "async time " << std::chrono::duration<double>(ts3-ts2).count() << "s" << std::endl;
-    for (auto& f : threads) {
-        Collisions collisions2 = f.get();
-        for (const auto& item : collisions2) {
-            const size_t& id1 = item.first;
-            for (const size_t& id2 : item.second)
-                collisions[id1].insert(id2);
-        }
-    }
-    // auto ts4 = std::chrono::system_clock::now();
-    // std::cout << "thread get time " << std::chrono::duration<double>(ts4-ts3).count() << "s" << std::endl;
-
-    // Iterate over the set of collisions.
-    // auto ts5 = std::chrono::system_clock::now();
-    std::vector<uint8_t> deleted(out_particles.size(), false);
-    size_t deleted_count = 0;
-    while (!collisions.empty()) {
-        // Locate and remove a connected set of touching particles.
-        std::unordered_set<size_t> colliding_ids;
-        std::queue<size_t> q;
-        q.push(collisions.begin()->first);
-        while (!q.empty()) {
-            size_t id = q.front();
-            q.pop();
-            colliding_ids.insert(id);
-            if (collisions.contains(id)) {
-                for (size_t touching_id : collisions[id])
-                    q.push(touching_id);
-                collisions.erase(id);
-            }
-        }
 
-        // Calculate the total mass, the center of mass position, and
-        // the combined velocity vector, of the touching particles.
-        float total_mass = 0.0F;
-        glm::vec2 position{0.0F, 0.0F};
-        glm::vec2 velocity{0.0F, 0.0F};
-        for (size_t id : colliding_ids) {
-            const Particle& ip = in_particles[id];
-            float radius = ip.diameter/2.0F;
-            const float mass = glm::pi<float>()*radius*radius;
-            total_mass += mass;
-            position += ip.position*mass;
-            velocity += mass*ip.velocity;
+    merge_collisions(in_particles, out_particles, collisions);
+    particles.swap(store);
+}
+
+// Combine each connected set of touching particles into one particle, then remove the rest.
+// Every phase runs across the worker threads, and the result doesn't depend on the thread count:
+// each set of touching particles is merged into its lowest ID, summing the members in ID order.
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::merge_collisions(const Particles& in_particles, Particles& out_particles, const std::vector<Collisions>& collisions) {
+    trace::Scope scope("merge");
+    counters::Scope counted("merge");
+    const size_t n = out_particles.size();
+    bool any = false;
+    for (const Collisions& c : collisions)
+        any = any || !c.empty();
+    if (!any)
+        return;
+
+    // Lock-free union-find. A root is always linked under a smaller root, so every set ends up rooted at its lowest ID.
+    std::vector<std::atomic<size_t>> parent(n);
+    parallel::for_blocks(n, [&](size_t begin, size_t end, size_t) {
+        for (size_t id = begin; id < end; ++id)
+            parent[id].store(id, std::memory_order_relaxed);
+    });
+    auto find = [&parent](size_t id) {
+        size_t p = parent[id].load(std::memory_order_relaxed);
+        while (p != id) {
+            const size_t gp = parent[p].load(std::memory_order_relaxed);
+            parent[id].compare_exchange_weak(p, gp, std::memory_order_relaxed);    // Path halving.
+            id = gp;
+            p = parent[id].load(std::memory_order_relaxed);
         }
-        position /= total_mass;
-        velocity /= total_mass;
-        for (size_t id : colliding_ids)
-            deleted[id] = true;
-        deleted[*colliding_ids.begin()] = false;
-        deleted_count += colliding_ids.size()-1;
-        Particle& op = out_particles[*colliding_ids.begin()];
-        op.position = position;
-        op.velocity = velocity;
-        op.diameter = sqrt(total_mass/glm::pi<float>())*2.0F;    // A=pi*r^2
-        op.color = Particle::choose_color_from_size(op.diameter);
+        return id;
+    };
+    std::vector<std::future<void>> threads;
+    threads.reserve(collisions.size());
+    for (const Collisions& c : collisions) {
+        threads.push_back(std::async([&find, &parent, &c]() {
+            counters::Scope counted("merge");
+            for (const auto& item : c) {
+                for (size_t id2 : item.second) {
+                    size_t id1 = item.first;
+                    while (true) {
+                        id1 = find(id1);
+                        id2 = find(id2);
+                        if (id1 == id2) break;
+                        if (id1 < id2) std::swap(id1, id2);
+                        size_t expected = id1;
+                        if (parent[id1].compare_exchange_strong(expected, id2, std::memory_order_relaxed)) break;
+                    }
+                }
+            }
+        }));
     }
-
-    // Remove any deleted particles and renumber the particle ID's.
-    Particles temp_particles;
-    temp_particles.reserve(out_particles.size()-deleted_count);
-    size_t next_id = 0;
-    for (const Particle& op : out_particles)
-        if (!deleted[op.id]) {
-            temp_particles.emplace_back(op);
-            temp_particles.back().id = next_id++;
+    for (auto& f : threads)
+        f.get();
+
+    // Flatten the sets, and list the non-root members of each block sorted by (root, id).
+    size_t thread_count = parallel::thread_count();
+    std::vector<size_t> roots(n);
+    std::vector<std::vector<std::pair<size_t, size_t>>> members(thread_count);
+    parallel::for_blocks(n, [&](size_t begin, size_t end, size_t t) {
+        for (size_t id = begin; id < end; ++id) {
+            roots[id] = find(id);
+            if (roots[id] != id)
+                members[t].emplace_back(roots[id], id);
         }
-    out_particles.swap(temp_particles);
-    if (out_particles.size() != in_particles.size()) {
-        std::cout << out_particles.size() << " particles" << std::endl;
+        std::stable_sort(members[t].begin(), members[t].end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    });
+
+    // Calculate the total mass, the center of mass position, and
+    // the combined velocity vector, of the touching particles.
+    // Each thread owns a range of roots, and visits their members block by block, which is ascending ID order.
+    parallel::for_blocks(n, [&](size_t begin, size_t end, size_t) {
+        std::vector<size_t> cursors(members.size());
+        for (size_t b = 0; b < members.size(); ++b)
+            cursors[b] = std::lower_bound(members[b].begin(), members[b].end(), std::make_pair(begin, size_t{0}))-members[b].begin();
+        while (true) {
+            size_t root = end;
+            for (size_t b = 0; b < members.size(); ++b)
+                if (cursors[b] < members[b].size())
+                    root = std::min(root, members[b][cursors[b]].first);
+            if (root >= end) break;
+
+            accumulator_type total_mass = 0.0F;
+            glm::vec<D, accumulator_type> position{0.0F};
+            Velocity velocity{0.0F};
+            auto add = [&](size_t id) {
+                const BasicParticle& ip = in_particles[id];
+                accumulator_type radius = ip.diameter/2.0F;
+                const accumulator_type mass = glm::pi<accumulator_type>()*radius*radius;
+                total_mass += mass;
+                position += glm::vec<D, accumulator_type>(ip.position)*mass;
+                velocity += mass*ip.velocity;
+            };
+            add(root);
+            for (size_t b = 0; b < members.size(); ++b)
+                for (; cursors[b] < members[b].size() && members[b][cursors[b]].first == root; ++cursors[b])
+                    add(members[b][cursors[b]].second);
+            position /= total_mass;
+            velocity /= total_mass;
+            BasicParticle& op = out_particles[root];
+            op.position = Position(position);
+            op.velocity = velocity;
+            op.diameter = static_cast<pair_type>(sqrt(total_mass/glm::pi<accumulator_type>())*2.0F);    // A=pi*r^2
+            op.color = choose_color_from_size(op.diameter);
+        }
+    });
+
+    // Remove any merged particles and renumber the particle ID's, in place, so the store keeps its memory and
+    // its spare capacity, and the freed slots at the end can be refilled without reallocating. Each block is
+    // compacted to its own start concurrently, then the blocks are moved down in order.
+    trace::Scope compaction_scope("compaction");
+    std::vector<size_t> starts(thread_count, 0);
+    std::vector<size_t> counts(thread_count, 0);
+    parallel::for_blocks(n, [&](size_t begin, size_t end, size_t t) {
+        size_t next = begin;
+        for (size_t id = begin; id < end; ++id)
+            if (roots[id] == id)
+                out_particles[next++] = out_particles[id];
+        starts[t] = begin;
+        counts[t] = next-begin;
+    });
+    size_t kept = 0;
+    for (size_t t = 0; t < thread_count; ++t) {
+        if (kept != starts[t])
+            std::copy(out_particles.begin()+starts[t], out_particles.begin()+starts[t]+counts[t], out_particles.begin()+kept);
+        kept += counts[t];
     }
-
-    // auto ts6 = std::chrono::system_clock::now();
-    // std::cout << "collision time " << std::chrono::duration<double>(ts6-ts5).count() << "s" << std::endl;
-    // std::cout << "acceleration time " << std::chrono::duration<double>(ts6-ts1).count() << "s\n" << std::endl;
-    return out_particles;
+    out_particles.resize(kept);
+    parallel::for_blocks(kept, [&](size_t begin, size_t end, size_t) {
+        for (size_t id = begin; id < end; ++id)
+            out_particles[id].id = id;
+    });
 }
 
-inline void Particle::move_particles(Particles& particles, float delta) {
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::move_particles(Particles& particles, float delta) {
+    trace::Scope scope("move");
     for (auto& p : particles) {
-        p.position[0] += ((p.velocity[0]+p.temporary_velocity[0]) * delta);
-        p.position[1] += ((p.velocity[1]+p.temporary_velocity[1]) * delta);
-        p.temporary_velocity = glm::vec2(0.0F, 0.0F);
+        for (glm::length_t k = 0; k < D; ++k)
+            p.position[k] += static_cast<position_type>((p.velocity[k]+p.temporary_velocity[k]) * delta);
+        p.temporary_velocity = Velocity(0.0F);
     }
 }
 
-inline void Particle::draw_particles(const Particles& particles, unsigned int shader_program) {
+template <glm::length_t D, typename Precision>
+inline void BasicParticle<D, Precision>::draw_particles(const Particles& particles, unsigned int shader_program) {
+    trace::Scope scope("draw");
     std::vector<GLfloat> memory;
-    constexpr size_t stride = 7;    // The number of floats pushed in the following loop.
+    constexpr size_t stride = D+5;    // The number of floats pushed in the following loop.
     memory.reserve(particles.size()*sizeof(GLfloat)*stride);
     for (const auto& p : particles) {
-        memory.push_back(p.position[0]);
-        memory.push_back(p.position[1]);
-        memory.push_back(p.diameter);
+        for (glm::length_t k = 0; k < D; ++k)
+            memory.push_back(static_cast<GLfloat>(p.position[k]));
+        memory.push_back(static_cast<GLfloat>(p.diameter));
         memory.push_back(p.color[0]);
         memory.push_back(p.color[1]);
         memory.push_back(p.color[2]);
@@ -279,10 +649,13 @@ inline void Particle::draw_particles(const Particles& particles, unsigned int sh
     glEnableVertexAttribArray(2);
 
     // Configure the VAO and VBO.
-    glBufferData(GL_ARRAY_BUFFER, memory.size()*sizeof(GLfloat), &memory[0], GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)(0*sizeof(GLfloat)));
-    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)(2*sizeof(GLfloat)));
-    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
+    {
+        trace::Scope upload_scope("upload");
+        glBufferData(GL_ARRAY_BUFFER, memory.size()*sizeof(GLfloat), &memory[0], GL_STATIC_DRAW);
+    }
+    glVertexAttribPointer(0, D, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)(0*sizeof(GLfloat)));
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)(D*sizeof(GLfloat)));
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride*sizeof(GLfloat), (void*)((D+1)*sizeof(GLfloat)));
 
     glClearColor(0.0, 0.0, 0.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -297,3 +670,10 @@ inline void Particle::draw_particles(const Particles& particles, unsigned int sh
     glDeleteBuffers(1, &vbo);
     glDeleteVertexArrays(1, &vao);
 }
+
+extern template struct BasicParticle<2, SinglePrecision>;
+extern template struct BasicParticle<2, DoublePrecision>;
+extern template struct BasicParticle<2, MixedPrecision>;
+extern template struct BasicParticle<3, SinglePrecision>;
+extern template struct BasicParticle<3, DoublePrecision>;
+extern template struct BasicParticle<3, MixedPrecision>;
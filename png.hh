@@ -0,0 +1,197 @@
+// png.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// PNG images of 8-bit RGB pixels, for the frames rendered by render.hh, without a dependency on zlib or libpng.
+//
+// The image data is one deflate block with the fixed Huffman codes. Matches are only tried against the pixel to
+// the left, the pixel above, and the last place the next three bytes were seen. The frames are mostly black
+// with flat discs, so that finds most of what a full LZ77 search would, at a small part of the cost.
+namespace png {
+
+constexpr size_t MAX_MATCH = 258;
+constexpr size_t MAX_DISTANCE = 32768;
+constexpr unsigned HASH_BITS = 15;
+
+constexpr std::array<uint16_t, 29> LENGTH_BASE{3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr std::array<uint8_t, 29> LENGTH_EXTRA{0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr std::array<uint16_t, 30> DISTANCE_BASE{1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr std::array<uint8_t, 30> DISTANCE_EXTRA{0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Appends after the previous call's crc, starting from 0.
+inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> ret{};
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            ret[n] = c;
+        }
+        return ret;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t adler32(const uint8_t* data, size_t size) {
+    constexpr uint32_t MOD = 65521;
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        const size_t n = std::min<size_t>(size, 5552);    // The most that can't overflow b before the modulo.
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= MOD;
+        b %= MOD;
+        data += n;
+        size -= n;
+    }
+    return b << 16 | a;
+}
+
+// Deflate's bits are packed from the least significant end of each byte, except that Huffman codes go in from
+// their most significant bit.
+class Bits {
+    std::vector<uint8_t>& out;
+    uint64_t buffer{0};
+    unsigned count{0};
+
+public:
+    inline explicit Bits(std::vector<uint8_t>& out) : out(out) {}
+
+    inline void put(uint32_t value, unsigned bits) {
+        buffer |= static_cast<uint64_t>(value) << count;
+        count += bits;
+        while (count >= 8) {
+            out.push_back(static_cast<uint8_t>(buffer));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    inline void code(uint32_t value, unsigned bits) {
+        uint32_t reversed = 0;
+        for (unsigned b = 0; b < bits; ++b)
+            reversed |= (value >> b & 1) << (bits-1-b);
+        put(reversed, bits);
+    }
+
+    // A literal byte, a length or the end of the block, in the fixed literal/length code.
+    inline void symbol(uint32_t s) {
+        if (s < 144)
+            code(0x30+s, 8);
+        else if (s < 256)
+            code(0x190+s-144, 9);
+        else if (s < 280)
+            code(s-256, 7);
+        else
+            code(0xC0+s-280, 8);
+    }
+
+    inline void match(size_t length, size_t distance) {
+        const size_t l = std::upper_bound(LENGTH_BASE.begin(), LENGTH_BASE.end(), length)-LENGTH_BASE.begin()-1;
+        symbol(static_cast<uint32_t>(257+l));
+        put(static_cast<uint32_t>(length-LENGTH_BASE[l]), LENGTH_EXTRA[l]);
+        const size_t d = std::upper_bound(DISTANCE_BASE.begin(), DISTANCE_BASE.end(), distance)-DISTANCE_BASE.begin()-1;
+        code(static_cast<uint32_t>(d), 5);
+        put(static_cast<uint32_t>(distance-DISTANCE_BASE[d]), DISTANCE_EXTRA[d]);
+    }
+
+    inline void flush() {
+        if (count > 0)
+            out.push_back(static_cast<uint8_t>(buffer));
+        buffer = 0;
+        count = 0;
+    }
+};
+
+// Appends a zlib stream of size bytes at data, with pixel and row the distances to the left and above.
+inline void deflate(const uint8_t* data, size_t size, size_t pixel, size_t row, std::vector<uint8_t>& out) {
+    out.push_back(0x78);    // Deflate with a 32K window, no dictionary.
+    out.push_back(0x01);
+    Bits bits(out);
+    bits.put(1, 1);    // The final block,
+    bits.put(1, 2);    // with the fixed codes.
+    std::vector<uint32_t> recent(size_t(1) << HASH_BITS, 0);    // 1 + the last position of each hashed 3 bytes.
+    for (size_t i = 0; i < size; ) {
+        size_t best = 0, best_distance = 0;
+        size_t hashed = 0;
+        if (i+3 <= size) {
+            const uint32_t h = ((data[i] << 16 | data[i+1] << 8 | data[i+2])*2654435761u) >> (32-HASH_BITS);
+            hashed = recent[h] != 0 ? i+1-recent[h] : 0;
+            recent[h] = static_cast<uint32_t>(i+1);
+        }
+        for (size_t distance : {pixel, row, hashed}) {
+            if (distance == 0 || distance > i || distance > MAX_DISTANCE)
+                continue;
+            const size_t limit = std::min(MAX_MATCH, size-i);
+            size_t length = 0;
+            while (length < limit && data[i+length] == data[i+length-distance])
+                ++length;
+            if (length > best) {
+                best = length;
+                best_distance = distance;
+            }
+        }
+        if (best >= 3) {
+            bits.match(best, best_distance);
+            i += best;
+        } else {
+            bits.symbol(data[i++]);
+        }
+    }
+    bits.symbol(256);
+    bits.flush();
+    const uint32_t adler = adler32(data, size);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(adler >> shift));
+}
+
+inline void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+inline void chunk(std::vector<uint8_t>& out, const char type[4], const std::vector<uint8_t>& data) {
+    put_u32(out, static_cast<uint32_t>(data.size()));
+    const size_t start = out.size();
+    out.insert(out.end(), type, type+4);
+    out.insert(out.end(), data.begin(), data.end());
+    put_u32(out, crc32(out.data()+start, out.size()-start));
+}
+
+// Replaces out with the PNG of width*height pixels at rgb, three bytes each, from the top row down. scratch
+// holds the filtered rows, and may be kept between calls to save reallocating it.
+inline void encode(const uint8_t* rgb, unsigned width, unsigned height, std::vector<uint8_t>& out, std::vector<uint8_t>& scratch) {
+    const size_t row = 1+3*static_cast<size_t>(width);
+    scratch.resize(row*height);
+    for (size_t y = 0; y < height; ++y) {
+        scratch[y*row] = 0;    // No filter.
+        std::copy(rgb+y*(row-1), rgb+(y+1)*(row-1), scratch.begin()+y*row+1);
+    }
+    std::vector<uint8_t> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0});    // 8-bit RGB, deflated, no interlace.
+    std::vector<uint8_t> data;
+    deflate(scratch.data(), scratch.size(), 3, row, data);
+
+    out.clear();
+    out.insert(out.end(), {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'});
+    chunk(out, "IHDR", header);
+    chunk(out, "IDAT", data);
+    chunk(out, "IEND", {});
+}
+
+}    // namespace png
@@ -0,0 +1,54 @@
+// precision.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Precision policies for the particle store and the force kernels.
+//   position_type:     particle positions, and the difference between two positions.
+//   pair_type:         everything else computed per pair of particles, which is the hot loop.
+//   accumulator_type:  velocities, and every sum over many particles.
+
+struct SinglePrecision {
+    using position_type = float;
+    using pair_type = float;
+    using accumulator_type = float;
+    static constexpr const char* name = "float";
+};
+
+struct DoublePrecision {
+    using position_type = double;
+    using pair_type = double;
+    using accumulator_type = double;
+    static constexpr const char* name = "double";
+};
+
+// Float pair math at full SIMD width, but double positions and sums so that long orbits don't drift.
+struct MixedPrecision {
+    using position_type = double;
+    using pair_type = float;
+    using accumulator_type = double;
+    static constexpr const char* name = "mixed";
+};
+
+enum class Precision { single, double_, mixed };
+
+inline Precision precision_from_name(const std::string& name) {
+    if (name == SinglePrecision::name) return Precision::single;
+    if (name == DoublePrecision::name) return Precision::double_;
+    if (name == MixedPrecision::name) return Precision::mixed;
+    throw std::runtime_error("unknown precision: "+name);
+}
+
+// Calls f.template operator()<Policy>() with the policy type for a run-time precision choice.
+template <typename F>
+inline auto with_precision(Precision precision, F&& f) {
+    switch (precision) {
+    case Precision::double_: return f.template operator()<DoublePrecision>();
+    case Precision::mixed: return f.template operator()<MixedPrecision>();
+    case Precision::single: break;
+    }
+    return f.template operator()<SinglePrecision>();
+}
@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <iostream>
 #include <random>
 
 class Randomize {
@@ -30,3 +33,55 @@ public:
         return dist(gen);
     }
 };    // class Randomize
+
+// Counter-based random numbers. Philox4x32-10, from "Parallel Random Numbers: As Easy as 1, 2, 3" by
+// Salmon et al. (2011). Each number is a pure function of the seed and a counter, so any thread can draw
+// the numbers for item k without drawing the ones before it, and the results don't depend on the thread count.
+class CounterRandomize {
+    std::random_device seed;
+    size_t seed_value;
+    std::int64_t n1;
+    std::uint64_t range;
+
+    static std::array<std::uint32_t, 4> philox(std::array<std::uint32_t, 4> counter, std::array<std::uint32_t, 2> key) {
+        for (int round = 0; round < 10; ++round) {
+            const std::uint64_t product0 = std::uint64_t{0xD2511F53}*counter[0];
+            const std::uint64_t product1 = std::uint64_t{0xCD9E8D57}*counter[2];
+            counter = {static_cast<std::uint32_t>(product1 >> 32)^counter[1]^key[0], static_cast<std::uint32_t>(product1),
+                       static_cast<std::uint32_t>(product0 >> 32)^counter[3]^key[1], static_cast<std::uint32_t>(product0)};
+            key[0] += 0x9E3779B9;
+            key[1] += 0xBB67AE85;
+        }
+        return counter;
+    }
+
+public:
+    // Quiet, unlike Randomize. The programs print the seeds they choose.
+    CounterRandomize(std::int64_t n1, std::int64_t n2)
+       : seed_value(seed())
+       , n1(n1)
+       , range(static_cast<std::uint64_t>(n2-n1)+1) {}
+
+    CounterRandomize(std::int64_t n1, std::int64_t n2, size_t seed_value)
+       : seed_value(seed_value)
+       , n1(n1)
+       , range(static_cast<std::uint64_t>(n2-n1)+1) {}
+
+    // 64 random bits, the draw'th for an item.
+    std::uint64_t bits(std::uint64_t item, std::uint32_t draw) const {
+        const std::array<std::uint32_t, 4> block = philox(
+            {static_cast<std::uint32_t>(item), static_cast<std::uint32_t>(item >> 32), draw, 0},
+            {static_cast<std::uint32_t>(seed_value), static_cast<std::uint32_t>(static_cast<std::uint64_t>(seed_value) >> 32)});
+        return (static_cast<std::uint64_t>(block[0]) << 32)|block[1];
+    }
+
+    // The draw'th number in [n1, n2] for an item.
+    std::int64_t get(std::uint64_t item, std::uint32_t draw) const {
+        return n1+static_cast<std::int64_t>(bits(item, draw)%range);    // The modulo bias is below range/2^64.
+    }
+
+    // The draw'th number in [0, 1) for an item, ignoring n1 and n2.
+    double uniform(std::uint64_t item, std::uint32_t draw) const {
+        return static_cast<double>(bits(item, draw) >> 11)*0x1.0p-53;
+    }
+};    // class CounterRandomize
@@ -0,0 +1,251 @@
+// render.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "parallel.hh"
+#include "particles.hh"
+#include "png.hh"
+#include "trace.hh"
+
+// Frames rendered with --render=TARGET without a window or a GPU, for runs on headless nodes. The particles
+// are drawn as in graphics.hh and draw_particles(): discs of their diameter in pixels, in their colors,
+// alpha blended in order over black, with the origin at the center of the image, y up and z ignored.
+//
+// The target is either a printf pattern for a numbered PNG per frame, such as "frames/%05d.png", or "|" and a
+// command that reads raw 8-bit RGB frames from its standard input, such as
+//   "|ffmpeg -f rawvideo -pix_fmt rgb24 -s 1920x1080 -r 60 -i - gravity.mp4"
+//
+// Frames are rasterized by the workers, in bands of rows, then encoded and written by a thread of their own
+// while the simulation goes on. The simulation only waits if the thread falls QUEUE frames behind.
+namespace render {
+
+constexpr size_t QUEUE = 4;
+
+struct Image {
+    size_t frame{0};    // Numbered from 0, for the PNG pattern.
+    std::vector<uint8_t> rgb;    // From the top row down.
+};
+
+// Draws particles into rgb, width*height pixels of three bytes. canvas holds the blended colors.
+template <glm::length_t D, typename Precision>
+inline void rasterize(const BasicParticles<D, Precision>& particles, unsigned width, unsigned height, std::vector<float>& canvas, std::vector<uint8_t>& rgb) {
+    trace::Scope scope("rasterize");
+    canvas.resize(3*static_cast<size_t>(width)*height);
+    rgb.resize(canvas.size());
+    const double x0 = width/2.0, y0 = height/2.0;
+    parallel::for_blocks(height, [&](size_t begin, size_t end, size_t) {
+        std::fill(canvas.begin()+3*begin*width, canvas.begin()+3*end*width, 0.0F);
+        // Rows counted up from the bottom, as in OpenGL.
+        const double bottom = static_cast<double>(height-end), top = static_cast<double>(height-begin)-1.0;
+        for (const auto& p : particles) {
+            const double cx = static_cast<double>(p.position[0])+x0, cy = static_cast<double>(p.position[1])+y0;
+            if (!std::isfinite(cx) || !std::isfinite(cy))
+                continue;
+            // A pixel is covered if its center is inside the disc. Points smaller than a pixel cover the one
+            // they're in, as a point of size 1 does in OpenGL.
+            const double radius = static_cast<double>(p.diameter)/2.0;
+            const bool small = radius <= 0.5;
+            const double x_lo = std::max(0.0, small ? std::floor(cx) : std::ceil(cx-radius-0.5));
+            const double x_hi = std::min(width-1.0, small ? std::floor(cx) : std::floor(cx+radius-0.5));
+            const double y_lo = std::max(bottom, small ? std::floor(cy) : std::ceil(cy-radius-0.5));
+            const double y_hi = std::min(top, small ? std::floor(cy) : std::floor(cy+radius-0.5));
+            if (x_lo > x_hi || y_lo > y_hi)
+                continue;
+            const float alpha = p.color[3];
+            for (size_t y = static_cast<size_t>(y_lo); y <= static_cast<size_t>(y_hi); ++y) {
+                const double dy = y+0.5-cy;
+                float* line = canvas.data()+3*(height-1-y)*width;
+                for (size_t x = static_cast<size_t>(x_lo); x <= static_cast<size_t>(x_hi); ++x) {
+                    const double dx = x+0.5-cx;
+                    if (!small && dx*dx+dy*dy > radius*radius)
+                        continue;
+                    float* pixel = line+3*x;
+                    for (int c = 0; c < 3; ++c)
+                        pixel[c] = p.color[c]*alpha+pixel[c]*(1.0F-alpha);
+                }
+            }
+        }
+        for (size_t i = 3*begin*width; i < 3*end*width; ++i)
+            rgb[i] = static_cast<uint8_t>(std::lround(std::clamp(canvas[i], 0.0F, 1.0F)*255.0F));
+    });
+}
+
+// The path of the frame'th PNG of pattern, which must have one %d conversion, such as %05d.
+inline std::string frame_path(const std::string& pattern, size_t frame) {
+    const size_t percent = pattern.find('%');
+    const size_t conversion = pattern.find_first_not_of("0123456789", percent+1);
+    if (percent == std::string::npos || conversion == std::string::npos || pattern[conversion] != 'd' || pattern.find('%', percent+1) != std::string::npos)
+        throw std::runtime_error("--render needs a pattern with one %d, such as frames/%05d.png, or |command: "+pattern);
+    const std::string width = pattern.substr(percent+1, conversion-percent-1);
+    std::string number = std::to_string(frame);
+    const size_t digits = width.empty() ? 0 : std::stoul(width);
+    if (number.size() < digits)
+        number.insert(0, digits-number.size(), width[0] == '0' ? '0' : ' ');
+    return pattern.substr(0, percent)+number+pattern.substr(conversion+1);
+}
+
+class Renderer {
+    std::string target;
+    unsigned width;
+    unsigned height;
+    FILE* pipe{nullptr};
+    std::vector<float> canvas;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Image> queue;    // Rasterized, for the thread to write.
+    std::vector<Image> spare;    // Written, to be reused.
+    bool stopping{false};
+    std::exception_ptr failure;
+    std::thread thread;
+    std::vector<uint8_t> encoded, scratch;    // Only for the thread.
+
+    inline void run();
+    inline void write(const Image& image);
+
+public:
+    size_t frames{0};
+    uint64_t bytes{0};    // Written by the thread, so only read it after stop().
+    double waited{0.0};    // Seconds that render() waited for the thread.
+
+    // Starts the command, or checks the pattern. Doesn't create any directories in the pattern.
+    inline Renderer(const std::string& target, unsigned width, unsigned height);
+    inline ~Renderer();
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // Rasterizes the next frame and hands it to the thread. Rethrows anything the thread failed with.
+    template <glm::length_t D, typename Precision>
+    inline void render(const BasicParticles<D, Precision>& particles);
+
+    // Writes the frames still queued, stops the thread, and waits for the command to exit.
+    inline void stop();
+};
+
+inline Renderer::Renderer(const std::string& target, unsigned width, unsigned height) : target(target), width(width), height(height) {
+    if (width == 0 || height == 0)
+        throw std::runtime_error("--render needs a width and height");
+    if (!target.empty() && target[0] == '|') {
+        std::signal(SIGPIPE, SIG_IGN);    // A command that exits early fails the write instead.
+        pipe = popen(target.c_str()+1, "w");
+        if (!pipe)
+            throw std::runtime_error("can't run "+target.substr(1));
+    } else {
+        frame_path(target, 0);
+    }
+    thread = std::thread([this]() { run(); });
+}
+
+inline Renderer::~Renderer() {
+    try {
+        stop();
+    } catch (...) {
+    }
+}
+
+template <glm::length_t D, typename Precision>
+inline void Renderer::render(const BasicParticles<D, Precision>& particles) {
+    trace::Scope scope("render");
+    Image image;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto start = std::chrono::steady_clock::now();
+        changed.wait(lock, [this]() { return queue.size() < QUEUE || failure; });
+        waited += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        if (failure)
+            std::rethrow_exception(failure);
+        if (!spare.empty()) {
+            image = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    image.frame = frames++;
+    rasterize(particles, width, height, canvas, image.rgb);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(image));
+    }
+    changed.notify_all();
+}
+
+inline void Renderer::run() {
+    for (;;) {
+        Image image;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return !queue.empty() || stopping; });
+            if (queue.empty())
+                return;
+            image = std::move(queue.front());
+            queue.pop_front();
+        }
+        try {
+            write(image);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            failure = std::current_exception();
+            queue.clear();
+            changed.notify_all();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(image));
+        }
+        changed.notify_all();
+    }
+}
+
+inline void Renderer::write(const Image& image) {
+    trace::Scope scope("encode");
+    if (pipe) {
+        if (std::fwrite(image.rgb.data(), 1, image.rgb.size(), pipe) != image.rgb.size())
+            throw std::runtime_error("can't write frame "+std::to_string(image.frame)+" to "+target.substr(1));
+        bytes += image.rgb.size();
+        return;
+    }
+    png::encode(image.rgb.data(), width, height, encoded, scratch);
+    const std::string path = frame_path(target, image.frame);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+    if (!file)
+        throw std::runtime_error("can't write "+path);
+    bytes += encoded.size();
+}
+
+inline void Renderer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+            return;
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+    if (pipe && pclose(pipe) != 0 && !failure)
+        failure = std::make_exception_ptr(std::runtime_error(target.substr(1)+" failed"));
+    pipe = nullptr;
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+}    // namespace render
@@ -0,0 +1,254 @@
+// shared.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+#include "parallel.hh"
+#include "particles.hh"
+#include "trace.hh"
+
+// The particles published in POSIX shared memory, so that other processes, such as a viewer, an analysis tool
+// or a recorder, can read them from a running simulation without copies through a socket. See gravity-watch.
+//
+// The segment is a Header followed by two buffers of Records. The simulation writes each frame into the
+// buffer that doesn't hold the latest frame, then makes it the latest. Each buffer has a sequence number, a
+// seqlock, which is odd while the buffer is written. A reader reads the latest buffer in place between two
+// loads of its sequence number, and discards what it read if the number changed. So the simulation never
+// waits for a reader, and a reader only retries when a whole frame passes while it reads.
+//
+// Records are always float, with z = 0 in 2-D, so a reader needn't know the simulation's precision.
+namespace shared {
+
+constexpr uint32_t MAGIC = 0x47524156;    // "GRAV"
+constexpr uint32_t VERSION = 1;
+constexpr size_t HEADER_BYTES = 256;    // The records start here.
+
+struct Record {
+    float position[3];
+    float velocity[3];
+    float diameter;
+    float color[4];
+};
+
+struct Buffer {
+    std::atomic<uint64_t> sequence;    // Odd while the buffer is written.
+    uint64_t frame;
+    double time;    // Simulated seconds.
+    uint64_t count;
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dimensions;
+    std::atomic<uint32_t> closed;    // Set when the simulation exits.
+    std::atomic<uint64_t> capacity;    // Records per buffer.
+    std::atomic<uint64_t> latest;    // The buffer with the latest frame.
+    std::atomic<uint64_t> frames;    // Published so far.
+    Buffer buffers[2];
+};
+
+static_assert(sizeof(Header) <= HEADER_BYTES);
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the seqlock needs address-free atomics");
+
+inline size_t segment_bytes(uint64_t capacity) {
+    return HEADER_BYTES+2*capacity*sizeof(Record);
+}
+
+inline Record* records(void* segment, uint64_t capacity, uint64_t buffer) {
+    return reinterpret_cast<Record*>(static_cast<char*>(segment)+HEADER_BYTES)+buffer*capacity;
+}
+
+// Converts the particles to records, on the worker threads.
+template <glm::length_t D, typename Precision>
+inline void copy_records(const BasicParticles<D, Precision>& particles, Record* out) {
+    parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            const auto& p = particles[i];
+            Record& r = out[i];
+            for (glm::length_t k = 0; k < 3; ++k) {
+                r.position[k] = k < D ? static_cast<float>(p.position[k]) : 0.0F;
+                r.velocity[k] = k < D ? static_cast<float>(p.velocity[k]) : 0.0F;
+            }
+            r.diameter = static_cast<float>(p.diameter);
+            for (glm::length_t k = 0; k < 4; ++k)
+                r.color[k] = p.color[k];
+        }
+    });
+}
+
+inline std::runtime_error error(const std::string& what, const std::string& name) {
+    return std::runtime_error(what+" "+name+": "+std::strerror(errno));
+}
+
+// Creates the segment, such as "/gravity", and replaces any left by an earlier run. The segment is removed
+// when the Publisher is destroyed. Readers that have it mapped keep their mapping, and see it closed.
+class Publisher {
+    std::string name;
+    int fd = -1;
+    void* segment = MAP_FAILED;
+    size_t bytes = 0;
+
+    inline Header& header() const { return *static_cast<Header*>(segment); }
+
+    // Maps a larger segment. Both buffers' sequences are made odd meanwhile, so a reader that was reading either one
+    // retries, and the buffer that isn't the latest stays odd until it's written.
+    inline void grow(uint64_t capacity) {
+        if (segment != MAP_FAILED) {
+            for (Buffer& buffer : header().buffers)
+                buffer.sequence.fetch_or(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            munmap(segment, bytes);
+        }
+        bytes = segment_bytes(capacity);
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+            throw error("can't resize", name);
+        segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED)
+            throw error("can't map", name);
+        header().capacity.store(capacity, std::memory_order_release);
+    }
+
+public:
+    inline Publisher(const std::string& name, glm::length_t dimensions) : name(name) {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            throw error("can't create", name);
+        grow(0);
+        Header& h = header();
+        h.magic = MAGIC;
+        h.version = VERSION;
+        h.dimensions = dimensions;
+    }
+
+    inline ~Publisher() {
+        if (segment != MAP_FAILED) {
+            header().closed.store(1, std::memory_order_release);
+            munmap(segment, bytes);
+        }
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    Publisher(const Publisher&) = delete;
+    Publisher& operator=(const Publisher&) = delete;
+
+    template <glm::length_t D, typename Precision>
+    inline void publish(const BasicParticles<D, Precision>& particles, uint64_t frame, double time) {
+        trace::Scope scope("publish");
+        if (particles.size() > header().capacity.load(std::memory_order_relaxed))
+            grow(particles.size()+particles.size()/2);
+        Header& h = header();
+        const uint64_t b = 1-h.latest.load(std::memory_order_relaxed);
+        Buffer& buffer = h.buffers[b];
+        const uint64_t sequence = buffer.sequence.load(std::memory_order_relaxed) | 1;
+        buffer.sequence.store(sequence, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        copy_records(particles, records(segment, h.capacity.load(std::memory_order_relaxed), b));
+        buffer.frame = frame;
+        buffer.time = time;
+        buffer.count = particles.size();
+        buffer.sequence.store(sequence+1, std::memory_order_release);
+        h.latest.store(b, std::memory_order_release);
+        h.frames.fetch_add(1, std::memory_order_release);
+    }
+};
+
+// A frame of records with its number and time, such as one decoded from a stream or a trajectory.
+struct Frame {
+    uint64_t frame{0};
+    double time{0.0};
+    std::vector<Record> records;
+};
+
+// Maps a Publisher's segment read-only.
+class Reader {
+    std::string name;
+    int fd = -1;
+    const void* segment = MAP_FAILED;
+    size_t bytes = 0;
+
+    inline const Header& header() const { return *static_cast<const Header*>(segment); }
+
+    inline void map() {
+        if (segment != MAP_FAILED)
+            munmap(const_cast<void*>(segment), bytes);
+        struct stat status;
+        if (fstat(fd, &status) != 0)
+            throw error("can't stat", name);
+        bytes = static_cast<size_t>(status.st_size);
+        if (bytes < HEADER_BYTES)
+            throw std::runtime_error(name+" isn't a particle segment");
+        segment = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED)
+            throw error("can't map", name);
+    }
+
+public:
+    inline explicit Reader(const std::string& name) : name(name) {
+        fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw error("can't open", name);
+        map();
+        if (header().magic != MAGIC || header().version != VERSION)
+            throw std::runtime_error(name+" isn't a particle segment of version "+std::to_string(VERSION));
+    }
+
+    inline ~Reader() {
+        if (segment != MAP_FAILED)
+            munmap(const_cast<void*>(segment), bytes);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    inline glm::length_t dimensions() const { return header().dimensions; }
+    inline bool closed() const { return header().closed.load(std::memory_order_acquire) != 0; }
+    inline uint64_t frames() const { return header().frames.load(std::memory_order_acquire); }
+
+    // Calls f(records, count, frame, time) on the latest frame in place, without copying it, and returns
+    // whether the frame stayed whole while f read it. If not, f should discard what it read, and may try again.
+    // Returns false without calling f if there's no frame yet.
+    template <typename F>
+    inline bool read(F&& f) {
+        const Header& h = header();
+        if (h.frames.load(std::memory_order_acquire) == 0)
+            return false;
+        const Buffer& buffer = h.buffers[h.latest.load(std::memory_order_acquire)];
+        const uint64_t sequence = buffer.sequence.load(std::memory_order_acquire);
+        if (sequence%2 != 0)
+            return false;
+        const uint64_t capacity = h.capacity.load(std::memory_order_acquire);
+        if (segment_bytes(capacity) > bytes) {
+            map();    // The segment grew. The header is where it was, but the old mapping is gone.
+            return false;
+        }
+        const uint64_t count = std::min(buffer.count, capacity);
+        f(records(const_cast<void*>(segment), capacity, &buffer-h.buffers), static_cast<size_t>(count), buffer.frame, buffer.time);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return buffer.sequence.load(std::memory_order_relaxed) == sequence;
+    }
+};
+
+}    // namespace shared
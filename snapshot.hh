@@ -0,0 +1,103 @@
+// snapshot.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "csv_parser/csv_parser.h"
+
+#include "particles.hh"
+#include "utility.hh"
+
+// Particles saved to and loaded from .csv files, with one column per axis of position and velocity and a
+// diameter column.
+
+inline constexpr char AXES[] = "xyz";    // The first letter of the position and velocity .csv headings.
+
+// 3-D if the .csv has a z column, otherwise 2-D.
+inline glm::length_t csv_dimensions(const std::string& csv_filename) {
+    std::ifstream ifile(csv_filename, std::ios::binary);
+    std::string headings;
+    std::getline(ifile, headings);
+    return headings.find("zposition") != std::string::npos ? 3 : 2;
+}
+
+template <glm::length_t D, typename Precision>
+inline BasicParticles<D, Precision> load_particles_from_csv(const std::string& csv_filename) {
+    BasicParticles<D, Precision> particles;
+
+    Csv::Parser csv;
+    std::vector<std::vector<Csv::CellReference>> cells;
+    std::ifstream ifile(csv_filename, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(ifile)), (std::istreambuf_iterator<char>()));
+    csv.parseTo(data, cells);
+
+    if (cells.size() > 0) {
+        std::vector<std::string> headings;
+        size_t cols = cells.size();
+        size_t rows = cells[0].size();
+        for (std::size_t col = 0; col < cols; ++col) {
+            if (cells[col].size() != rows)
+                throw std::runtime_error(".csv column #"+std::to_string(col+1)+" unexpected size");
+            const auto& cell = cells[col][0];
+            if (cell.getType() != Csv::CellType::String)
+                throw std::runtime_error("unexpected type for string heading column #"+std::to_string(col+1));
+            std::optional<std::string> s = cell.getCleanString().value();
+            headings.push_back(utility::strip(s.value_or("")));
+        }
+        size_t next_id = 0;
+        for (std::size_t row = 1; row < rows; ++row) {
+            BasicParticle<D, Precision> p;
+            p.id = next_id++;
+            for (std::size_t col = 0; col < cols; ++col) {
+                const auto& cell = cells[col][row];
+                if (cell.getType() != Csv::CellType::Double)
+                    throw std::runtime_error("unexpected type for number in column #"+std::to_string(col+1)+" row #"+std::to_string(row+1));
+                double d = cell.getDouble().value();
+                const std::string& heading = headings[col];
+                const size_t axis = heading.empty() ? std::string::npos : std::string(AXES).find(heading[0]);
+                if (axis < D && heading.substr(1) == "position")
+                    p.position[axis] = d;
+                else if (axis < D && heading.substr(1) == "velocity")
+                    p.velocity[axis] = d;
+                else if (heading == "diameter")
+                    p.diameter = d;
+                else
+                    throw std::runtime_error("unexpected name for .csv col #"+std::to_string(col+1)+": "+heading);
+            }
+            particles.push_back(std::move(p));
+        }
+    }
+
+    return particles;
+}
+
+// Writes the same columns load_particles_from_csv() reads, with enough digits to reload every float exactly.
+template <glm::length_t D, typename Precision>
+inline void save_particles_to_csv(const BasicParticles<D, Precision>& particles, const std::string& csv_filename) {
+    std::ofstream ofile(csv_filename, std::ios::binary);
+    if (!ofile)
+        throw std::runtime_error("can't write "+csv_filename);
+    ofile << std::setprecision(std::numeric_limits<typename Precision::position_type>::max_digits10);
+    for (glm::length_t k = 0; k < D; ++k)
+        ofile << AXES[k] << "position,";
+    for (glm::length_t k = 0; k < D; ++k)
+        ofile << AXES[k] << "velocity,";
+    ofile << "diameter\n";
+    for (const auto& p : particles) {
+        for (glm::length_t k = 0; k < D; ++k)
+            ofile << p.position[k] << ',';
+        for (glm::length_t k = 0; k < D; ++k)
+            ofile << p.velocity[k] << ',';
+        ofile << p.diameter << '\n';
+    }
+}
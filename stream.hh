@@ -0,0 +1,406 @@
+// stream.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+#include "codec.hh"
+#include "particles.hh"
+#include "shared.hh"
+#include "trace.hh"
+#include "utility.hh"
+
+// Frames streamed from the simulation to viewers over a Unix domain socket, with --stream=PATH.
+//
+// A client connects and sends one line, such as "rate=30 fields=position,diameter bits=16", or with
+// "tolerance=0.01 entropy=1" in place of the bits. The server then sends it at most rate frames per second of
+// the fields it chose, each quantized as it asked and delta encoded against the last frames it sent that
+// client. See codec.hh.
+//
+// The simulation only hands the server its latest frame, and a thread of the server's own does the rest, so a
+// slow viewer can never stall the simulation. Each client has a queue of at most QUEUE_FRAMES frames that
+// haven't been encoded yet. When a client can't keep up, the oldest frames in its queue are dropped. Frames
+// are encoded only as they're sent, so a dropped frame never breaks the chain of deltas. Each client's socket
+// buffer is sized to about one frame, so a backlog waits in the queue, where it can be dropped, rather than in
+// the kernel.
+namespace stream {
+
+constexpr size_t QUEUE_FRAMES = 4;    // Frames waiting for each client before the oldest are dropped.
+constexpr double RATE = 30.0;    // Frames per second when the client doesn't say.
+constexpr double MIN_RATE = 0.01;    // The slowest a client can ask for, so its interval fits the clock.
+constexpr double MAX_RATE = 1000.0;
+
+// A frame the simulation published, shared by every client's queue.
+struct Snapshot {
+    uint64_t frame{0};
+    double time{0.0};
+    unsigned dimensions{0};
+    std::vector<shared::Record> records;
+};
+
+struct Subscription {
+    double rate{RATE};
+    codec::Settings settings;
+};
+
+// The first line a client sends: the rate, from MIN_RATE to MAX_RATE, and any of the settings of
+// codec::parse_settings().
+inline Subscription parse_subscription(const std::string& line) {
+    Subscription ret;
+    ret.settings = codec::parse_settings(line, [&ret](const std::string& name, const std::string& value) {
+        if (name != "rate")
+            return false;
+        ret.rate = std::stod(value);
+        return true;
+    });
+    if (!(ret.rate >= MIN_RATE && ret.rate <= MAX_RATE))
+        throw std::runtime_error("bad subscription: "+line);
+    return ret;
+}
+
+inline sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un ret{};
+    ret.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(ret.sun_path))
+        throw std::runtime_error("socket path too long: "+path);
+    std::strncpy(ret.sun_path, path.c_str(), sizeof(ret.sun_path)-1);
+    return ret;
+}
+
+inline void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Totals over every client since the server started.
+struct Stats {
+    size_t clients{0};
+    size_t sent{0};
+    size_t key_frames{0};
+    size_t dropped{0};
+    uint64_t bytes{0};
+};
+
+class Server {
+    struct Client {
+        int fd{-1};
+        std::string request;    // Until the subscription line is complete.
+        bool subscribed{false};
+        Subscription subscription;
+        std::optional<codec::Encoder> encoder;
+        std::deque<std::shared_ptr<const Snapshot>> queue;
+        std::vector<uint8_t> output;
+        size_t written{0};
+        std::chrono::steady_clock::time_point next_frame;
+    };
+
+    std::string path;
+    int listener{-1};
+    int wake[2]{-1, -1};    // A pipe that publish() writes to, to wake the thread.
+    std::mutex mutex;
+    std::shared_ptr<const Snapshot> latest;
+    std::atomic<size_t> client_count{0};
+    std::atomic<bool> stopping{false};
+    Stats stats;    // Only the thread writes it until it's joined.
+    std::thread thread;
+
+    inline void run();
+    inline void take(std::vector<Client>& clients, const std::shared_ptr<const Snapshot>& snapshot);
+    inline bool receive(Client& client);
+    inline bool send(Client& client);
+
+public:
+    // Listens on a Unix domain socket at path, replacing any left by an earlier run.
+    inline explicit Server(const std::string& path);
+    inline ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Hands the server the latest frame. Copies the particles if anyone is connected, otherwise does nothing.
+    // Never waits for a client.
+    template <glm::length_t D, typename Precision>
+    inline void publish(const BasicParticles<D, Precision>& particles, uint64_t frame, double time);
+
+    // The totals, once the server has stopped. See stop().
+    inline const Stats& totals() const { return stats; }
+
+    // Disconnects every client and stops the thread.
+    inline void stop();
+};
+
+inline Server::Server(const std::string& path) : path(path) {
+    const sockaddr_un address = socket_address(path);
+    unlink(path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw shared::error("can't create socket", path);
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        close(listener);
+        throw shared::error("can't listen on", path);
+    }
+    set_nonblocking(listener);
+    if (pipe(wake) != 0) {
+        close(listener);
+        throw shared::error("can't create pipe for", path);
+    }
+    set_nonblocking(wake[0]);
+    set_nonblocking(wake[1]);
+    thread = std::thread([this]() { run(); });
+}
+
+inline Server::~Server() {
+    stop();
+    close(listener);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(path.c_str());
+}
+
+inline void Server::stop() {
+    if (stopping.exchange(true))
+        return;
+    const char byte = 0;
+    (void)!write(wake[1], &byte, 1);
+    thread.join();
+}
+
+template <glm::length_t D, typename Precision>
+inline void Server::publish(const BasicParticles<D, Precision>& particles, uint64_t frame, double time) {
+    if (client_count.load(std::memory_order_relaxed) == 0)
+        return;
+    trace::Scope scope("stream");
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->frame = frame;
+    snapshot->time = time;
+    snapshot->dimensions = D;
+    snapshot->records.resize(particles.size());
+    shared::copy_records(particles, snapshot->records.data());
+    {
+        std::lock_guard lock(mutex);
+        latest = std::move(snapshot);
+    }
+    // If the pipe is full, the thread is already due to wake.
+    const char byte = 0;
+    (void)!write(wake[1], &byte, 1);
+}
+
+// Queues the snapshot for each subscribed client that is due a frame, dropping its oldest if it's full.
+inline void Server::take(std::vector<Client>& clients, const std::shared_ptr<const Snapshot>& snapshot) {
+    const auto now = std::chrono::steady_clock::now();
+    for (Client& client : clients) {
+        if (!client.subscribed || now < client.next_frame)
+            continue;
+        client.next_frame = now+std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0/client.subscription.rate));
+        client.queue.push_back(snapshot);
+        if (client.queue.size() > QUEUE_FRAMES) {
+            client.queue.pop_front();
+            ++stats.dropped;
+        }
+    }
+}
+
+// Reads the subscription. Returns false if the client has gone or sent a bad subscription.
+inline bool Server::receive(Client& client) {
+    char buffer[256];
+    for (;;) {
+        const ssize_t got = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (got == 0)
+            return false;
+        if (got < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (client.subscribed)
+            continue;    // Anything after the subscription is ignored.
+        client.request.append(buffer, got);
+        const size_t newline = client.request.find('\n');
+        if (newline == std::string::npos) {
+            if (client.request.size() > 1024)
+                return false;
+            continue;
+        }
+        try {
+            client.subscription = parse_subscription(utility::strip(client.request.substr(0, newline)));
+        } catch (const std::runtime_error& err) {
+            std::cout << "stream client: " << err.what() << std::endl;
+            return false;
+        }
+        client.encoder.emplace(client.subscription.settings);
+        client.subscribed = true;
+        client.next_frame = std::chrono::steady_clock::now();
+    }
+}
+
+// Sends as much as the socket takes without waiting, encoding queued frames as the output empties. Returns
+// false if the client has gone or its frames can't be encoded with its settings.
+inline bool Server::send(Client& client) {
+    for (;;) {
+        if (client.written == client.output.size()) {
+            if (client.queue.empty())
+                return true;
+            const std::shared_ptr<const Snapshot> snapshot = std::move(client.queue.front());
+            client.queue.pop_front();
+            client.output.clear();
+            client.written = 0;
+            try {
+                stats.key_frames += client.encoder->encode(snapshot->records, snapshot->dimensions, snapshot->frame, snapshot->time, client.output);
+            } catch (const std::exception& err) {
+                // Such as a tolerance too fine for the values. Only this client is dropped.
+                std::cout << "stream client: " << err.what() << std::endl;
+                return false;
+            }
+            ++stats.sent;
+            // Linux doubles the size it's given, and has a minimum.
+            const int buffer = static_cast<int>(std::min<size_t>(client.output.size(), std::numeric_limits<int>::max()/2));
+            setsockopt(client.fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        }
+        const ssize_t sent = ::send(client.fd, client.output.data()+client.written, client.output.size()-client.written, MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client.written += sent;
+        stats.bytes += sent;
+    }
+}
+
+inline void Server::run() {
+    std::vector<Client> clients;
+    std::shared_ptr<const Snapshot> taken;
+    std::vector<pollfd> fds;
+    while (!stopping.load()) {
+        fds.clear();
+        fds.push_back({wake[0], POLLIN, 0});
+        fds.push_back({listener, POLLIN, 0});
+        for (const Client& client : clients)
+            fds.push_back({client.fd, static_cast<short>(POLLIN | (client.written < client.output.size() || !client.queue.empty() ? POLLOUT : 0)), 0});
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            break;
+
+        char drain[64];
+        while (read(wake[0], drain, sizeof(drain)) > 0) {}
+        std::shared_ptr<const Snapshot> snapshot;
+        {
+            std::lock_guard lock(mutex);
+            snapshot = latest;
+        }
+        if (snapshot && snapshot != taken) {
+            taken = snapshot;
+            take(clients, snapshot);
+        }
+
+        for (int fd = accept(listener, nullptr, nullptr); fd >= 0; fd = accept(listener, nullptr, nullptr)) {
+            set_nonblocking(fd);
+            clients.emplace_back();
+            clients.back().fd = fd;
+            ++stats.clients;
+        }
+
+        // The clients that were polled are the first fds.size()-2, and any just accepted follow them.
+        for (size_t c = 0; c < clients.size(); ) {
+            Client& client = clients[c];
+            const bool polled = c+2 < fds.size();
+            const short events = polled ? fds[c+2].revents : 0;
+            bool alive = (events & (POLLERR | POLLNVAL)) == 0;
+            if (alive && (events & (POLLIN | POLLHUP)))
+                alive = receive(client);
+            if (alive)
+                alive = send(client);
+            if (alive) {
+                ++c;
+            } else {
+                close(client.fd);
+                clients.erase(clients.begin()+c);
+            }
+        }
+        client_count.store(clients.size(), std::memory_order_relaxed);
+    }
+    for (Client& client : clients)
+        close(client.fd);
+    client_count.store(0);
+}
+
+// Receives a stream from a Server, such as the simulation's --stream. Blocks.
+class Client {
+    int fd{-1};
+    codec::Decoder decoder;
+    std::vector<uint8_t> input;
+
+    // Reads until input holds at least size bytes. Returns false if the server closed the connection.
+    inline bool fill(size_t size) {
+        while (input.size() < size) {
+            uint8_t buffer[65536];
+            const ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+            if (got == 0)
+                return false;
+            if (got < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string("stream receive: ")+std::strerror(errno));
+            }
+            input.insert(input.end(), buffer, buffer+got);
+        }
+        return true;
+    }
+
+public:
+    size_t bytes{0};    // Received so far.
+
+    // Connects and subscribes with a line such as "rate=30 fields=position bits=12". See parse_subscription().
+    inline Client(const std::string& path, const std::string& subscription) {
+        const sockaddr_un address = socket_address(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw shared::error("can't create socket for", path);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            close(fd);
+            throw shared::error("can't connect to", path);
+        }
+        const std::string line = subscription+"\n";
+        if (::send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+            close(fd);
+            throw shared::error("can't subscribe to", path);
+        }
+    }
+
+    inline ~Client() { close(fd); }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // The next frame. Returns false when the server has gone.
+    inline bool receive(shared::Frame& frame) {
+        if (!fill(codec::PREFIX_BYTES))
+            return false;
+        uint32_t length = 0;
+        std::memcpy(&length, input.data()+offsetof(codec::Header, bytes), sizeof(length));
+        const size_t size = codec::PREFIX_BYTES+length;
+        if (!fill(size))
+            return false;
+        decoder.decode(input.data(), size, frame);
+        input.erase(input.begin(), input.begin()+size);
+        bytes += size;
+        return true;
+    }
+};
+
+}    // namespace stream
@@ -0,0 +1,134 @@
+// trace.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Always-compiled timing of the phases of each frame, exported as Chrome trace-event JSON. Open the file in
+// chrome://tracing or https://ui.perfetto.dev to see each phase, and each worker block, on a timeline.
+//
+// A trace::Scope times itself from construction to destruction. When tracing is disabled, which is the
+// default, that's one relaxed atomic load. When it's enabled, each thread appends to a ring buffer of its
+// own, with no locking, and keeps the last RING_SIZE events. Worker threads come and go with every
+// std::async() call, so a thread returns its buffer to a pool when it exits, and the next new thread reuses
+// it. Each buffer is one lane of the timeline, so the lanes are the workers, not the operating system threads.
+namespace trace {
+
+constexpr size_t RING_SIZE = 1 << 16;    // Events kept per lane.
+
+inline std::atomic<bool> enabled{false};
+
+struct Event {
+    const char* name;    // A string literal.
+    int64_t begin;    // Nanoseconds since origin().
+    int64_t end;
+};
+
+struct Buffer {
+    size_t lane;
+    std::vector<Event> events;
+    std::atomic<size_t> head{0};    // The number of events ever written. The newest is at (head-1)%RING_SIZE.
+
+    inline explicit Buffer(size_t lane) : lane(lane), events(RING_SIZE) {}
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::vector<Buffer*> idle;    // Buffers of threads that have exited.
+};
+
+inline Registry& registry() {
+    static Registry ret;
+    return ret;
+}
+
+inline std::chrono::steady_clock::time_point origin() {
+    static const std::chrono::steady_clock::time_point ret = std::chrono::steady_clock::now();
+    return ret;
+}
+
+inline int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-origin()).count();
+}
+
+// The calling thread's buffer. Taken from the pool on first use, and returned when the thread exits.
+inline Buffer& local_buffer() {
+    struct Lease {
+        Buffer* buffer = nullptr;
+        ~Lease() {
+            if (buffer == nullptr) return;
+            std::lock_guard lock(registry().mutex);
+            registry().idle.push_back(buffer);
+        }
+    };
+    thread_local Lease lease;
+    if (lease.buffer == nullptr) {
+        Registry& r = registry();
+        std::lock_guard lock(r.mutex);
+        if (r.idle.empty()) {
+            r.buffers.push_back(std::make_unique<Buffer>(r.buffers.size()));
+            lease.buffer = r.buffers.back().get();
+        } else {
+            // The lowest lane, so the same worker tends to stay on the same row of the timeline.
+            auto it = std::min_element(r.idle.begin(), r.idle.end(), [](Buffer* a, Buffer* b) { return a->lane < b->lane; });
+            lease.buffer = *it;
+            r.idle.erase(it);
+        }
+    }
+    return *lease.buffer;
+}
+
+class Scope {
+    const char* name;
+    int64_t begin;
+
+public:
+    inline explicit Scope(const char* name) : name(name), begin(enabled.load(std::memory_order_relaxed) ? now() : -1) {}
+
+    inline ~Scope() {
+        if (begin < 0) return;
+        Buffer& buffer = local_buffer();
+        const size_t head = buffer.head.load(std::memory_order_relaxed);
+        buffer.events[head%RING_SIZE] = Event{name, begin, now()};
+        buffer.head.store(head+1, std::memory_order_release);
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+// Writes every buffered event. Call it between frames, when no worker is running.
+inline void write_chrome_json(const std::string& filename) {
+    std::ofstream ofile(filename, std::ios::binary);
+    if (!ofile)
+        throw std::runtime_error("can't write "+filename);
+    Registry& r = registry();
+    std::lock_guard lock(r.mutex);
+    ofile << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto& buffer : r.buffers) {
+        const size_t head = buffer->head.load(std::memory_order_acquire);
+        for (size_t k = head > RING_SIZE ? head-RING_SIZE : 0; k < head; ++k) {
+            const Event& e = buffer->events[k%RING_SIZE];
+            // Trace-event times are in microseconds.
+            ofile << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->lane
+                  << ",\"ts\":" << e.begin/1000 << '.' << std::to_string(1000+e.begin%1000).substr(1)
+                  << ",\"dur\":" << (e.end-e.begin)/1000 << '.' << std::to_string(1000+(e.end-e.begin)%1000).substr(1) << '}';
+            first = false;
+        }
+    }
+    ofile << "\n]}\n";
+}
+
+}    // namespace trace
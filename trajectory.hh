@@ -0,0 +1,153 @@
+// trajectory.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "codec.hh"
+#include "particles.hh"
+#include "shared.hh"
+#include "trace.hh"
+
+// Trajectories recorded with --record=PATH: the frames of a run in a file, encoded as in codec.hh, to a
+// tolerance and entropy coded by default. A snapshot is a trajectory of one frame.
+//
+// The file is a FileHeader followed by the codec's messages, one per frame. Every KEY_FRAMES frames is a key
+// frame, so a reader can start from one without decoding the whole file before it, and a damaged file loses
+// no more than that many frames.
+namespace trajectory {
+
+constexpr uint32_t MAGIC = 0x54565247;    // "GRVT"
+constexpr uint32_t VERSION = 1;
+constexpr size_t KEY_FRAMES = 100;
+constexpr char SETTINGS[] = "fields=all tolerance=0.01 entropy=1";    // See codec::parse_settings().
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+class Writer {
+    std::string path;
+    std::ofstream file;
+    uint8_t fields;
+    codec::Encoder encoder;
+    std::vector<shared::Record> records;
+    std::vector<uint8_t> message;
+
+public:
+    size_t frames{0};
+    size_t key_frames{0};
+    uint64_t bytes{0};    // Written to the file.
+    uint64_t raw{0};    // As floats, of the fields of the frames written.
+
+    // Replaces any file at path.
+    inline Writer(const std::string& path, const codec::Settings& settings)
+        : path(path), file(path, std::ios::binary | std::ios::trunc), fields(settings.fields), encoder(settings) {
+        if (!file)
+            throw std::runtime_error("can't create "+path);
+        const FileHeader header{MAGIC, VERSION};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes += sizeof(header);
+    }
+
+    inline void write(const std::vector<shared::Record>& frame_records, unsigned dimensions, uint64_t frame, double time) {
+        if (frames%KEY_FRAMES == 0)
+            encoder.reset();
+        message.clear();
+        key_frames += encoder.encode(frame_records, dimensions, frame, time, message);
+        file.write(reinterpret_cast<const char*>(message.data()), static_cast<std::streamsize>(message.size()));
+        if (!file)
+            throw std::runtime_error("can't write "+path);
+        ++frames;
+        bytes += message.size();
+        raw += frame_records.size()*codec::components(fields, dimensions).size()*sizeof(float);
+    }
+
+    template <glm::length_t D, typename Precision>
+    inline void write(const BasicParticles<D, Precision>& particles, uint64_t frame, double time) {
+        trace::Scope scope("record");
+        records.resize(particles.size());
+        shared::copy_records(particles, records.data());
+        write(records, D, frame, time);
+    }
+
+    inline void flush() { file.flush(); }
+};
+
+class Reader {
+    std::string path;
+    std::ifstream file;
+    codec::Decoder decoder;
+    std::vector<uint8_t> message;
+
+    // The next message, without decoding it. Returns false at the end of the file.
+    inline bool next(codec::Header& header) {
+        message.resize(codec::PREFIX_BYTES);
+        if (!file.read(reinterpret_cast<char*>(message.data()), codec::PREFIX_BYTES))
+            return false;
+        uint32_t length = 0;
+        std::memcpy(&length, message.data()+offsetof(codec::Header, bytes), sizeof(length));
+        message.resize(codec::PREFIX_BYTES+length);
+        if (length < sizeof(codec::Header)-codec::PREFIX_BYTES || !file.read(reinterpret_cast<char*>(message.data()+codec::PREFIX_BYTES), length))
+            throw std::runtime_error("truncated frame in "+path);
+        std::memcpy(&header, message.data(), sizeof(header));
+        if (header.magic != codec::MAGIC)
+            throw std::runtime_error("bad frame in "+path);
+        return true;
+    }
+
+public:
+    inline explicit Reader(const std::string& path) : path(path), file(path, std::ios::binary) {
+        if (!file)
+            throw std::runtime_error("can't open "+path);
+        FileHeader header{};
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || header.magic != MAGIC || header.version != VERSION)
+            throw std::runtime_error(path+" isn't a trajectory of version "+std::to_string(VERSION));
+    }
+
+    // The next frame. Returns false at the end of the file.
+    inline bool read(shared::Frame& frame) {
+        codec::Header header;
+        if (!next(header))
+            return false;
+        decoder.decode(message.data(), message.size(), frame);
+        return true;
+    }
+
+    // Moves to the first frame numbered at least frame, decoding from the key frame before it. The next read()
+    // returns it. Returns false if there's no such frame.
+    inline bool seek(uint64_t frame) {
+        file.clear();
+        file.seekg(sizeof(FileHeader));
+        std::streampos key = -1, target = -1;
+        codec::Header header;
+        for (std::streampos at = file.tellg(); next(header); at = file.tellg()) {
+            if (header.key)
+                key = at;
+            if (header.frame >= frame) {
+                target = at;
+                break;
+            }
+        }
+        if (target == std::streampos(-1) || key == std::streampos(-1))
+            return false;
+        file.clear();
+        file.seekg(key);
+        shared::Frame skipped;
+        while (file.tellg() != target)
+            read(skipped);
+        return true;
+    }
+};
+
+}    // namespace trajectory
@@ -0,0 +1,457 @@
+// tree.hh
+// Copyright (C) 2023 by Shawn Yarbrough
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "parallel.hh"
+#include "counters.hh"
+#include "particles.hh"
+#include "trace.hh"
+
+// Barnes-Hut gravity on a quadtree (2-D) or octree (3-D).
+//
+// The particles are sorted along a Morton (Z-order) curve, so every tree node owns a contiguous range of
+// the sorted order. A node far enough from a particle, compared with its size, acts on it as one body at
+// its center of mass. Otherwise the node is opened, and at a leaf the particles act on each other with the
+// same kernel as the direct sum, which also finds every pair of touching particles. O(n log n) time.
+//
+// Optionally each node also carries its quadrupole moment, Q = sum(m*(3*x*x^T-|x|^2*I)) about its center of
+// mass, which corrects for the shape of the node. That costs more per node but allows a larger theta for
+// the same accuracy. See "gravity-benchmark multipole".
+//
+// Particles move only a little each frame, so by default the tree is built once and then refit: the same
+// nodes keep the same particles, and only the bounding boxes and moments are recomputed. The nodes grow as
+// their particles drift apart, which slows the walk, so the tree is rebuilt once the total size of the
+// nodes has grown by REFIT_LIMIT, and after any collision merges. See "gravity-benchmark refit".
+
+namespace tree {
+
+constexpr float THETA = 0.5F;    // The opening angle. Smaller is more accurate and slower.
+constexpr bool QUADRUPOLE = false;
+constexpr bool REFIT = true;
+constexpr double REFIT_LIMIT = 1.25;    // Rebuild once refitting has grown the total size of the nodes by this factor.
+constexpr size_t LEAF_SIZE = 8;    // Nodes with no more particles than this aren't split.
+
+template <glm::length_t D>
+constexpr unsigned MORTON_BITS = 64/D;    // Bits per axis in a Morton key.
+
+// Interleave the low MORTON_BITS of each axis into one key, with the first axis in the lowest bit.
+template <glm::length_t D>
+inline uint64_t morton_key(const glm::vec<D, uint64_t>& cell) {
+    uint64_t key = 0;
+    for (unsigned bit = 0; bit < MORTON_BITS<D>; ++bit)
+        for (glm::length_t k = 0; k < D; ++k)
+            key |= ((cell[k] >> bit) & 1) << (bit*D+k);
+    return key;
+}
+
+// Seconds spent in each phase of the last Solver::accelerate_particles().
+struct Timings {
+    double refit{0.0};
+    double build{0.0};
+    double walk{0.0};
+    double merge{0.0};
+    bool rebuilt{false};
+};
+
+template <glm::length_t D, typename Precision>
+class Solver {
+    using Particle = BasicParticle<D, Precision>;
+    using Particles = BasicParticles<D, Precision>;
+    using Position = typename Particle::Position;
+    using position_type = typename Precision::position_type;
+    using pair_type = typename Precision::pair_type;
+    using accumulator_type = typename Precision::accumulator_type;
+    using Acceleration = glm::vec<D, accumulator_type>;
+    using Quadrupole = glm::mat<D, D, accumulator_type>;
+
+    static constexpr uint32_t child_slots = 1 << D;
+
+    struct Node {
+        uint32_t begin{0};    // The node's particles are order[begin, end).
+        uint32_t end{0};
+        uint32_t first_child{0};    // Children are stored next to each other.
+        uint32_t child_count{0};    // Zero for a leaf.
+        Position lo{0.0F};    // The bounding box of the particle centers.
+        Position hi{0.0F};
+        Position center_of_mass{0.0F};
+        accumulator_type mass{0};
+        Quadrupole quadrupole{0};
+        pair_type max_radius{0};
+        pair_type opening_distance{0};    // Closer than this, the node must be opened.
+    };
+
+    float theta;
+    bool quadrupole;
+    bool refit;
+    std::vector<uint32_t> order;    // Particle indexes sorted by Morton key.
+    std::vector<uint64_t> keys;    // Sorted the same as order.
+    std::vector<Node> nodes;
+
+    // Nodes [0, top_count) are the top levels of the tree. Below them, each subtree is built separately
+    // and its nodes are contiguous, so the subtrees can be built and updated concurrently.
+    size_t top_count{0};
+    std::vector<std::pair<size_t, size_t>> subtrees;
+
+    // The particle count and the total size of the nodes when the tree was last built. Zero forces a rebuild.
+    size_t built_count{0};
+    double built_size{0.0};
+    Timings last_timings;
+    Particles store;    // The accelerated particles, swapped with the caller's each frame.
+
+    inline void sort_particles(const Particles& particles);
+    inline void split_node(std::vector<Node>& out_nodes, size_t index, unsigned level, unsigned stop_level, std::vector<size_t>* frontier) const;
+    static inline Quadrupole point_quadrupole(accumulator_type mass, const glm::vec<D, accumulator_type>& offset);
+    inline void update_node(const Particles& particles, Node& node) const;
+    inline double update_moments(const Particles& particles);
+    inline void build(const Particles& particles);
+    inline Collisions accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t begin, size_t end, accumulator_type* potentials) const;
+
+public:
+    inline explicit Solver(float theta = THETA, bool quadrupole = QUADRUPOLE, bool refit = REFIT) : theta(theta), quadrupole(quadrupole), refit(refit) {}
+    inline size_t node_count() const { return nodes.size(); }
+    inline const Timings& timings() const { return last_timings; }
+    inline const Particles& previous() const { return store; }    // The particles before the last step.
+    // Advances particles in place. If potentials isn't null, it's resized to hold each particle's potential
+    // energy, approximated like the forces.
+    inline void accelerate_particles(Particles& particles, float delta, std::vector<accumulator_type>* potentials = nullptr);
+};    // class Solver
+
+// Sort the particle indexes along a Morton curve through the bounding cube.
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::sort_particles(const Particles& particles) {
+    Position lo{std::numeric_limits<position_type>::max()};
+    Position hi{std::numeric_limits<position_type>::lowest()};
+    for (const Particle& p : particles) {
+        lo = glm::min(lo, p.position);
+        hi = glm::max(hi, p.position);
+    }
+    double extent = 1.0;
+    for (glm::length_t k = 0; k < D; ++k)
+        extent = std::max(extent, static_cast<double>(hi[k]-lo[k]));
+    const double scale = static_cast<double>((uint64_t{1} << MORTON_BITS<D>)-1)/extent;
+
+    std::vector<std::pair<uint64_t, uint32_t>> sorted(particles.size());
+    parallel::for_blocks(particles.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            const glm::vec<D, double> u = (glm::vec<D, double>(particles[i].position)-glm::vec<D, double>(lo))*scale;
+            sorted[i] = {morton_key<D>(glm::vec<D, uint64_t>(u)), static_cast<uint32_t>(i)};
+        }
+    });
+    parallel::sort(sorted.begin(), sorted.end());
+
+    order.resize(sorted.size());
+    keys.resize(sorted.size());
+    for (size_t k = 0; k < sorted.size(); ++k) {
+        keys[k] = sorted[k].first;
+        order[k] = sorted[k].second;
+    }
+}
+
+// Split a node into one child per occupied octant (quadrant in 2-D), then split each child in turn.
+// Nodes reaching stop_level are left unsplit and added to the frontier.
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::split_node(std::vector<Node>& out_nodes, size_t index, unsigned level, unsigned stop_level, std::vector<size_t>* frontier) const {
+    const uint32_t begin = out_nodes[index].begin;
+    const uint32_t end = out_nodes[index].end;
+    if (end-begin <= LEAF_SIZE || level == MORTON_BITS<D>)
+        return;
+    if (level == stop_level) {
+        frontier->push_back(index);
+        return;
+    }
+
+    // The keys in this node share their top level*D bits, so the children are split by the next D bits.
+    const unsigned shift = (MORTON_BITS<D>-1-level)*D;
+    const uint32_t first_child = static_cast<uint32_t>(out_nodes.size());
+    uint32_t child_begin = begin;
+    for (uint32_t slot = 0; slot < child_slots && child_begin < end; ++slot) {
+        const uint32_t child_end = static_cast<uint32_t>(std::partition_point(keys.begin()+child_begin, keys.begin()+end,
+            [shift, slot](uint64_t key) { return ((key >> shift) & (child_slots-1)) <= slot; })-keys.begin());
+        if (child_end == child_begin) continue;
+        Node child;
+        child.begin = child_begin;
+        child.end = child_end;
+        out_nodes.push_back(child);
+        child_begin = child_end;
+    }
+    const uint32_t child_count = static_cast<uint32_t>(out_nodes.size())-first_child;
+    out_nodes[index].first_child = first_child;
+    out_nodes[index].child_count = child_count;
+    for (uint32_t c = first_child; c < first_child+child_count; ++c)
+        split_node(out_nodes, c, level+1, stop_level, frontier);
+}
+
+// The quadrupole moment of a point mass at an offset from the center of mass.
+template <glm::length_t D, typename Precision>
+inline auto Solver<D, Precision>::point_quadrupole(accumulator_type mass, const glm::vec<D, accumulator_type>& offset) -> Quadrupole {
+    Quadrupole q = glm::outerProduct(offset, offset)*(3*mass);
+    const accumulator_type quadrance = glm::dot(offset, offset);
+    for (glm::length_t k = 0; k < D; ++k)
+        q[k][k] -= mass*quadrance;
+    return q;
+}
+
+// Recompute a node's bounding box and moments from its particles, or from its children.
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::update_node(const Particles& particles, Node& node) const {
+    glm::vec<D, accumulator_type> weighted(0.0F);
+    node.lo = Position(std::numeric_limits<position_type>::max());
+    node.hi = Position(std::numeric_limits<position_type>::lowest());
+    node.mass = 0;
+    node.max_radius = 0;
+    if (node.child_count == 0) {
+        for (uint32_t k = node.begin; k < node.end; ++k) {
+            const Particle& p = particles[order[k]];
+            const pair_type r = p.diameter/2.0F;
+            const accumulator_type mass = glm::pi<accumulator_type>()*r*r;
+            node.mass += mass;
+            weighted += glm::vec<D, accumulator_type>(p.position)*mass;
+            node.lo = glm::min(node.lo, p.position);
+            node.hi = glm::max(node.hi, p.position);
+            node.max_radius = std::max(node.max_radius, r);
+        }
+    } else {
+        for (uint32_t c = node.first_child; c < node.first_child+node.child_count; ++c) {
+            const Node& child = nodes[c];
+            node.mass += child.mass;
+            weighted += glm::vec<D, accumulator_type>(child.center_of_mass)*child.mass;
+            node.lo = glm::min(node.lo, child.lo);
+            node.hi = glm::max(node.hi, child.hi);
+            node.max_radius = std::max(node.max_radius, child.max_radius);
+        }
+    }
+    node.center_of_mass = Position(weighted/node.mass);
+
+    // The quadrupole needs the center of mass, so it takes a second pass. A child's quadrupole is moved to
+    // the parent's center of mass by adding the quadrupole of its whole mass at its own center of mass.
+    if (quadrupole) {
+        node.quadrupole = Quadrupole(0.0F);
+        if (node.child_count == 0) {
+            for (uint32_t k = node.begin; k < node.end; ++k) {
+                const Particle& p = particles[order[k]];
+                const pair_type r = p.diameter/2.0F;
+                node.quadrupole += point_quadrupole(glm::pi<accumulator_type>()*r*r, glm::vec<D, accumulator_type>(p.position-node.center_of_mass));
+            }
+        } else {
+            for (uint32_t c = node.first_child; c < node.first_child+node.child_count; ++c) {
+                const Node& child = nodes[c];
+                node.quadrupole += child.quadrupole+point_quadrupole(child.mass, glm::vec<D, accumulator_type>(child.center_of_mass-node.center_of_mass));
+            }
+        }
+    }
+
+    // Open the node within size/theta of its center of mass, plus the offset of the center of mass from the
+    // middle of the box, which guards against a lopsided node passing for a distant one.
+    const glm::vec<D, pair_type> size(node.hi-node.lo);
+    const glm::vec<D, pair_type> offset(node.center_of_mass-(node.lo+node.hi)/static_cast<position_type>(2));
+    pair_type longest = 0;
+    for (glm::length_t k = 0; k < D; ++k)
+        longest = std::max(longest, size[k]);
+    node.opening_distance = longest/static_cast<pair_type>(theta)+glm::length(offset);
+}
+
+// Children always come after their parent, so updating in reverse order works from the leaves up.
+// Returns the total size of the nodes, the sum of the longest side of each bounding box.
+template <glm::length_t D, typename Precision>
+inline double Solver<D, Precision>::update_moments(const Particles& particles) {
+    auto longest_side = [](const Node& node) {
+        double longest = 0.0;
+        for (glm::length_t k = 0; k < D; ++k)
+            longest = std::max(longest, static_cast<double>(node.hi[k]-node.lo[k]));
+        return longest;
+    };
+    std::vector<double> sizes(parallel::thread_count(), 0.0);
+    parallel::for_blocks(subtrees.size(), [&](size_t begin, size_t end, size_t t) {
+        for (size_t s = begin; s < end; ++s) {
+            for (size_t i = subtrees[s].second; i-- > subtrees[s].first;) {
+                update_node(particles, nodes[i]);
+                sizes[t] += longest_side(nodes[i]);
+            }
+        }
+    });
+    double size = 0.0;
+    for (double s : sizes)
+        size += s;
+    for (size_t i = top_count; i-- > 0;) {
+        update_node(particles, nodes[i]);
+        size += longest_side(nodes[i]);
+    }
+    return size;
+}
+
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::build(const Particles& particles) {
+    sort_particles(particles);
+
+    // Build the top levels until there are a few subtrees per thread, then build the subtrees concurrently.
+    unsigned stop_level = 1;
+    while (stop_level < MORTON_BITS<D> && (size_t{1} << (stop_level*D)) < 4*parallel::thread_count())
+        ++stop_level;
+    nodes.assign(1, Node{});
+    nodes[0].end = static_cast<uint32_t>(particles.size());
+    std::vector<size_t> frontier;
+    split_node(nodes, 0, 0, stop_level, &frontier);
+    top_count = nodes.size();
+
+    std::vector<std::vector<Node>> parts(frontier.size());
+    parallel::for_blocks(frontier.size(), [&](size_t begin, size_t end, size_t) {
+        for (size_t f = begin; f < end; ++f) {
+            parts[f].assign(1, nodes[frontier[f]]);
+            split_node(parts[f], 0, stop_level, MORTON_BITS<D>+1, nullptr);
+        }
+    });
+
+    // Splice each subtree in after the top levels. Its root replaces the frontier node.
+    subtrees.clear();
+    for (size_t f = 0; f < frontier.size(); ++f) {
+        const uint32_t offset = static_cast<uint32_t>(nodes.size())-1;
+        for (Node& node : parts[f])
+            if (node.child_count != 0)
+                node.first_child += offset;
+        nodes[frontier[f]] = parts[f][0];
+        subtrees.emplace_back(nodes.size(), nodes.size()+parts[f].size()-1);
+        nodes.insert(nodes.end(), parts[f].begin()+1, parts[f].end());
+    }
+
+    built_count = particles.size();
+    built_size = update_moments(particles);
+}
+
+template <glm::length_t D, typename Precision>
+inline Collisions Solver<D, Precision>::accelerate_particle_block(const Particles& in_particles, Particles& out_particles, float delta, size_t begin, size_t end, accumulator_type* potentials) const {
+    Collisions collisions;
+    std::vector<uint32_t> stack;
+    for (size_t k = begin; k < end; ++k) {
+        // Walk the particles in Morton order, so that neighbouring walks visit mostly the same nodes.
+        const size_t i1 = order[k];
+        const Particle& ip1 = in_particles[i1];
+        Particle& op1 = out_particles[i1];
+        const pair_type r1 = ip1.diameter/2.0F;
+        Acceleration acceleration(0.0F);
+        accumulator_type potential = 0;
+
+        stack.assign(1, 0);
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.back()];
+            stack.pop_back();
+
+            // A node that any of its particles could be touching is always opened.
+            pair_type box_quadrance = 0;
+            for (glm::length_t axis = 0; axis < D; ++axis) {
+                const pair_type outside = static_cast<pair_type>(std::max({node.lo[axis]-ip1.position[axis], ip1.position[axis]-node.hi[axis], position_type{0}}));
+                box_quadrance += outside*outside;
+            }
+            const glm::vec<D, pair_type> distances(node.center_of_mass-ip1.position);
+            const pair_type quadrance = glm::dot(distances, distances);
+            const pair_type distance = sqrt(quadrance);
+            const pair_type reach = r1+node.max_radius;
+
+            if (box_quadrance > reach*reach && distance > node.opening_distance) {
+                // Far away. The whole node acts as one body, with the same softening as Particle::accelerate_particle().
+                const pair_type quadrance2 = std::max(quadrance, pair_type{3});
+                const pair_type gacceleration1 = static_cast<pair_type>(GRAVITY)*static_cast<pair_type>(node.mass)/quadrance2;
+                for (glm::length_t axis = 0; axis < D; ++axis)
+                    acceleration[axis] += (gacceleration1*distances[axis])/distance;
+                if (potentials != nullptr) {
+                    const pair_type mass1 = glm::pi<pair_type>()*r1*r1;
+                    potential -= static_cast<accumulator_type>(static_cast<pair_type>(GRAVITY)*static_cast<pair_type>(node.mass)*mass1/sqrt(quadrance2));
+                }
+                if (quadrupole) {
+                    // a = G*(Q*x/r^5 - 5/2*(x^T*Q*x)*x/r^7), with x from the center of mass to the particle.
+                    const glm::vec<D, pair_type> x = -distances;
+                    const glm::vec<D, pair_type> qx = glm::mat<D, D, pair_type>(node.quadrupole)*x;
+                    const pair_type inverse_quadrance = pair_type{1}/quadrance;
+                    const pair_type scale = static_cast<pair_type>(GRAVITY)*inverse_quadrance*inverse_quadrance/distance;
+                    acceleration += Acceleration(scale*(qx-(pair_type{2.5}*glm::dot(x, qx)*inverse_quadrance)*x));
+                    if (potentials != nullptr)    // The potential -G*(x^T*Q*x)/(2*r^5) that gives that acceleration.
+                        potential -= static_cast<accumulator_type>(glm::pi<pair_type>()*r1*r1*scale*pair_type{0.5}*glm::dot(x, qx));
+                }
+            } else if (node.child_count == 0) {
+                for (uint32_t k2 = node.begin; k2 < node.end; ++k2) {
+                    const size_t i2 = order[k2];
+                    if (i1 == i2) continue;
+                    if (potentials != nullptr)
+                        Particle::template accelerate_particle<true>(ip1, in_particles[i2], op1, out_particles[i2], collisions, delta, &potential);
+                    else
+                        Particle::accelerate_particle(ip1, in_particles[i2], op1, out_particles[i2], collisions, delta);
+                }
+            } else {
+                for (uint32_t c = node.first_child; c < node.first_child+node.child_count; ++c)
+                    stack.push_back(c);
+            }
+        }
+        op1.velocity += acceleration*static_cast<accumulator_type>(delta);
+        if (potentials != nullptr)
+            potentials[i1] = potential;
+    }
+    return collisions;
+}
+
+template <glm::length_t D, typename Precision>
+inline void Solver<D, Precision>::accelerate_particles(Particles& particles, float delta, std::vector<accumulator_type>* potentials) {
+    const Particles& in_particles = particles;
+    Particles& out_particles = store;
+    Particle::copy_particles(in_particles, out_particles);
+    accumulator_type* potential_data = nullptr;
+    if (potentials != nullptr) {
+        potentials->assign(in_particles.size(), 0);
+        potential_data = potentials->data();
+    }
+    if (in_particles.empty())
+        return;
+
+    // Refit the tree if it still holds the same particles, then check it hasn't degraded too far.
+    auto ts1 = std::chrono::steady_clock::now();
+    {
+        trace::Scope scope("refit");
+        last_timings.rebuilt = !refit || in_particles.size() != built_count || update_moments(in_particles) > built_size*REFIT_LIMIT;
+    }
+    auto ts2 = std::chrono::steady_clock::now();
+    if (last_timings.rebuilt) {
+        trace::Scope scope("build");
+        build(in_particles);
+    }
+    auto ts3 = std::chrono::steady_clock::now();
+
+    std::vector<Collisions> collisions(parallel::thread_count());
+    {
+        trace::Scope scope("force");
+        counters::Scope counted("force");
+        parallel::for_blocks(in_particles.size(), [&](size_t begin, size_t end, size_t t) {
+            collisions[t] = accelerate_particle_block(in_particles, out_particles, delta, begin, end, potential_data);
+        });
+    }
+    auto ts4 = std::chrono::steady_clock::now();
+
+    // Merging moves particles to new indexes, so the next frame needs a new tree.
+    Particle::merge_collisions(in_particles, out_particles, collisions);
+    if (out_particles.size() != in_particles.size())
+        built_count = 0;
+    auto ts5 = std::chrono::steady_clock::now();
+
+    last_timings.refit = std::chrono::duration<double>(ts2-ts1).count();
+    last_timings.build = std::chrono::duration<double>(ts3-ts2).count();
+    last_timings.walk = std::chrono::duration<double>(ts4-ts3).count();
+    last_timings.merge = std::chrono::duration<double>(ts5-ts4).count();
+    particles.swap(store);
+}
+
+extern template class Solver<2, SinglePrecision>;
+extern template class Solver<2, DoublePrecision>;
+extern template class Solver<2, MixedPrecision>;
+extern template class Solver<3, SinglePrecision>;
+extern template class Solver<3, DoublePrecision>;
+extern template class Solver<3, MixedPrecision>;
+
+}    // namespace tree